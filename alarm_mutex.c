@@ -3,105 +3,348 @@
  *
  * This is an enhancement to the alarm_thread.c program, which
  * created an "alarm thread" for each alarm command. This new
- * version uses a single alarm thread, which reads the next
- * entry in a list. The main thread places new requests onto the
- * list, in order of absolute expiration time. The list is
- * protected by a mutex, and the alarm thread sleeps for at
- * least 1 second, each iteration, to ensure that the main
- * thread can lock the mutex to add new work to the list.
+ * version uses a single alarm thread, which waits for the next
+ * due entry in a hierarchical timing wheel. The main thread
+ * places new requests onto the wheel in constant time. The wheel
+ * is protected by a mutex, and the alarm thread waits on a
+ * condition variable (rather than sleeping), so that the main
+ * thread can wake it up whenever a new alarm is due earlier than
+ * the one the alarm thread is currently waiting for. An alarm
+ * entered as "<time>*<count>" goes off every <time>, <count> times
+ * (for ever if the count is left out), and is put back on the
+ * wheel each time rather than freed.
  */
 #include <pthread.h>
 #include <time.h>
 #include "errors.h"
 
 /*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
- * enough, since the "alarm thread" cannot tell how long it has
- * been on the list.
+ * The "alarm" structure now contains the absolute expiration time
+ * for each alarm, so that they can be placed into the timing
+ * wheel. Storing the requested duration would not be enough,
+ * since the "alarm thread" cannot tell how long it has been on
+ * the wheel. Expiration times are CLOCK_MONOTONIC nanoseconds, so
+ * that stepping the wall clock neither fires nor delays alarms.
  */
 typedef struct alarm_tag
 {
     struct alarm_tag *link;
-    int seconds;
-    time_t time; /* seconds from EPOCH */
+    int msecs;
+    int repeats;    /* times a recurring alarm still goes off, -1 for ever, 0 if one-shot */
+    long long time; /* CLOCK_MONOTONIC nanoseconds */
     char message[64];
 } alarm_t;
 
+/*
+ * Durations are printed the way they may be entered: in whole
+ * seconds ("5"), or in milliseconds ("250ms") when they are not a
+ * whole number of seconds.
+ */
+#define DURATION_FMT        "%d%s"
+#define DURATION_ARGS(ms)   ((ms) % 1000 ? (ms) : (ms) / 1000), ((ms) % 1000 ? "ms" : "")
+
+/*
+ * Hierarchical timing wheel. Each level has WHEEL_SLOTS slots,
+ * and each slot of level n covers WHEEL_SLOTS^n ticks. An alarm
+ * is hashed into the lowest level whose span still covers its
+ * distance from "now"; every time level 0 wraps around, the next
+ * slot of level 1 is "cascaded" (re-hashed) into level 0, and so
+ * on upward. Insertion and expiry are both O(1), and an alarm is
+ * never fired more than one tick late.
+ */
+#define WHEEL_TICK_NS   10000000LL  /* 10 milliseconds */
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS    5
+
+/*
+ * The tick in which an alarm is due, rounded up so that an alarm
+ * is never fired before its expiration time.
+ */
+#define WHEEL_TICK(ns)  (((ns) + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS)
+
+typedef struct wheel_tag
+{
+    long long now;      /* next tick to be processed */
+    int count;          /* alarms currently on the wheel */
+    alarm_t *slot[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel_t;
+
 pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-alarm_t *alarm_list = NULL;
+pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
+wheel_t alarm_wheel;
+long long alarm_wait_until = 0; /* tick; 0 means "waiting for any alarm" */
+
+long long monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+ * Parse a duration of whole seconds ("5") or milliseconds
+ * ("250ms") into milliseconds. Returns -1 if it is neither.
+ */
+int parse_duration(const char *text, int *msecs)
+{
+    char *end;
+    long value = strtol(text, &end, 10);
+
+    if (end == text || value < 0 || value > 2000000000L)
+        return -1;
+    if (strcmp(end, "ms") == 0)
+        *msecs = (int)value;
+    else if (*end == '\0' && value <= 2000000L)
+        *msecs = (int)value * 1000;
+    else
+        return -1;
+    return 0;
+}
+
+/*
+ * Split a recurring alarm's "<time>*<count>", or "<time>*" for
+ * ever, at the '*', and set how many times it goes off: -1 for
+ * ever, 0 for a one-shot alarm without a '*'. Returns -1 if the
+ * count is not a positive number.
+ */
+int parse_repeats(char *text, int *repeats)
+{
+    char *star = strchr(text, '*'), *end;
+    long value;
+
+    *repeats = 0;
+    if (star == NULL)
+        return 0;
+    *star++ = '\0';
+    if (*star == '\0')
+    {
+        *repeats = -1;
+        return 0;
+    }
+    value = strtol(star, &end, 10);
+    if (*end != '\0' || value <= 0 || value > 1000000000L)
+        return -1;
+    *repeats = (int)value;
+    return 0;
+}
+
+/*
+ * Set a recurring alarm that has gone off to its next time, a whole
+ * number of periods after its first, so that it does not drift.
+ * Times it was already due again are skipped and counted against
+ * those it has left. Returns 0 when it has gone off for the last
+ * time.
+ */
+int alarm_rearm(alarm_t *alarm, long long now)
+{
+    long long period = alarm->msecs * 1000000LL;
+    long long due;
+
+    if (alarm->repeats == 0)
+        return 0;
+    due = (now - alarm->time) / period + 1;
+    if (alarm->repeats > 0 && alarm->repeats <= due)
+        return 0;
+    if (alarm->repeats > 0)
+        alarm->repeats -= (int)due;
+    alarm->time += due * period;
+    return 1;
+}
+
+/*
+ * Hash an alarm into the wheel, relative to the wheel's current
+ * tick. Alarms that are already due go into the slot for the
+ * current tick; alarms beyond the wheel's range are parked at the
+ * far end of the top level and re-hashed when they cascade down.
+ */
+void wheel_insert(wheel_t *wheel, alarm_t *alarm)
+{
+    long long expires = WHEEL_TICK(alarm->time);
+    long long delta = expires - wheel->now;
+    alarm_t **slot;
+    int level = 0;
+
+    if (delta < 0)
+        expires = wheel->now;
+    else
+    {
+        if (delta >= (1LL << (WHEEL_BITS * WHEEL_LEVELS)))
+        {
+            delta = (1LL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+            expires = wheel->now + delta;
+        }
+        while (level < WHEEL_LEVELS - 1 && delta >= (1LL << (WHEEL_BITS * (level + 1))))
+            level++;
+    }
+
+    slot = &wheel->slot[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    alarm->link = *slot;
+    *slot = alarm;
+}
+
+/*
+ * Move every alarm in one slot of a higher level down into the
+ * lower levels, and return the slot index that was cascaded.
+ */
+int wheel_cascade(wheel_t *wheel, int level)
+{
+    int index = (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    alarm_t *alarm = wheel->slot[level][index];
+    alarm_t *next;
+
+    wheel->slot[level][index] = NULL;
+    while (alarm != NULL)
+    {
+        next = alarm->link;
+        wheel_insert(wheel, alarm);
+        alarm = next;
+    }
+    return index;
+}
+
+/*
+ * Advance the wheel up to, and including, tick "target", and
+ * return the list of alarms that became due on the way.
+ */
+alarm_t *wheel_advance(wheel_t *wheel, long long target)
+{
+    alarm_t *expired = NULL, *alarm, *next;
+    int index, level;
+
+    //an empty wheel has nothing to cascade, so it can jump ahead
+    if (wheel->count == 0 && wheel->now <= target)
+        wheel->now = target + 1;
+    while (wheel->now <= target)
+    {
+        index = wheel->now & WHEEL_MASK;
+        for (level = 1; index == 0 && level < WHEEL_LEVELS; level++)
+            index = wheel_cascade(wheel, level);
+
+        index = wheel->now & WHEEL_MASK;
+        alarm = wheel->slot[0][index];
+        wheel->slot[0][index] = NULL;
+        while (alarm != NULL)
+        {
+            next = alarm->link;
+            alarm->link = expired;
+            expired = alarm;
+            wheel->count--;
+            alarm = next;
+        }
+        wheel->now++;
+    }
+    return expired;
+}
+
+/*
+ * Return the earliest tick at which the wheel may have something
+ * to fire. If level 0 holds nothing, nothing can become due until
+ * level 0 wraps around and the higher levels are cascaded, so the
+ * wrap-around tick is a safe (if early) answer.
+ */
+long long wheel_next(wheel_t *wheel)
+{
+    long long tick = wheel->now;
+
+    if ((tick & WHEEL_MASK) == 0)
+        return tick;
+    do
+    {
+        if (wheel->slot[0][tick & WHEEL_MASK] != NULL)
+            return tick;
+        tick++;
+    } while ((tick & WHEEL_MASK) != 0);
+    return tick;
+}
 
 /*
  * The alarm thread's start routine.
  */
 void *alarm_thread(void *arg)
 {
-    alarm_t *alarm;
-    int sleep_time;
-    time_t now;
+    alarm_t *alarm, *next, *rearmed;
+    struct timespec cond_time;
+    long long now;
     int status;
 
     /*
      * Loop forever, processing commands. The alarm thread will
      * be disintegrated when the process exits.
      */
+    status = pthread_mutex_lock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
     while (1)
     {
-        status = pthread_mutex_lock(&alarm_mutex);
-        if (status != 0)
-            err_abort(status, "Lock mutex");
-        alarm = alarm_list;
+        now = monotonic_ns() / WHEEL_TICK_NS;
+        alarm = wheel_advance(&alarm_wheel, now);
 
         /*
-         * If the alarm list is empty, wait for one second. This
-         * allows the main thread to run, and read another
-         * command. If the list is not empty, remove the first
-         * item. Compute the number of seconds to wait -- if the
-         * result is less than 0 (the time has passed), then set
-         * the sleep_time to 0.
+         * If timers expired, unlock the mutex so that the main
+         * thread can keep inserting while we print the messages
+         * and free the structures. Recurring alarms with times
+         * left are kept, and go back on the wheel once it is
+         * locked again.
          */
-        if (alarm == NULL)
-            sleep_time = 1;
-        else
+        if (alarm != NULL)
         {
-            alarm_list = alarm->link;
-            now = time(NULL);
-            if (alarm->time <= now)
-                sleep_time = 0;
-            else
-                sleep_time = alarm->time - now;
-#ifdef DEBUG
-            printf("[waiting: %d(%d)\"%s\"]\n", alarm->time,
-                   sleep_time, alarm->message);
-#endif
+            status = pthread_mutex_unlock(&alarm_mutex);
+            if (status != 0)
+                err_abort(status, "Unlock mutex");
+            rearmed = NULL;
+            while (alarm != NULL)
+            {
+                next = alarm->link;
+                printf("(" DURATION_FMT ") %s\n", DURATION_ARGS(alarm->msecs), alarm->message);
+                if (alarm_rearm(alarm, monotonic_ns()))
+                {
+                    alarm->link = rearmed;
+                    rearmed = alarm;
+                }
+                else
+                    free(alarm);
+                alarm = next;
+            }
+            status = pthread_mutex_lock(&alarm_mutex);
+            if (status != 0)
+                err_abort(status, "Lock mutex");
+            while (rearmed != NULL)
+            {
+                next = rearmed->link;
+                wheel_insert(&alarm_wheel, rearmed);
+                alarm_wheel.count++;
+                rearmed = next;
+            }
+            continue;
         }
 
         /*
-         * Unlock the mutex before waiting, so that the main
-         * thread can lock it to insert a new alarm request. If
-         * the sleep_time is 0, then call sched_yield, giving
-         * the main thread a chance to run if it has been
-         * readied by user input, without delaying the message
-         * if there's no input.
+         * Nothing is due yet. Wait until the next tick that may
+         * hold an alarm, or indefinitely if the wheel is empty.
+         * The main thread signals alarm_cond when it inserts an
+         * alarm due before alarm_wait_until.
          */
-        status = pthread_mutex_unlock(&alarm_mutex);
-        if (status != 0)
-            err_abort(status, "Unlock mutex");
-        if (sleep_time > 0)
-            sleep(sleep_time);
+        if (alarm_wheel.count == 0)
+        {
+            alarm_wait_until = 0;
+            status = pthread_cond_wait(&alarm_cond, &alarm_mutex);
+        }
         else
-            sched_yield();
-
-        /*
-         * If a timer expired, print the message and free the
-         * structure.
-         */
-        if (alarm != NULL)
         {
-            printf("(%d) %s\n", alarm->seconds, alarm->message);
-            free(alarm);
+            alarm_wait_until = wheel_next(&alarm_wheel);
+            cond_time.tv_sec = alarm_wait_until * WHEEL_TICK_NS / 1000000000LL;
+            cond_time.tv_nsec = alarm_wait_until * WHEEL_TICK_NS % 1000000000LL;
+#ifdef DEBUG
+            printf("[waiting: %lld(%lld)]\n", alarm_wait_until,
+                   alarm_wait_until - now);
+#endif
+            status = pthread_cond_timedwait(&alarm_cond, &alarm_mutex, &cond_time);
         }
+        if (status != 0 && status != ETIMEDOUT)
+            err_abort(status, "Wait on cond");
     }
 }
 
@@ -110,9 +353,26 @@ int main(int argc, char *argv[])
 {
     int status;
     char line[128];
-    alarm_t *alarm, **last, *next;
+    char duration[16];
+    alarm_t *alarm;
+    long long now;
     pthread_t thread;
+    pthread_condattr_t cond_attr;
 
+    /*
+     * The alarm thread's timed waits are measured against the
+     * same monotonic clock as the alarm expiration times.
+     */
+    status = pthread_condattr_init(&cond_attr);
+    if (status == 0)
+        status = pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    if (status == 0)
+        status = pthread_cond_init(&alarm_cond, &cond_attr);
+    if (status != 0)
+        err_abort(status, "Init cond");
+    pthread_condattr_destroy(&cond_attr);
+
+    alarm_wheel.now = monotonic_ns() / WHEEL_TICK_NS;
 
     status = pthread_create(&thread, NULL, alarm_thread, NULL); //Start of alarm_thread
 
@@ -131,11 +391,16 @@ int main(int argc, char *argv[])
             errno_abort("Allocate alarm");
 
         /*
-         * Parse input line into seconds (%d) and a message
-         * (%64[^\n]), consisting of up to 64 characters
-         * separated from the seconds by whitespace.
+         * Parse input line into a duration (%15s), in seconds or
+         * in milliseconds with an "ms" suffix and, for a recurring
+         * alarm, followed by "*" and an optional count, and a
+         * message (%63[^\n]), consisting of up to 63 characters
+         * separated from the duration by whitespace.
          */
-        if (sscanf(line, "%d %64[^\n]", &alarm->seconds, alarm->message) < 2)
+        if (sscanf(line, "%15s %63[^\n]", duration, alarm->message) < 2 ||
+            parse_repeats(duration, &alarm->repeats) != 0 ||
+            parse_duration(duration, &alarm->msecs) != 0 ||
+            (alarm->repeats != 0 && alarm->msecs == 0))
         {
             fprintf(stderr, "Bad command\n");
             free(alarm);
@@ -146,43 +411,37 @@ int main(int argc, char *argv[])
             if (status != 0)
                 err_abort(status, "Lock mutex");
 
-            //Alarm will go off in (EPOCH + user_entered_time)
-            alarm->time = time(NULL) + alarm->seconds;
+            //Alarm will go off in (now + user_entered_time)
+            now = monotonic_ns();
+            alarm->time = now + alarm->msecs * 1000000LL;
 
             /*
-             * Insert the new alarm into the list of alarms,
-             * sorted by expiration time.
+             * The alarm thread does not advance an empty wheel, so
+             * after an idle spell the wheel's tick is stale. Bring
+             * it up to date first, so that the alarm is hashed
+             * relative to the current tick and the next advance
+             * does not walk every tick of the idle spell.
              */
-            last = &alarm_list;
-            next = *last;
-            while (next != NULL)
-            {
-                if (next->time >= alarm->time)
-                {
-                    alarm->link = next;
-                    *last = alarm;
-                    break;
-                }
-                last = &next->link;
-                next = next->link;
-            }
+            if (alarm_wheel.count == 0 && now / WHEEL_TICK_NS > alarm_wheel.now)
+                alarm_wheel.now = now / WHEEL_TICK_NS;
+
             /*
-             * If we reached the end of the list, insert the new
-             * alarm there. ("next" is NULL, and "last" points
-             * to the link field of the last item, or to the
-             * list header).
+             * Hash the new alarm into the timing wheel. If the
+             * alarm thread is waiting for a later tick (or for
+             * any alarm at all), wake it so it can recompute how
+             * long to wait.
              */
-            if (next == NULL)
+            wheel_insert(&alarm_wheel, alarm);
+            alarm_wheel.count++;
+            if (alarm_wait_until == 0 || WHEEL_TICK(alarm->time) < alarm_wait_until)
             {
-                *last = alarm;
-                alarm->link = NULL;
+                status = pthread_cond_signal(&alarm_cond);
+                if (status != 0)
+                    err_abort(status, "Signal cond");
             }
 #ifdef DEBUG
-            printf("[list: ");
-            for (next = alarm_list; next != NULL; next = next->link)
-                printf("%d(%d)[\"%s\"] ", next->time,
-                       next->time - time(NULL), next->message);
-            printf("]\n");
+            printf("[wheel: now %lld, %d alarms]\n",
+                   alarm_wheel.now, alarm_wheel.count);
 #endif
             status = pthread_mutex_unlock(&alarm_mutex);
             if (status != 0)
@@ -0,0 +1,824 @@
+/*
+ * alarm_store.h
+ *
+ * The alarm list of new_alarm_mutex.c, kept apart from the rest of
+ * the program so that the benchmarks can drive it directly.
+ *
+ * The store is partitioned into shards by alarm id. Each shard has
+ * its own mutex, id hash table and expiration heap, so commands on
+ * alarms in different shards never wait for each other. A store
+ * with a single shard behaves like the original one-lock list.
+ * Each shard also keeps two secondary indexes for the bulk
+ * commands: its alarms ordered by id, and listed by type.
+ *
+ * Readers that only list or count the alarms (View_Alarms and
+ * Stats) take no shard lock. Each hash table, and each alarm's
+ * printable fields, carry a sequence count that writers make odd
+ * while they change them; a reader copies, then retries if the
+ * count moved. Removed alarms and outgrown tables are freed through
+ * epoch.h, so whatever a reader copied stays allocated.
+ */
+#ifndef __alarm_store_h
+#define __alarm_store_h
+
+#include <pthread.h>
+#include "errors.h"
+#include "stats.h"
+#include "epoch.h"
+
+#define ALARM_READ_RETRIES  8       /* optimistic reads before taking the lock */
+
+/*
+ * The "alarm" structure now contains the absolute expiration time
+ * for each alarm, so that they can be sorted. Storing the
+ * requested duration would not be enough, since the "alarm
+ * thread" cannot tell how long it has been on the list.
+ * Expiration times are CLOCK_MONOTONIC nanoseconds, so that
+ * stepping the wall clock neither fires nor delays alarms. An alarm
+ * may go off at any time from "time" to "latest", its slack later,
+ * which lets the expiry sweep take alarms due close together in one
+ * pass: the sweep runs by the earliest "latest" in the store, and
+ * then takes every alarm whose "time" has come.
+ *
+ * The fields that commands and the expiry sweep look at come first,
+ * and fit in the first cache line; the links of the secondary
+ * indexes and of the periodic prints follow. The message text is
+ * kept apart, in message_arena.h, and is replaced rather than
+ * written over, so a lock-free reader always finds it whole.
+ */
+typedef struct alarm_tag {
+    long long           time;   /* CLOCK_MONOTONIC nanoseconds */
+    long long           latest; /* time plus its slack; orders the heap */
+    int                 id;
+    int                 type;   /* interned, see type_intern.h */
+    int                 msecs;  /* requested duration, the period of a recurring alarm */
+    int                 repeats;    /* times a recurring alarm still goes off, -1 for ever, 0 if one-shot */
+    int                 heap_index; /* position in its shard's heap, -1 if not queued */
+    int                 held;       /* display thread slots holding it, the stale ones too */
+    atomic_uint         version;    /* odd while type, time and message change */
+    unsigned char       cancelled;
+    unsigned char       expired;    /* removed from the alarm list by the expiry sweep */
+    unsigned char       pending;    /* on the command ring, waiting for the alarm thread */
+    struct display_thread_node *display; /* display thread the alarm is assigned to */
+    _Atomic(char *)     message;    /* in the message arena */
+
+    struct alarm_tag    *periodic_prev; /* links in its periodic print bucket */
+    struct alarm_tag    *periodic_next;
+    long long           periodic_tick;  /* tick of its next periodic print, 0 if none */
+    struct alarm_tag    *id_left;   /* children in its shard's id treap */
+    struct alarm_tag    *id_right;
+    struct alarm_tag    *type_prev; /* links in its shard's list of its type */
+    struct alarm_tag    *type_next;
+    int                 due_index;  /* position in its shard's heap of alarms with slack, -1 if none */
+} alarm_t;
+
+_Static_assert(sizeof(alarm_t) <= 128, "an alarm takes at most two cache lines");
+
+/*
+ * How many milliseconds after its time an alarm may go off.
+ */
+static inline int alarm_slack(const alarm_t *alarm)
+{
+    return (int)((alarm->latest - alarm->time) / 1000000);
+}
+
+/*
+ * The alarm list is kept as two indexes over the same alarm_t
+ * nodes: an open-addressing hash table keyed by alarm id, so that
+ * Change_Alarm and Cancel_Alarm find their alarm in O(1), and a
+ * binary min-heap ordered by the latest time each alarm may go off,
+ * so that the expiry sweep only ever looks at alarms that are
+ * actually due. Alarms with slack are also kept in a second heap,
+ * ordered by their time, so that a sweep run for one alarm's latest
+ * time also finds those whose time has come but whose latest is
+ * further off. Listing the alarms in id order is done on demand by
+ * sorting a snapshot of the hash table.
+ */
+typedef struct alarm_hash_tag {
+    alarm_t             **slots;
+    int                 capacity;   /* always a power of two */
+    int                 count;
+    atomic_uint         version;    /* odd while the table changes */
+} alarm_hash_t;
+
+/*
+ * The fields of an alarm that View_Alarms prints, copied out.
+ */
+typedef struct alarm_copy_tag {
+    int                 id;
+    int                 type;
+    int                 msecs;
+    char                message[128];
+} alarm_copy_t;
+
+/*
+ * Writers bracket a change with these, with the shard locked.
+ */
+static inline void alarm_version_begin(atomic_uint *version)
+{
+    atomic_store_explicit(version, atomic_load_explicit(version, memory_order_relaxed) + 1,
+        memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void alarm_version_end(atomic_uint *version)
+{
+    atomic_store_explicit(version, atomic_load_explicit(version, memory_order_relaxed) + 1,
+        memory_order_release);
+}
+
+typedef struct alarm_heap_tag {
+    alarm_t             **nodes;
+    int                 capacity;
+    int                 count;
+    int                 by_time;    /* ordered by time, through due_index, rather than by latest */
+} alarm_heap_t;
+
+/*
+ * The secondary indexes let Cancel_Range, Cancel_Type and
+ * Change_Type find their alarms at a cost proportional to how many
+ * there are, rather than by a walk of the whole store. "by_id" is a
+ * treap keyed by alarm id, whose priorities are a hash of the id, so
+ * its shape is that of a random binary search tree whatever order
+ * ids arrive in; "by_type" heads a doubly linked list of the alarms
+ * of each interned type. Both are kept only under the shard lock.
+ */
+typedef struct alarm_shard_tag {
+    pthread_mutex_t     lock;       /* protects hash, heap, indexes, and alarms' times and flags */
+    alarm_hash_t        hash;
+    alarm_heap_t        heap;
+    alarm_heap_t        due;        /* the alarms with slack, by time */
+    alarm_t             *by_id;     /* root of the id treap */
+    alarm_t             **by_type;  /* first alarm of each type, indexed by type */
+    int                 types;      /* entries in by_type */
+    long long           locked_at;  /* when the holder's sampled lock was taken, see stats.h */
+} alarm_shard_t;
+
+typedef struct alarm_store_tag {
+    int                 shards;
+    alarm_shard_t       *shard;
+} alarm_store_t;
+
+/*
+ * The table slot of an alarm id: the murmur3 finalizer, masked. The
+ * low bits of a Fibonacci hash would do for one table, but those of
+ * id * 2654435769 from bit 16 up also pick the shard (see
+ * alarm_store_shard), so in a shard's table of 2^17 slots or more
+ * they would be the same for every id, and whole runs of slots never
+ * be any id's home; linear probing then goes quadratic past a
+ * million alarms or so.
+ */
+static inline unsigned int alarm_hash_slot(int id, int capacity)
+{
+    unsigned int hash = (unsigned int)id;
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash & (unsigned int)(capacity - 1);
+}
+
+static inline alarm_t *alarm_hash_find(alarm_hash_t *hash, int id)
+{
+    unsigned int slot;
+
+    if (hash->count == 0)
+        return NULL;
+    for (slot = alarm_hash_slot(id, hash->capacity);
+         hash->slots[slot] != NULL;
+         slot = (slot + 1) & (hash->capacity - 1))
+        if (hash->slots[slot]->id == id)
+            return hash->slots[slot];
+    return NULL;
+}
+
+static inline void alarm_hash_place(alarm_hash_t *hash, alarm_t *alarm)
+{
+    unsigned int slot = alarm_hash_slot(alarm->id, hash->capacity);
+
+    while (hash->slots[slot] != NULL)
+        slot = (slot + 1) & (hash->capacity - 1);
+    hash->slots[slot] = alarm;
+}
+
+/*
+ * Insert an alarm, doubling the table whenever it would become
+ * more than half full so that probe sequences stay short.
+ */
+static inline void alarm_hash_insert(alarm_hash_t *hash, alarm_t *alarm)
+{
+    alarm_t **old_slots = hash->slots, **slots;
+    int old_capacity = hash->capacity;
+    int i;
+
+    alarm_version_begin(&hash->version);
+    if ((hash->count + 1) * 2 > hash->capacity) {
+        slots = calloc(old_capacity ? old_capacity * 2 : 64, sizeof(alarm_t *));
+        if (slots == NULL)
+            errno_abort ("Allocate alarm hash");
+        //a reader may pair the new table with the old capacity, never the reverse
+        hash->slots = slots;
+        atomic_thread_fence(memory_order_release);
+        hash->capacity = old_capacity ? old_capacity * 2 : 64;
+        for (i = 0; i < old_capacity; i++)
+            if (old_slots[i] != NULL)
+                alarm_hash_place(hash, old_slots[i]);
+        if (old_slots != NULL)
+            epoch_retire(old_slots, free);
+    }
+    alarm_hash_place(hash, alarm);
+    hash->count++;
+    alarm_version_end(&hash->version);
+}
+
+/*
+ * Remove an alarm by id. Linear probing needs no tombstones if the
+ * entries following the hole are shifted back into it.
+ */
+static inline alarm_t *alarm_hash_remove(alarm_hash_t *hash, int id)
+{
+    unsigned int mask = hash->capacity - 1;
+    unsigned int slot, next, home;
+    alarm_t *alarm;
+
+    if (hash->count == 0)
+        return NULL;
+    for (slot = alarm_hash_slot(id, hash->capacity);
+         hash->slots[slot] != NULL && hash->slots[slot]->id != id;
+         slot = (slot + 1) & mask)
+        ;
+    alarm = hash->slots[slot];
+    if (alarm == NULL)
+        return NULL;
+
+    alarm_version_begin(&hash->version);
+    hash->slots[slot] = NULL;
+    for (next = (slot + 1) & mask; hash->slots[next] != NULL; next = (next + 1) & mask) {
+        home = alarm_hash_slot(hash->slots[next]->id, hash->capacity);
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            hash->slots[slot] = hash->slots[next];
+            hash->slots[next] = NULL;
+            slot = next;
+        }
+    }
+    hash->count--;
+    alarm_version_end(&hash->version);
+    return alarm;
+}
+
+static inline long long alarm_heap_key(const alarm_heap_t *heap, const alarm_t *alarm)
+{
+    return heap->by_time ? alarm->time : alarm->latest;
+}
+
+static inline int *alarm_heap_index(const alarm_heap_t *heap, alarm_t *alarm)
+{
+    return heap->by_time ? &alarm->due_index : &alarm->heap_index;
+}
+
+static inline void alarm_heap_set(alarm_heap_t *heap, int index, alarm_t *alarm)
+{
+    heap->nodes[index] = alarm;
+    *alarm_heap_index(heap, alarm) = index;
+}
+
+static inline void alarm_heap_up(alarm_heap_t *heap, int index)
+{
+    alarm_t *alarm = heap->nodes[index];
+    long long key = alarm_heap_key(heap, alarm);
+    int parent;
+
+    while (index > 0) {
+        parent = (index - 1) / 2;
+        if (alarm_heap_key(heap, heap->nodes[parent]) <= key)
+            break;
+        alarm_heap_set(heap, index, heap->nodes[parent]);
+        index = parent;
+    }
+    alarm_heap_set(heap, index, alarm);
+}
+
+static inline void alarm_heap_down(alarm_heap_t *heap, int index)
+{
+    alarm_t *alarm = heap->nodes[index];
+    long long key = alarm_heap_key(heap, alarm);
+    int child;
+
+    while ((child = 2 * index + 1) < heap->count) {
+        if (child + 1 < heap->count
+                && alarm_heap_key(heap, heap->nodes[child + 1]) < alarm_heap_key(heap, heap->nodes[child]))
+            child++;
+        if (key <= alarm_heap_key(heap, heap->nodes[child]))
+            break;
+        alarm_heap_set(heap, index, heap->nodes[child]);
+        index = child;
+    }
+    alarm_heap_set(heap, index, alarm);
+}
+
+static inline void alarm_heap_push(alarm_heap_t *heap, alarm_t *alarm)
+{
+    if (heap->count == heap->capacity) {
+        heap->capacity = heap->capacity ? heap->capacity * 2 : 64;
+        heap->nodes = realloc(heap->nodes, heap->capacity * sizeof(alarm_t *));
+        if (heap->nodes == NULL)
+            errno_abort ("Allocate alarm heap");
+    }
+    alarm_heap_set(heap, heap->count++, alarm);
+    alarm_heap_up(heap, heap->count - 1);
+}
+
+/*
+ * Remove an arbitrary alarm from the heap, by moving the last node
+ * into its position and restoring the heap order from there.
+ */
+static inline void alarm_heap_remove(alarm_heap_t *heap, alarm_t *alarm)
+{
+    int index = *alarm_heap_index(heap, alarm);
+    alarm_t *last;
+
+    if (index < 0)
+        return;
+    *alarm_heap_index(heap, alarm) = -1;
+    last = heap->nodes[--heap->count];
+    if (index == heap->count)
+        return;
+    alarm_heap_set(heap, index, last);
+    alarm_heap_up(heap, index);
+    alarm_heap_down(heap, *alarm_heap_index(heap, last));
+}
+
+/*
+ * Re-establish the heap order after an alarm's expiration time
+ * and slack were changed in place.
+ */
+static inline void alarm_heap_update(alarm_heap_t *heap, alarm_t *alarm)
+{
+    alarm_heap_up(heap, *alarm_heap_index(heap, alarm));
+    alarm_heap_down(heap, *alarm_heap_index(heap, alarm));
+}
+
+static inline alarm_t *alarm_heap_top(alarm_heap_t *heap)
+{
+    return heap->count > 0 ? heap->nodes[0] : NULL;
+}
+
+/*
+ * The treap priority of an alarm id: the murmur3 finalizer, so that
+ * consecutive ids get unrelated priorities.
+ */
+static inline unsigned int alarm_tree_priority(int id)
+{
+    unsigned int hash = (unsigned int)id;
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    return hash ^ (hash >> 16);
+}
+
+/*
+ * Split a treap into the alarms with ids below "id" and those above
+ * it. Ids are unique, so there is none equal to it.
+ */
+static inline void alarm_tree_split(alarm_t *node, int id, alarm_t **below, alarm_t **above)
+{
+    while (node != NULL) {
+        if (node->id < id) {
+            *below = node;
+            below = &node->id_right;
+            node = node->id_right;
+        } else {
+            *above = node;
+            above = &node->id_left;
+            node = node->id_left;
+        }
+    }
+    *below = *above = NULL;
+}
+
+/*
+ * Join two treaps, every id in "below" being less than every id in
+ * "above".
+ */
+static inline alarm_t *alarm_tree_join(alarm_t *below, alarm_t *above)
+{
+    alarm_t *root = NULL, **link = &root;
+
+    while (below != NULL && above != NULL) {
+        if (alarm_tree_priority(below->id) > alarm_tree_priority(above->id)) {
+            *link = below;
+            link = &below->id_right;
+            below = below->id_right;
+        } else {
+            *link = above;
+            link = &above->id_left;
+            above = above->id_left;
+        }
+    }
+    *link = below != NULL ? below : above;
+    return root;
+}
+
+static inline void alarm_tree_insert(alarm_t **root, alarm_t *alarm)
+{
+    unsigned int priority = alarm_tree_priority(alarm->id);
+
+    while (*root != NULL && alarm_tree_priority((*root)->id) >= priority)
+        root = alarm->id < (*root)->id ? &(*root)->id_left : &(*root)->id_right;
+    alarm_tree_split(*root, alarm->id, &alarm->id_left, &alarm->id_right);
+    *root = alarm;
+}
+
+static inline void alarm_tree_remove(alarm_t **root, alarm_t *alarm)
+{
+    while (*root != alarm)
+        root = alarm->id < (*root)->id ? &(*root)->id_left : &(*root)->id_right;
+    *root = alarm_tree_join(alarm->id_left, alarm->id_right);
+    alarm->id_left = alarm->id_right = NULL;
+}
+
+/*
+ * Append the alarms of a treap with ids from "first" to "last", in
+ * id order, to "*list", which holds "*used" of "*size" entries and
+ * is grown as needed. Only the subtrees that can hold such ids are
+ * visited.
+ */
+static inline void alarm_tree_range(alarm_t *node, int first, int last, alarm_t ***list, int *used, int *size)
+{
+    while (node != NULL) {
+        if (node->id > first)
+            alarm_tree_range(node->id_left, first, last, list, used, size);
+        if (node->id >= first && node->id <= last) {
+            if (*used == *size) {
+                *size = *size ? *size * 2 : 64;
+                *list = realloc(*list, *size * sizeof(alarm_t *));
+                if (*list == NULL)
+                    errno_abort ("Allocate alarm range");
+            }
+            (*list)[(*used)++] = node;
+        }
+        if (node->id >= last)
+            return;
+        node = node->id_right;
+    }
+}
+
+/*
+ * Add an alarm to the list of its type, growing the list heads to
+ * cover every type interned so far.
+ */
+static inline void alarm_type_link(alarm_shard_t *shard, alarm_t *alarm)
+{
+    alarm_t **by_type;
+    int types;
+
+    if (alarm->type >= shard->types) {
+        types = shard->types ? shard->types : 16;
+        while (types <= alarm->type)
+            types *= 2;
+        by_type = realloc(shard->by_type, types * sizeof(alarm_t *));
+        if (by_type == NULL)
+            errno_abort ("Allocate alarm type index");
+        memset(by_type + shard->types, 0, (types - shard->types) * sizeof(alarm_t *));
+        shard->by_type = by_type;
+        shard->types = types;
+    }
+    alarm->type_prev = NULL;
+    alarm->type_next = shard->by_type[alarm->type];
+    if (alarm->type_next != NULL)
+        alarm->type_next->type_prev = alarm;
+    shard->by_type[alarm->type] = alarm;
+}
+
+static inline void alarm_type_unlink(alarm_shard_t *shard, alarm_t *alarm)
+{
+    if (alarm->type_prev != NULL)
+        alarm->type_prev->type_next = alarm->type_next;
+    else
+        shard->by_type[alarm->type] = alarm->type_next;
+    if (alarm->type_next != NULL)
+        alarm->type_next->type_prev = alarm->type_prev;
+    alarm->type_prev = alarm->type_next = NULL;
+}
+
+/*
+ * The first alarm of a type in a shard, or NULL.
+ */
+static inline alarm_t *alarm_type_first(alarm_shard_t *shard, int type)
+{
+    return type < shard->types ? shard->by_type[type] : NULL;
+}
+
+/*
+ * Queue an alarm in its shard's heaps after its time or slack was
+ * set, whether or not it is queued already: by its latest time, and
+ * by its time as well if it has slack. Called with the shard locked.
+ */
+static inline void alarm_shard_requeue(alarm_shard_t *shard, alarm_t *alarm)
+{
+    if (alarm->heap_index < 0)
+        alarm_heap_push(&shard->heap, alarm);
+    else
+        alarm_heap_update(&shard->heap, alarm);
+    if (alarm->latest == alarm->time)
+        alarm_heap_remove(&shard->due, alarm);
+    else if (alarm->due_index < 0)
+        alarm_heap_push(&shard->due, alarm);
+    else
+        alarm_heap_update(&shard->due, alarm);
+}
+
+/*
+ * Add an alarm to every index of its shard, or take it out of all
+ * of them. Called with the shard locked.
+ */
+static inline void alarm_shard_insert(alarm_shard_t *shard, alarm_t *alarm)
+{
+    alarm_hash_insert(&shard->hash, alarm);
+    alarm_shard_requeue(shard, alarm);
+    alarm_tree_insert(&shard->by_id, alarm);
+    alarm_type_link(shard, alarm);
+}
+
+static inline void alarm_shard_remove(alarm_shard_t *shard, alarm_t *alarm)
+{
+    alarm_heap_remove(&shard->heap, alarm);
+    alarm_heap_remove(&shard->due, alarm);
+    alarm_hash_remove(&shard->hash, alarm->id);
+    alarm_tree_remove(&shard->by_id, alarm);
+    alarm_type_unlink(shard, alarm);
+}
+
+static inline int alarm_id_compare(const void *a, const void *b)
+{
+    int id_a = (*(alarm_t * const *)a)->id;
+    int id_b = (*(alarm_t * const *)b)->id;
+
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+static inline void alarm_store_init(alarm_store_t *store, int shards)
+{
+    int status, i;
+
+    store->shards = shards;
+    store->shard = calloc(shards, sizeof(alarm_shard_t));
+    if (store->shard == NULL)
+        errno_abort ("Allocate alarm shards");
+    for (i = 0; i < shards; i++) {
+        status = pthread_mutex_init(&store->shard[i].lock, NULL);
+        if (status != 0)
+            err_abort (status, "Init mutex");
+        store->shard[i].due.by_time = 1;
+    }
+}
+
+/*
+ * Free every alarm still in the store, and the store itself.
+ */
+static inline void alarm_store_destroy(alarm_store_t *store)
+{
+    alarm_shard_t *shard;
+    int i, j;
+
+    for (i = 0; i < store->shards; i++) {
+        shard = &store->shard[i];
+        for (j = 0; j < shard->hash.capacity; j++)
+            free(shard->hash.slots[j]);
+        free(shard->hash.slots);
+        free(shard->heap.nodes);
+        free(shard->due.nodes);
+        free(shard->by_type);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(store->shard);
+    store->shard = NULL;
+    store->shards = 0;
+}
+
+/*
+ * The shard an alarm id belongs to. The high bits of the Fibonacci
+ * hash are used, so that consecutive ids spread over the shards
+ * without correlating with their slots in the shard's hash table.
+ */
+static inline alarm_shard_t *alarm_store_shard(alarm_store_t *store, int id)
+{
+    return &store->shard[(((unsigned int)id * 2654435769u) >> 16) % store->shards];
+}
+
+/*
+ * Shard locks time their waits and holds for the runtime
+ * statistics (stats.h).
+ */
+static inline void alarm_shard_lock(alarm_shard_t *shard)
+{
+    long long locked_at = stats_lock(&shard->lock, STATS_ALARM_WAIT);
+
+    shard->locked_at = locked_at;
+}
+
+static inline void alarm_shard_unlock(alarm_shard_t *shard)
+{
+    long long locked_at = shard->locked_at;
+
+    shard->locked_at = 0;
+    stats_unlock(&shard->lock, STATS_ALARM_HOLD, locked_at);
+}
+
+/*
+ * Lock every shard, always in shard order, for operations that
+ * need a consistent view of the whole store. Anything that holds
+ * more than one shard lock takes them in shard order, so this
+ * cannot deadlock.
+ */
+static inline void alarm_store_lock_all(alarm_store_t *store)
+{
+    int i;
+
+    for (i = 0; i < store->shards; i++)
+        alarm_shard_lock(&store->shard[i]);
+}
+
+static inline void alarm_store_unlock_all(alarm_store_t *store)
+{
+    int i;
+
+    for (i = store->shards - 1; i >= 0; i--)
+        alarm_shard_unlock(&store->shard[i]);
+}
+
+/*
+ * The earliest time by which some alarm in the store must go off,
+ * its slack included, or 0 if the store is empty.
+ */
+static inline long long alarm_store_earliest(alarm_store_t *store)
+{
+    long long earliest = 0;
+    alarm_t *first;
+    int i;
+
+    for (i = 0; i < store->shards; i++) {
+        alarm_shard_lock(&store->shard[i]);
+        first = alarm_heap_top(&store->shard[i].heap);
+        if (first != NULL && (earliest == 0 || first->latest < earliest))
+            earliest = first->latest;
+        alarm_shard_unlock(&store->shard[i]);
+    }
+    return earliest;
+}
+
+/*
+ * Return a freshly allocated array of every alarm in the store,
+ * sorted by alarm id. Called with every shard locked; the caller
+ * frees the array.
+ */
+static inline alarm_t **alarm_store_by_id(alarm_store_t *store, int *count)
+{
+    alarm_hash_t *hash;
+    alarm_t **list;
+    int i, j, n = 0;
+
+    for (i = 0; i < store->shards; i++)
+        n += store->shard[i].hash.count;
+    list = malloc((n ? n : 1) * sizeof(alarm_t *));
+    if (list == NULL)
+        errno_abort ("Allocate alarm listing");
+    n = 0;
+    for (i = 0; i < store->shards; i++) {
+        hash = &store->shard[i].hash;
+        for (j = 0; j < hash->capacity; j++)
+            if (hash->slots[j] != NULL)
+                list[n++] = hash->slots[j];
+    }
+    qsort(list, n, sizeof(alarm_t *), alarm_id_compare);
+    *count = n;
+    return list;
+}
+
+/*
+ * Append the alarms in a shard's hash table to "*list", which holds
+ * "*used" of "*size" entries and is grown as needed, without taking
+ * the shard lock unless ALARM_READ_RETRIES copies in a row are spoiled
+ * by a writer. Called inside an epoch read section.
+ */
+static inline void alarm_shard_read(alarm_shard_t *shard, alarm_t ***list, int *used, int *size)
+{
+    alarm_hash_t *hash = &shard->hash;
+    alarm_t **slots, *alarm;
+    unsigned int version;
+    int attempt, capacity, found, i;
+
+    for (attempt = 0; ; attempt++) {
+        if (attempt == ALARM_READ_RETRIES)
+            alarm_shard_lock(shard);
+        //no writer is mid-change under the lock, so the locked copy never retries
+        version = atomic_load_explicit(&hash->version, memory_order_acquire);
+        if ((version & 1) && attempt < ALARM_READ_RETRIES)
+            continue;
+        capacity = hash->capacity;
+        atomic_thread_fence(memory_order_acquire);
+        slots = hash->slots;
+        if (*used + capacity > *size) {
+            *size = (*used + capacity) * 2;
+            *list = realloc(*list, *size * sizeof(alarm_t *));
+            if (*list == NULL)
+                errno_abort ("Allocate alarm listing");
+        }
+        found = 0;
+        for (i = 0; i < capacity; i++)
+            if ((alarm = slots[i]) != NULL)
+                (*list)[*used + found++] = alarm;
+        atomic_thread_fence(memory_order_acquire);
+        if (attempt == ALARM_READ_RETRIES) {
+            alarm_shard_unlock(shard);
+            break;
+        }
+        if (atomic_load_explicit(&hash->version, memory_order_relaxed) == version)
+            break;
+    }
+    *used += found;
+}
+
+/*
+ * Return a freshly allocated array of every alarm in the store,
+ * sorted by alarm id, like alarm_store_by_id but without holding
+ * the shard locks. Each shard is copied as it was at one moment,
+ * though not all the shards at the same moment.
+ * Called inside an epoch read section; the caller frees the array.
+ */
+static inline alarm_t **alarm_store_snapshot(alarm_store_t *store, int *count)
+{
+    alarm_t **list = NULL;
+    int used = 0, size = 0, i;
+
+    for (i = 0; i < store->shards; i++)
+        alarm_shard_read(&store->shard[i], &list, &used, &size);
+    if (list == NULL && (list = malloc(sizeof(alarm_t *))) == NULL)
+        errno_abort ("Allocate alarm listing");
+    qsort(list, used, sizeof(alarm_t *), alarm_id_compare);
+    *count = used;
+    return list;
+}
+
+/*
+ * The number of alarms in the store, without locking it.
+ */
+static inline int alarm_store_count(alarm_store_t *store)
+{
+    alarm_hash_t *hash;
+    unsigned int version;
+    int total = 0, count, i;
+
+    for (i = 0; i < store->shards; i++) {
+        hash = &store->shard[i].hash;
+        do {
+            version = atomic_load_explicit(&hash->version, memory_order_acquire);
+            count = hash->count;
+            atomic_thread_fence(memory_order_acquire);
+        } while ((version & 1) || atomic_load_explicit(&hash->version, memory_order_relaxed) != version);
+        total += count;
+    }
+    return total;
+}
+
+/*
+ * Copy the printable fields of an alarm, consistently, without
+ * taking its shard lock unless ALARM_READ_RETRIES copies in a row
+ * are spoiled by a Change_Alarm. Called inside an epoch read
+ * section.
+ */
+static inline void alarm_read(alarm_store_t *store, alarm_t *alarm, alarm_copy_t *copy)
+{
+    alarm_shard_t *shard = NULL;
+    unsigned int version;
+    const char *message;
+    int attempt, i;
+
+    for (attempt = 0; ; attempt++) {
+        if (attempt == ALARM_READ_RETRIES) {
+            shard = alarm_store_shard(store, alarm->id);
+            alarm_shard_lock(shard);
+        }
+        version = atomic_load_explicit(&alarm->version, memory_order_acquire);
+        if ((version & 1) && shard == NULL)
+            continue;
+        copy->id = alarm->id;
+        copy->type = alarm->type;
+        copy->msecs = alarm->msecs;
+        message = atomic_load_explicit(&alarm->message, memory_order_acquire);
+        for (i = 0; i < (int)sizeof(copy->message) - 1 && message[i] != '\0'; i++)
+            copy->message[i] = message[i];
+        copy->message[i] = '\0';
+        atomic_thread_fence(memory_order_acquire);
+        if (shard != NULL || atomic_load_explicit(&alarm->version, memory_order_relaxed) == version)
+            break;
+    }
+    if (shard != NULL)
+        alarm_shard_unlock(shard);
+}
+
+#endif
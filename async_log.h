@@ -0,0 +1,373 @@
+/*
+ * async_log.h
+ *
+ * Asynchronous standard output for new_alarm_mutex.c. No thread
+ * that reports an event writes to standard output itself, so no
+ * lock is ever held across blocking I/O on a slow pipe.
+ *
+ * Every thread that logs gets its own single-producer ring of
+ * fixed-size record slots. log_printf formats a line straight into
+ * the next free slot, stamps it from a global sequence counter,
+ * and publishes it; no lock is taken. A single writer thread
+ * merges the rings in sequence order -- the order in which the
+ * records were made -- gathers runs of records into one iovec
+ * array, and writes them with writev.
+ *
+ * The sequence number is taken after the slot is filled, just
+ * before it is published, so the writer waits out the short gap
+ * when a record is stamped but not yet visible.
+ *
+ * log_printf never waits for the writer, since its callers may hold
+ * an alarm shard or periodic lock. When a thread's ring is full, it
+ * spills the record into an allocated one on the ring's overflow
+ * list instead, under a mutex held for no more than the append, and
+ * goes on spilling until the writer has emptied the list, so that
+ * its records still come out in order. A stalled standard output
+ * then costs memory rather than holding up the alarm list.
+ */
+#ifndef __async_log_h
+#define __async_log_h
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <time.h>
+#include "errors.h"
+
+#define LOG_RECORD_MAX      512     /* longest line, longer ones are truncated */
+#define LOG_RING_SLOTS      1024    /* records per thread, a power of two */
+#define LOG_IOV_MAX         512     /* records per writev */
+
+typedef struct log_record_tag {
+    unsigned long       sequence;
+    int                 length;
+    char                text[LOG_RECORD_MAX];
+} log_record_t;
+
+typedef struct log_spill_tag {
+    struct log_spill_tag *next;
+    log_record_t        record;
+} log_spill_t;
+
+typedef struct log_ring_tag {
+    atomic_size_t       head;       /* next slot the owner fills */
+    atomic_size_t       tail;       /* next slot the writer releases */
+    size_t              read;       /* next slot the writer gathers (writer only) */
+    atomic_int          spilled;    /* records on the overflow list; the owner fills no slot while any are */
+    pthread_mutex_t     overflow_lock;  /* protects the overflow list */
+    log_spill_t         *overflow_first;
+    log_spill_t         *overflow_last;
+    struct log_ring_tag *next;
+    log_record_t        records[LOG_RING_SLOTS];
+} log_ring_t;
+
+static _Atomic(log_ring_t *) log_rings = NULL;  /* every thread's ring, newest first */
+static atomic_ulong log_sequence = 0;           /* next sequence number to hand out */
+static atomic_ulong log_written = 0;            /* every record before this is written */
+static atomic_int log_waiting = 0;              /* 1 while the writer sleeps, or is about to */
+static sem_t log_wakeup;
+static __thread log_ring_t *log_self = NULL;
+
+static inline void log_notify(void)
+{
+    //pairs with the fence in log_writer: either it sees the record, or we see it waiting
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&log_waiting, memory_order_relaxed)
+            && atomic_exchange(&log_waiting, 0)) {
+        if (sem_post(&log_wakeup) == -1)
+            errno_abort ("Post semaphore");
+    }
+}
+
+/*
+ * The calling thread's ring, created and registered on first use.
+ */
+static inline log_ring_t *log_ring(void)
+{
+    log_ring_t *ring = log_self;
+    int status;
+
+    if (ring != NULL)
+        return ring;
+    ring = calloc(1, sizeof(log_ring_t));
+    if (ring == NULL)
+        errno_abort ("Allocate log ring");
+    status = pthread_mutex_init(&ring->overflow_lock, NULL);
+    if (status != 0)
+        err_abort (status, "Init mutex");
+    ring->next = atomic_load(&log_rings);
+    while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring))
+        ;
+    log_self = ring;
+    return ring;
+}
+
+static inline void log_format(log_record_t *record, const char *format, va_list args)
+{
+    int length = vsnprintf(record->text, LOG_RECORD_MAX, format, args);
+
+    if (length < 0)
+        length = 0;
+    else if (length >= LOG_RECORD_MAX)
+        length = LOG_RECORD_MAX - 1;
+    record->length = length;
+}
+
+/*
+ * Format one record and queue it for standard output, in the next
+ * slot of the caller's ring, or on its overflow list if the ring is
+ * full or records are already waiting there.
+ */
+static inline void log_vprintf(const char *format, va_list args)
+{
+    log_ring_t *ring = log_ring();
+    log_record_t *record;
+    log_spill_t *spill;
+    size_t head;
+    int status;
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (atomic_load_explicit(&ring->spilled, memory_order_acquire) == 0
+            && head - atomic_load_explicit(&ring->tail, memory_order_acquire) < LOG_RING_SLOTS) {
+        record = &ring->records[head & (LOG_RING_SLOTS - 1)];
+        log_format(record, format, args);
+        record->sequence = atomic_fetch_add(&log_sequence, 1);
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+        log_notify();
+        return;
+    }
+
+    spill = malloc(sizeof(log_spill_t));
+    if (spill == NULL)
+        errno_abort ("Allocate log record");
+    log_format(&spill->record, format, args);
+    spill->next = NULL;
+    status = pthread_mutex_lock(&ring->overflow_lock);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    spill->record.sequence = atomic_fetch_add(&log_sequence, 1);
+    if (ring->overflow_last != NULL)
+        ring->overflow_last->next = spill;
+    else
+        ring->overflow_first = spill;
+    ring->overflow_last = spill;
+    atomic_fetch_add_explicit(&ring->spilled, 1, memory_order_release);
+    status = pthread_mutex_unlock(&ring->overflow_lock);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    log_notify();
+}
+
+static inline void log_printf(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    log_vprintf(format, args);
+    va_end(args);
+}
+
+/*
+ * The wall clock time, formatted as "%D %I:%M:%S %p" for event
+ * lines. Each thread formats it at most once per second and
+ * otherwise reuses its cached copy.
+ */
+static inline const char *log_time(void)
+{
+    static __thread time_t second = -1;
+    static __thread char text[80];
+    struct tm local;
+    time_t now = time(NULL);
+
+    if (now != second) {
+        localtime_r(&now, &local);
+        strftime(text, sizeof(text), "%D %I:%M:%S %p", &local);
+        second = now;
+    }
+    return text;
+}
+
+/*
+ * Write out the gathered records, resuming after partial writes.
+ */
+static inline void log_writev(struct iovec *iov, int count)
+{
+    ssize_t written;
+
+    while (count > 0) {
+        written = writev(STDOUT_FILENO, iov, count);
+        if (written == -1) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            errno_abort ("Write standard output");
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+/*
+ * A ring's next record for the writer: the oldest in its slots, or,
+ * once those are all gathered, the oldest it spilled. NULL if it has
+ * none. The owner fills no slot while it has records spilled, so
+ * every record in the slots is older than those.
+ */
+static inline log_record_t *log_front(log_ring_t *ring)
+{
+    log_record_t *record = NULL;
+    int status;
+
+    if (ring->read != atomic_load_explicit(&ring->head, memory_order_acquire))
+        return &ring->records[ring->read & (LOG_RING_SLOTS - 1)];
+    if (atomic_load_explicit(&ring->spilled, memory_order_acquire) == 0)
+        return NULL;
+    status = pthread_mutex_lock(&ring->overflow_lock);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    record = &ring->overflow_first->record;
+    status = pthread_mutex_unlock(&ring->overflow_lock);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    return record;
+}
+
+/*
+ * Move the writer past the record log_front returned. A spilled
+ * record goes on "done", to be freed once it has been written.
+ */
+static inline void log_pop(log_ring_t *ring, log_spill_t **done)
+{
+    log_spill_t *spill;
+    int status;
+
+    if (ring->read != atomic_load_explicit(&ring->head, memory_order_acquire)) {
+        ring->read++;
+        return;
+    }
+    status = pthread_mutex_lock(&ring->overflow_lock);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    spill = ring->overflow_first;
+    ring->overflow_first = spill->next;
+    if (ring->overflow_first == NULL)
+        ring->overflow_last = NULL;
+    //once it is 0 the owner may fill slots again, all of them newer than this record
+    atomic_fetch_sub_explicit(&ring->spilled, 1, memory_order_release);
+    status = pthread_mutex_unlock(&ring->overflow_lock);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    spill->next = *done;
+    *done = spill;
+}
+
+/*
+ * The writer thread's start routine.
+ */
+static void *log_writer(void *arg)
+{
+    struct iovec iov[LOG_IOV_MAX];
+    unsigned long next = 0;
+    log_ring_t *ring, *from;
+    log_record_t *record = NULL;
+    log_spill_t *done = NULL, *spill;
+    int count, behind;
+
+    (void)arg;
+    while (1) {
+        /*
+         * Gather records in sequence order. The record numbered
+         * "next" is at the read position of exactly one ring, once
+         * it has been published; rings whose next record has a
+         * later number are "behind" it.
+         */
+        count = 0;
+        from = NULL;
+        while (count < LOG_IOV_MAX) {
+            behind = 0;
+            if (from == NULL || (record = log_front(from)) == NULL || record->sequence != next) {
+                for (from = atomic_load(&log_rings); from != NULL; from = from->next) {
+                    if ((record = log_front(from)) == NULL)
+                        continue;
+                    if (record->sequence == next)
+                        break;
+                    behind = 1;
+                }
+                if (from == NULL)
+                    break;
+            }
+            iov[count].iov_base = record->text;
+            iov[count].iov_len = record->length;
+            count++;
+            log_pop(from, &done);
+            next++;
+        }
+
+        if (count > 0) {
+            log_writev(iov, count);
+            for (ring = atomic_load(&log_rings); ring != NULL; ring = ring->next)
+                atomic_store_explicit(&ring->tail, ring->read, memory_order_release);
+            while ((spill = done) != NULL) {
+                done = spill->next;
+                free(spill);
+            }
+            atomic_store(&log_written, next);
+            continue;
+        }
+
+        //the next record is stamped but not yet published
+        if (behind || atomic_load(&log_sequence) != next) {
+            sched_yield();
+            continue;
+        }
+
+        atomic_store(&log_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load(&log_sequence) != next) {
+            atomic_store(&log_waiting, 0);
+            continue;
+        }
+        while (sem_wait(&log_wakeup) == -1) {
+            if (errno != EINTR)
+                errno_abort ("Wait on semaphore");
+        }
+    }
+    return NULL;
+}
+
+static inline void log_start(void)
+{
+    pthread_t thread;
+    int status;
+
+    if (sem_init(&log_wakeup, 0, 0) == -1)
+        errno_abort ("Init semaphore");
+    status = pthread_create(&thread, NULL, log_writer, NULL);
+    if (status != 0)
+        err_abort (status, "Create log writer");
+}
+
+/*
+ * Wait until every record made so far has been written.
+ */
+static inline void log_flush(void)
+{
+    unsigned long target = atomic_load(&log_sequence);
+    struct timespec pause = { 0, 1000000 };
+
+    while (atomic_load(&log_written) < target) {
+        log_notify();
+        nanosleep(&pause, NULL);
+    }
+}
+
+#endif
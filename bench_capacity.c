@@ -0,0 +1,233 @@
+/*
+ * bench_capacity.c
+ *
+ * Capacity benchmark for the alarm list of new_alarm_mutex.c. It
+ * loads a store of 1, 2, 5 and 10 million alarms (up to -n), each in
+ * a fresh child process, exactly as the program holds them: alarms
+ * from a slab cache of whole cache lines, messages in the message
+ * arena, every alarm in all the indexes of its shard. Most messages
+ * are short, as they are in practice. For each size it reports:
+ *
+ *  - the resident set size once loaded, and what that comes to per
+ *    alarm, over what the process used before;
+ *  - the insert rate, locking the alarm's shard for each insert, as
+ *    a Start_Alarm does;
+ *  - the cost of an expiry sweep that finds nothing due, and of the
+ *    sweeps that then expire every alarm, a thousandth of the
+ *    deadlines at a time, per sweep and per alarm expired.
+ *
+ *      cc -O2 bench_capacity.c -o bench_capacity -lpthread
+ *      ./bench_capacity [-n max_alarms] [-s shards] [-k types]
+ */
+#include <pthread.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "errors.h"
+#include "alarm_store.h"
+#include "message_arena.h"
+
+#define NSEC_PER_SEC        1000000000LL
+#define WINDOW_NS           (1000 * NSEC_PER_SEC)   /* deadlines are spread over this */
+#define SWEEPS              1000
+#define IDLE_SWEEPS         10000
+
+slab_cache_t alarm_cache;
+message_arena_t message_arena;
+
+long long monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+static unsigned int next_random(unsigned int *state)
+{
+    unsigned int x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+long resident_kb(void)
+{
+    char line[256];
+    FILE *status;
+    long kb = 0;
+
+    status = fopen("/proc/self/status", "r");
+    if (status == NULL)
+        errno_abort ("Open /proc/self/status");
+    while (fgets(line, sizeof(line), status) != NULL)
+        if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+            break;
+    fclose(status);
+    return kb;
+}
+
+/*
+ * The length of a message: seven in ten fit 16 bytes, two more 32,
+ * and the rest are up to 100 characters long.
+ */
+int message_length(unsigned int *seed)
+{
+    unsigned int pick = next_random(seed) % 10;
+
+    if (pick < 7)
+        return 6 + next_random(seed) % 9;
+    if (pick < 9)
+        return 16 + next_random(seed) % 15;
+    return 32 + next_random(seed) % 69;
+}
+
+/*
+ * Expire every alarm in the store due by "now", as the expiry
+ * sweep does, and return how many there were.
+ */
+long sweep(alarm_store_t *store, long long now)
+{
+    alarm_shard_t *shard;
+    alarm_t *alarm;
+    long expired = 0;
+    int i;
+
+    for (i = 0; i < store->shards; i++) {
+        shard = &store->shard[i];
+        alarm_shard_lock(shard);
+        while ((alarm = alarm_heap_top(&shard->heap)) != NULL && alarm->time <= now) {
+            alarm_shard_remove(shard, alarm);
+            slab_free(alarm->message);
+            slab_free(alarm);
+            expired++;
+        }
+        alarm_shard_unlock(shard);
+    }
+    return expired;
+}
+
+/*
+ * Load "alarms" alarms into a fresh store, measure, and expire
+ * them all. Runs in a child process of its own, so that each size
+ * starts from an empty heap.
+ */
+void run(int alarms, int shards, int types)
+{
+    static char text[MESSAGE_MAX];
+    alarm_store_t store;
+    alarm_shard_t *shard;
+    alarm_t *alarm;
+    unsigned int seed = 2463534242u;
+    long long start, insert_ns, idle_ns, sweep_ns = 0, worst_ns = 0, elapsed, now;
+    long before_kb, loaded_kb, expired = 0;
+    int i;
+
+    memset(text, 'm', sizeof(text));
+    slab_cache_init(&alarm_cache, "alarms", (sizeof(alarm_t) + 63) & ~(size_t)63);
+    message_arena_init(&message_arena);
+    alarm_store_init(&store, shards);
+    before_kb = resident_kb();
+
+    start = monotonic_ns();
+    for (i = 0; i < alarms; i++) {
+        alarm = slab_alloc(&alarm_cache);
+        memset(alarm, 0, sizeof(alarm_t));
+        alarm->id = i + 1;
+        alarm->type = i % types;
+        alarm->msecs = 1000;
+        alarm->time = (long long)(((unsigned long long)next_random(&seed) << 32 | next_random(&seed))
+            % WINDOW_NS) + 1;
+        alarm->latest = alarm->time;
+        alarm->heap_index = -1;
+        alarm->due_index = -1;
+        alarm->message = message_alloc(&message_arena, text, message_length(&seed));
+        shard = alarm_store_shard(&store, alarm->id);
+        alarm_shard_lock(shard);
+        alarm_shard_insert(shard, alarm);
+        alarm_shard_unlock(shard);
+    }
+    insert_ns = monotonic_ns() - start;
+    loaded_kb = resident_kb();
+
+    start = monotonic_ns();
+    for (i = 0; i < IDLE_SWEEPS; i++)
+        expired += sweep(&store, 0);
+    idle_ns = (monotonic_ns() - start) / IDLE_SWEEPS;
+
+    for (i = 1; i <= SWEEPS; i++) {
+        now = WINDOW_NS / SWEEPS * i;
+        start = monotonic_ns();
+        expired += sweep(&store, i == SWEEPS ? WINDOW_NS : now);
+        elapsed = monotonic_ns() - start;
+        sweep_ns += elapsed;
+        if (elapsed > worst_ns)
+            worst_ns = elapsed;
+    }
+    if (expired != alarms) {
+        fprintf(stderr, "%ld of %d alarms expired\n", expired, alarms);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%10d %9.1f %8.0f %12.0f %9.2f %9.3f %9.3f %10.1f\n", alarms, loaded_kb / 1024.0,
+        (loaded_kb - before_kb) * 1024.0 / alarms, (double)alarms * NSEC_PER_SEC / insert_ns,
+        idle_ns / 1e3, sweep_ns / 1e6 / SWEEPS, worst_ns / 1e6, (double)sweep_ns / alarms);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    static const int steps[] = { 1, 2, 5 };
+    int max_alarms = 10000000, shards = 16, types = 64, option, status, alarms, step;
+    pid_t child;
+
+    while ((option = getopt(argc, argv, "n:s:k:")) != -1) {
+        switch (option) {
+        case 'n':
+            max_alarms = atoi(optarg);
+            break;
+        case 's':
+            shards = atoi(optarg);
+            break;
+        case 'k':
+            types = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n max_alarms] [-s shards] [-k types]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (max_alarms <= 0 || shards <= 0 || types <= 0) {
+        fprintf(stderr, "The alarms, shards and types must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("alarm_t is %zu bytes, %d shards, %d types\n", sizeof(alarm_t), shards, types);
+    printf("%10s %9s %8s %12s %9s %9s %9s %10s\n", "alarms", "RSS MB", "B/alarm", "inserts/s",
+        "idle us", "sweep ms", "worst ms", "ns/expiry");
+    //1, 2 and 5 million, then 10, 20, 50 million and so on, and -n itself
+    for (alarms = 1000000, step = 0; ; ) {
+        if (alarms > max_alarms)
+            alarms = max_alarms;
+        fflush(stdout);
+        child = fork();
+        if (child == -1)
+            errno_abort ("Fork");
+        if (child == 0) {
+            run(alarms, shards, types);
+            exit(0);
+        }
+        if (waitpid(child, &status, 0) == -1)
+            errno_abort ("Wait for run");
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "The run of %d alarms failed\n", alarms);
+            exit(EXIT_FAILURE);
+        }
+        if (alarms == max_alarms)
+            break;
+        step++;
+        alarms = steps[step % 3] * (int)(step < 3 ? 1000000 : step < 6 ? 10000000 : 100000000);
+    }
+    return 0;
+}
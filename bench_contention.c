@@ -0,0 +1,198 @@
+/*
+ * bench_contention.c
+ *
+ * Contention benchmark for the sharded alarm store of
+ * new_alarm_mutex.c. A number of threads issue a mix of
+ * Start_Alarm, Change_Alarm and Cancel_Alarm operations on random
+ * alarm ids, each locking only the shard its alarm id belongs to,
+ * exactly as the main thread does. The same workload is run
+ * against a store with a single shard (the original one-lock
+ * alarm list) and against a store with N shards, for 1, 2, 4, ...
+ * threads, and the throughput of each is reported.
+ *
+ *      cc -O2 bench_contention.c -o bench_contention -lpthread
+ *      ./bench_contention [-s shards] [-t max_threads] [-n ops_per_thread] [-k ids]
+ */
+#include <pthread.h>
+#include <time.h>
+#include "errors.h"
+#include "alarm_store.h"
+
+#define NSEC_PER_SEC        1000000000LL
+
+typedef struct worker_tag {
+    pthread_t           thread;
+    alarm_store_t       *store;
+    unsigned int        seed;
+    long                ops;
+    int                 ids;
+} worker_t;
+
+pthread_barrier_t start_barrier;
+
+long long monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+/*
+ * xorshift32, so that the threads do not serialize on rand().
+ */
+static unsigned int next_random(unsigned int *state)
+{
+    unsigned int x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/*
+ * One benchmark thread. An operation on an id that is not in the
+ * store starts it; on an id that is, it changes the alarm three
+ * times out of four and cancels it otherwise, so that the store
+ * stays about half full.
+ */
+void *worker_thread(void *arg)
+{
+    worker_t *worker = arg;
+    alarm_shard_t *shard;
+    alarm_t *alarm, *cancelled;
+    long i;
+    int id, status;
+
+    status = pthread_barrier_wait(&start_barrier);
+    if (status != 0 && status != PTHREAD_BARRIER_SERIAL_THREAD)
+        err_abort (status, "Wait on barrier");
+
+    for (i = 0; i < worker->ops; i++) {
+        id = next_random(&worker->seed) % worker->ids;
+        shard = alarm_store_shard(worker->store, id);
+        alarm_shard_lock(shard);
+        alarm = alarm_hash_find(&shard->hash, id);
+        cancelled = NULL;
+        if (alarm == NULL) {
+            alarm = calloc(1, sizeof(alarm_t));
+            if (alarm == NULL)
+                errno_abort ("Allocate alarm");
+            alarm->id = id;
+            alarm->msecs = 1000 + next_random(&worker->seed) % 60000;
+            alarm->time = monotonic_ns() + alarm->msecs * 1000000LL;
+            alarm->latest = alarm->time;
+            alarm->heap_index = -1;
+            alarm->type = 0;
+            alarm_hash_insert(&shard->hash, alarm);
+            alarm_heap_push(&shard->heap, alarm);
+        } else if (next_random(&worker->seed) % 4 != 0) {
+            alarm->msecs = 1000 + next_random(&worker->seed) % 60000;
+            alarm->time = monotonic_ns() + alarm->msecs * 1000000LL;
+            alarm->latest = alarm->time;
+            alarm_heap_update(&shard->heap, alarm);
+        } else {
+            alarm_hash_remove(&shard->hash, id);
+            alarm_heap_remove(&shard->heap, alarm);
+            cancelled = alarm;
+        }
+        alarm_shard_unlock(shard);
+
+        //a cancelled alarm is freed outside the lock, as the display threads do
+        free(cancelled);
+    }
+    return NULL;
+}
+
+/*
+ * Run the workload with "threads" threads against a fresh store of
+ * "shards" shards, and return the throughput in operations per
+ * second.
+ */
+double run(int shards, int threads, long ops, int ids)
+{
+    alarm_store_t store;
+    worker_t *workers;
+    long long start, elapsed;
+    int status, i;
+
+    alarm_store_init(&store, shards);
+    workers = calloc(threads, sizeof(worker_t));
+    if (workers == NULL)
+        errno_abort ("Allocate workers");
+    status = pthread_barrier_init(&start_barrier, NULL, threads + 1);
+    if (status != 0)
+        err_abort (status, "Init barrier");
+
+    for (i = 0; i < threads; i++) {
+        workers[i].store = &store;
+        workers[i].seed = 2463534242u + i * 7919u;
+        workers[i].ops = ops;
+        workers[i].ids = ids;
+        status = pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+        if (status != 0)
+            err_abort (status, "Create worker");
+    }
+
+    status = pthread_barrier_wait(&start_barrier);
+    if (status != 0 && status != PTHREAD_BARRIER_SERIAL_THREAD)
+        err_abort (status, "Wait on barrier");
+    start = monotonic_ns();
+    for (i = 0; i < threads; i++) {
+        status = pthread_join(workers[i].thread, NULL);
+        if (status != 0)
+            err_abort (status, "Join worker");
+    }
+    elapsed = monotonic_ns() - start;
+
+    pthread_barrier_destroy(&start_barrier);
+    alarm_store_destroy(&store);
+    free(workers);
+    return (double)ops * threads * NSEC_PER_SEC / (elapsed > 0 ? elapsed : 1);
+}
+
+int main(int argc, char *argv[])
+{
+    int shards = 16, max_threads, ids = 100000, threads, option;
+    long ops = 1000000, processors;
+    double one_lock, sharded;
+
+    processors = sysconf(_SC_NPROCESSORS_ONLN);
+    max_threads = processors > 1 ? (int)processors : 2;
+    while ((option = getopt(argc, argv, "s:t:n:k:")) != -1) {
+        switch (option) {
+        case 's':
+            shards = atoi(optarg);
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'n':
+            ops = atol(optarg);
+            break;
+        case 'k':
+            ids = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s shards] [-t max_threads] [-n ops_per_thread] [-k ids]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (shards <= 0 || max_threads <= 0 || ops <= 0 || ids <= 0) {
+        fprintf(stderr, "All arguments must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%ld Start/Change/Cancel operations per thread over %d alarm ids\n", ops, ids);
+    printf("%8s %16s %16s %8s\n", "threads", "1 shard ops/s", "sharded ops/s", "speedup");
+    for (threads = 1; threads <= max_threads; threads *= 2) {
+        one_lock = run(1, threads, ops, ids);
+        sharded = run(shards, threads, ops, ids);
+        printf("%8d %16.0f %16.0f %7.2fx\n", threads, one_lock, sharded, sharded / one_lock);
+        if (threads < max_threads && threads * 2 > max_threads)
+            threads = max_threads / 2;
+    }
+    printf("(%d shards)\n", shards);
+    return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * bench_ingest.c
+ *
+ * Command ingestion benchmark for new_alarm_mutex.c. It generates
+ * a burst of Start_Alarm, Change_Alarm and Cancel_Alarm commands,
+ * pipes the whole burst into the alarm program once for each batch
+ * size 1, 2, 4, ... 4096 (its -b option), and reports how many
+ * commands per second the program took in. The program exits at
+ * the end of its input, so each run is timed from the first write
+ * to the program's exit. Its output is discarded.
+ *
+ *      cc new_alarm_mutex.c -o new_alarm_mutex -lpthread
+ *      cc -O2 bench_ingest.c -o bench_ingest
+ *      ./bench_ingest [-p program] [-n commands] [-s shards]
+ */
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "errors.h"
+
+#define NSEC_PER_SEC        1000000000LL
+#define LARGEST_BATCH       4096
+
+long long monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+/*
+ * Build the command burst. Every alarm is started with a ten minute
+ * duration, so that nothing expires during a run; one in four is
+ * changed to another type shortly after, and one in eight is
+ * cancelled.
+ */
+char *make_commands(int commands, size_t *length)
+{
+    size_t size = (size_t)commands * 64, used = 0;
+    char *text = malloc(size);
+    int id = 0, n;
+
+    if (text == NULL)
+        errno_abort ("Allocate commands");
+    for (n = 0; n < commands; n++) {
+        if (n % 4 == 1 && id > 2)
+            used += sprintf(text + used, "Change_Alarm(%d): Tchanged%d 600 changed\n", id - 2, id % 7);
+        else if (n % 8 == 3 && id > 4)
+            used += sprintf(text + used, "Cancel_Alarm(%d)\n", id - 4);
+        else {
+            id++;
+            used += sprintf(text + used, "Start_Alarm(%d): Ttype%d 600 message %d\n", id, id % 13, id);
+        }
+    }
+    *length = used;
+    return text;
+}
+
+/*
+ * Run the program once with the given batch size, feed it the
+ * commands, and return the elapsed time in nanoseconds.
+ */
+long long run(const char *program, int batch, const char *shards, const char *text, size_t length)
+{
+    char batch_arg[16];
+    int pipe_fd[2], null_fd, status;
+    long long start;
+    ssize_t written;
+    size_t offset = 0;
+    pid_t child;
+
+    if (pipe(pipe_fd) == -1)
+        errno_abort ("Create pipe");
+    snprintf(batch_arg, sizeof(batch_arg), "%d", batch);
+
+    child = fork();
+    if (child == -1)
+        errno_abort ("Fork");
+    if (child == 0) {
+        null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd == -1)
+            errno_abort ("Open /dev/null");
+        dup2(pipe_fd[0], STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        close(null_fd);
+        if (shards != NULL)
+            execl(program, program, "-b", batch_arg, "-s", shards, (char *)NULL);
+        else
+            execl(program, program, "-b", batch_arg, (char *)NULL);
+        _exit(127);
+    }
+    close(pipe_fd[0]);
+
+    start = monotonic_ns();
+    while (offset < length) {
+        written = write(pipe_fd[1], text + offset, length - offset);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            errno_abort ("Write commands");
+        }
+        offset += written;
+    }
+    close(pipe_fd[1]);
+    if (waitpid(child, &status, 0) == -1)
+        errno_abort ("Wait for program");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s -b %d did not run to completion\n", program, batch);
+        exit(EXIT_FAILURE);
+    }
+    return monotonic_ns() - start;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *program = "./new_alarm_mutex", *shards = NULL;
+    int commands = 200000, batch, option;
+    long long elapsed;
+    size_t length;
+    char *text;
+
+    while ((option = getopt(argc, argv, "p:n:s:")) != -1) {
+        switch (option) {
+        case 'p':
+            program = optarg;
+            break;
+        case 'n':
+            commands = atoi(optarg);
+            break;
+        case 's':
+            shards = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p program] [-n commands] [-s shards]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (commands <= 0) {
+        fprintf(stderr, "There must be at least one command\n");
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    text = make_commands(commands, &length);
+    printf("%d commands (%zu bytes) piped into %s\n", commands, length, program);
+    printf("%8s %14s %16s\n", "batch", "seconds", "commands/sec");
+    for (batch = 1; batch <= LARGEST_BATCH; batch *= 2) {
+        elapsed = run(program, batch, shards, text, length);
+        printf("%8d %14.3f %16.0f\n", batch, (double)elapsed / NSEC_PER_SEC,
+            (double)commands * NSEC_PER_SEC / elapsed);
+    }
+    free(text);
+    return 0;
+}
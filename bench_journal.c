@@ -0,0 +1,182 @@
+/*
+ * bench_journal.c
+ *
+ * Output benchmark for new_alarm_mutex.c. Each of 1, 2, 4, ...
+ * threads reports the same stream of lifecycle events, once as the
+ * program's text lines through the asynchronous log (async_log.h)
+ * and once as binary journal records (journal.h), both into files
+ * in the given directory. It reports records per second, and bytes
+ * per record, for each output mode. A run is timed until every
+ * record has reached the file.
+ *
+ *      cc -O2 bench_journal.c -o bench_journal -lpthread
+ *      ./bench_journal [-d directory] [-t max_threads] [-n records_per_thread]
+ */
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "async_log.h"
+#include "journal.h"
+
+#define NSEC_PER_SEC        1000000000LL
+#define DURATION_FMT        "%d%s"
+#define DURATION_ARGS(ms)   ((ms) % 1000 ? (ms) : (ms) / 1000), ((ms) % 1000 ? "ms" : "")
+
+typedef struct worker_tag {
+    pthread_t           thread;
+    int                 index;
+    long                records;
+    int                 journal;    /* 1 for journal records, 0 for text */
+} worker_t;
+
+journal_t journal;
+
+long long monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+/*
+ * Mostly periodic prints, as in a busy run of the program, with an
+ * insert and an expiry for every alarm.
+ */
+void *worker_routine(void *arg)
+{
+    worker_t *worker = arg;
+    const char *message = "The quick brown fox jumps over the lazy dog";
+    long n;
+    int id, event;
+
+    for (n = 0; n < worker->records; n++) {
+        id = worker->index * 1000000 + (int)(n / 8);
+        event = n % 8 == 0 ? JOURNAL_INSERT : n % 8 == 7 ? JOURNAL_EXPIRE : JOURNAL_PERIODIC;
+        if (worker->journal) {
+            journal_event(&journal, event, id, 3, 5000, 7,
+                event == JOURNAL_INSERT ? message : NULL);
+        } else if (event == JOURNAL_INSERT) {
+            log_printf("Alarm(%d) Inserted by Main Thread (%lu) Into Alarm List at <%s>: " DURATION_FMT " %s \n",
+                id, 7UL, log_time(), DURATION_ARGS(5000), message);
+        } else if (event == JOURNAL_EXPIRE) {
+            log_printf("Alarm(%d): Alarm Expired at <%s>: Alarm Removed From Alarm List\n", id, log_time());
+        } else {
+            log_printf("Alarm(%d) Message PERIODICALLY PRINTED BY Display Thread (%lu) at %s: T%s " DURATION_FMT " %s \n",
+                id, 7UL, log_time(), "weather", DURATION_ARGS(5000), message);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Run "threads" workers in one output mode; return the elapsed
+ * nanoseconds and set *bytes to the size of the output.
+ */
+long long run(const char *directory, int threads, long records, int use_journal, long long *bytes)
+{
+    char path[4096];
+    worker_t *workers;
+    struct stat info;
+    long long start, elapsed;
+    int status, i, fd, saved;
+
+    snprintf(path, sizeof(path), "%s/bench_journal.%s", directory, use_journal ? "jrn" : "txt");
+    workers = calloc(threads, sizeof(worker_t));
+    if (workers == NULL)
+        errno_abort ("Allocate workers");
+
+    //the log writer writes to standard output, so point that at the file for the run
+    saved = -1;
+    fd = -1;
+    if (use_journal)
+        journal_open(&journal, path);
+    else {
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1)
+            errno_abort ("Open output");
+        fflush(stdout);
+        saved = dup(STDOUT_FILENO);
+        if (saved == -1 || dup2(fd, STDOUT_FILENO) == -1)
+            errno_abort ("Redirect standard output");
+    }
+
+    start = monotonic_ns();
+    for (i = 0; i < threads; i++) {
+        workers[i].index = i;
+        workers[i].records = records;
+        workers[i].journal = use_journal;
+        status = pthread_create(&workers[i].thread, NULL, worker_routine, &workers[i]);
+        if (status != 0)
+            err_abort (status, "Create worker");
+    }
+    for (i = 0; i < threads; i++) {
+        status = pthread_join(workers[i].thread, NULL);
+        if (status != 0)
+            err_abort (status, "Join worker");
+    }
+    if (use_journal)
+        journal_close(&journal);
+    else
+        log_flush();
+    elapsed = monotonic_ns() - start;
+
+    if (use_journal) {
+        if (munmap(journal.base, JOURNAL_MAP_MAX) == -1)
+            errno_abort ("Unmap journal");
+        journal.base = NULL;
+        fd = journal.fd;
+    } else if (dup2(saved, STDOUT_FILENO) == -1)
+        errno_abort ("Restore standard output");
+    if (fstat(fd, &info) == -1)
+        errno_abort ("Stat output");
+    *bytes = info.st_size;
+    close(fd);
+    if (saved != -1)
+        close(saved);
+    unlink(path);
+    free(workers);
+    return elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *directory = "/tmp";
+    long records = 1000000;
+    long long text_ns, journal_ns, text_bytes, journal_bytes, total;
+    int max_threads = 8, threads, option;
+
+    while ((option = getopt(argc, argv, "d:t:n:")) != -1) {
+        switch (option) {
+        case 'd':
+            directory = optarg;
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'n':
+            records = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d directory] [-t max_threads] [-n records_per_thread]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (max_threads <= 0 || records <= 0) {
+        fprintf(stderr, "There must be at least one thread and one record\n");
+        exit(EXIT_FAILURE);
+    }
+
+    log_start();
+    printf("%7s %16s %10s %16s %10s %8s\n", "threads", "text rec/s", "bytes/rec", "journal rec/s", "bytes/rec", "speedup");
+    for (threads = 1; threads <= max_threads; threads *= 2) {
+        total = (long long)threads * records;
+        text_ns = run(directory, threads, records, 0, &text_bytes);
+        journal_ns = run(directory, threads, records, 1, &journal_bytes);
+        printf("%7d %16.0f %10.1f %16.0f %10.1f %7.1fx\n", threads,
+            (double)total * NSEC_PER_SEC / text_ns, (double)text_bytes / total,
+            (double)total * NSEC_PER_SEC / journal_ns, (double)(journal_bytes - JOURNAL_RECORD) / total,
+            (double)text_ns / (journal_ns > 0 ? journal_ns : 1));
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,416 @@
+/*
+ * bench_load.c
+ *
+ * Load generator for new_alarm_mutex.c. It starts the program, feeds
+ * it a paced stream of Start_Alarm, Change_Alarm, Cancel_Alarm and
+ * View_Alarms commands, and reads its output as it comes, noting
+ * when each "Alarm Expired" line arrives. The lateness of an expiry
+ * is how long after the alarm's deadline -- reckoned from when its
+ * Start (or last Change) was written -- the line was read.
+ *
+ * At the end it reports the command rate achieved, the expiry
+ * lateness percentiles, and the program's peak thread count and
+ * peak resident set size. With -o it also appends one line of the
+ * same figures, labelled with -l, to a results file, so that runs
+ * of different versions of the program can be compared against a
+ * baseline; "make baseline" and "make bench" do that for the tree
+ * as it stands (see the Makefile).
+ *
+ *      cc new_alarm_mutex.c -o new_alarm_mutex -lpthread
+ *      cc -O2 bench_load.c -o bench_load -lm
+ *      ./bench_load [-p program] [-n commands] [-r rate] [-k types]
+ *                   [-d fixed:MS | uniform:LO:HI | exp:MEAN] [-m start,change,cancel,view]
+ *                   [-l label] [-o results] [-- program options]
+ */
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "errors.h"
+
+#define NSEC_PER_SEC        1000000000LL
+#define NSEC_PER_MSEC       1000000LL
+#define OUTPUT_SIZE         65536
+#define SAMPLE_NS           (100 * NSEC_PER_MSEC)   /* /proc sampling period */
+#define DRAIN_NS            (2 * NSEC_PER_SEC)      /* wait past the last deadline */
+
+#define DURATION_FIXED      0
+#define DURATION_UNIFORM    1
+#define DURATION_EXP        2
+
+typedef struct load_tag {
+    int                 commands;
+    double              rate;       /* commands per second */
+    int                 types;
+    int                 distribution;   /* DURATION_* */
+    int                 low_ms, high_ms;    /* fixed and uniform; mean for exp */
+    int                 mix[4];     /* percentages of start, change, cancel, view */
+} load_t;
+
+/*
+ * Alarms known to be in the program's list: "live" holds their ids
+ * in no order, "position" the index of each id in it (or -1), and
+ * "deadline" when each is expected to expire.
+ */
+int *live, *position;
+long long *deadline;
+int live_count = 0, next_id = 0;
+
+long long *lateness;
+int lateness_count = 0;
+unsigned long long random_state = 88172645463325252ULL;
+
+long long monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+unsigned long long next_random(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+int duration_ms(load_t *load)
+{
+    double uniform;
+
+    switch (load->distribution) {
+    case DURATION_UNIFORM:
+        return load->low_ms + (int)(next_random() % (unsigned)(load->high_ms - load->low_ms + 1));
+    case DURATION_EXP:
+        uniform = (next_random() >> 11) * (1.0 / 9007199254740992.0);
+        return 1 + (int)(-log1p(-uniform) * load->low_ms);
+    default:
+        return load->low_ms;
+    }
+}
+
+void live_add(int id)
+{
+    position[id] = live_count;
+    live[live_count++] = id;
+}
+
+void live_remove(int id)
+{
+    int last;
+
+    if (position[id] < 0)
+        return;
+    last = live[--live_count];
+    live[position[id]] = last;
+    position[last] = position[id];
+    position[id] = -1;
+    deadline[id] = 0;
+}
+
+/*
+ * Format the next command of the mix into "line", and note what it
+ * will do to the list.
+ */
+int make_command(load_t *load, char *line, long long now)
+{
+    int pick = (int)(next_random() % 100), id, ms;
+
+    if (pick >= load->mix[0] && live_count > 0) {
+        pick -= load->mix[0];
+        id = live[next_random() % live_count];
+        if (pick < load->mix[1]) {
+            ms = duration_ms(load);
+            deadline[id] = now + ms * NSEC_PER_MSEC;
+            return sprintf(line, "Change_Alarm(%d): Ttype%d %dms changed\n",
+                id, (int)(next_random() % load->types), ms);
+        }
+        pick -= load->mix[1];
+        if (pick < load->mix[2]) {
+            live_remove(id);
+            return sprintf(line, "Cancel_Alarm(%d)\n", id);
+        }
+        return sprintf(line, "View_Alarms\n");
+    }
+    id = ++next_id;
+    ms = duration_ms(load);
+    live_add(id);
+    deadline[id] = now + ms * NSEC_PER_MSEC;
+    return sprintf(line, "Start_Alarm(%d): Ttype%d %dms message %d\n",
+        id, (int)(next_random() % load->types), ms, id);
+}
+
+/*
+ * Handle one line of the program's output, read at "now".
+ */
+void output_line(const char *line, long long now)
+{
+    int id;
+
+    if (sscanf(line, "Alarm(%d): Alarm Expired", &id) != 1 || strstr(line, "Alarm Expired") == NULL)
+        return;
+    if (id <= 0 || id > next_id || deadline[id] == 0)
+        return;
+    lateness[lateness_count++] = now - deadline[id];
+    live_remove(id);
+}
+
+/*
+ * Sample the program's thread count and peak resident set size.
+ */
+void sample_process(pid_t pid, int *threads, long *peak_kb)
+{
+    char path[64], line[256];
+    FILE *status;
+    int value;
+    long kb;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    status = fopen(path, "r");
+    if (status == NULL)
+        return;
+    while (fgets(line, sizeof(line), status) != NULL) {
+        if (sscanf(line, "Threads: %d", &value) == 1 && value > *threads)
+            *threads = value;
+        else if (sscanf(line, "VmHWM: %ld", &kb) == 1 && kb > *peak_kb)
+            *peak_kb = kb;
+    }
+    fclose(status);
+}
+
+int compare_ns(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+double percentile_ms(double fraction)
+{
+    int index;
+
+    if (lateness_count == 0)
+        return 0;
+    index = (int)(fraction * (lateness_count - 1) + 0.5);
+    return lateness[index] / 1e6;
+}
+
+int parse_distribution(load_t *load, const char *text)
+{
+    if (sscanf(text, "fixed:%d", &load->low_ms) == 1) {
+        load->distribution = DURATION_FIXED;
+        return load->low_ms > 0;
+    }
+    if (sscanf(text, "uniform:%d:%d", &load->low_ms, &load->high_ms) == 2) {
+        load->distribution = DURATION_UNIFORM;
+        return load->low_ms > 0 && load->high_ms >= load->low_ms;
+    }
+    if (sscanf(text, "exp:%d", &load->low_ms) == 1) {
+        load->distribution = DURATION_EXP;
+        return load->low_ms > 0;
+    }
+    return 0;
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-p program] [-n commands] [-r rate] [-k types]\n"
+        "       [-d fixed:MS | uniform:LO:HI | exp:MEAN] [-m start,change,cancel,view]\n"
+        "       [-l label] [-o results] [-- program options]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    load_t load = { 100000, 10000.0, 16, DURATION_UNIFORM, 500, 3000, { 80, 10, 9, 1 } };
+    const char *program = "./new_alarm_mutex", *label = "run", *results = NULL;
+    char **program_argv, line[256], output[OUTPUT_SIZE], *newline, *start;
+    int input_fd[2], output_fd[2], null_fd, option, i, sent = 0, threads = 0, status;
+    long long begin, now, next_send, next_sample, last_deadline = 0, send_ns, elapsed = 0;
+    size_t output_len = 0, pending_len = 0, pending_off = 0;
+    struct pollfd fds[2];
+    ssize_t bytes;
+    long peak_kb = 0;
+    FILE *file;
+    pid_t child;
+
+    while ((option = getopt(argc, argv, "p:n:r:k:d:m:l:o:")) != -1) {
+        switch (option) {
+        case 'p':
+            program = optarg;
+            break;
+        case 'n':
+            load.commands = atoi(optarg);
+            break;
+        case 'r':
+            load.rate = atof(optarg);
+            break;
+        case 'k':
+            load.types = atoi(optarg);
+            break;
+        case 'd':
+            if (!parse_distribution(&load, optarg))
+                usage(argv[0]);
+            break;
+        case 'm':
+            if (sscanf(optarg, "%d,%d,%d,%d", &load.mix[0], &load.mix[1], &load.mix[2], &load.mix[3]) != 4
+                    || load.mix[0] + load.mix[1] + load.mix[2] + load.mix[3] != 100)
+                usage(argv[0]);
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        case 'o':
+            results = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (load.commands <= 0 || load.rate <= 0 || load.types <= 0) {
+        fprintf(stderr, "The commands, rate and types must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    live = malloc((load.commands + 1) * sizeof(int));
+    position = malloc((load.commands + 1) * sizeof(int));
+    deadline = calloc(load.commands + 1, sizeof(long long));
+    lateness = malloc((load.commands + 1) * sizeof(long long));
+    program_argv = malloc((argc - optind + 2) * sizeof(char *));
+    if (live == NULL || position == NULL || deadline == NULL || lateness == NULL || program_argv == NULL)
+        errno_abort ("Allocate load state");
+    memset(position, -1, (load.commands + 1) * sizeof(int));
+    program_argv[0] = (char *)program;
+    for (i = optind; i < argc; i++)
+        program_argv[i - optind + 1] = argv[i];
+    program_argv[argc - optind + 1] = NULL;
+    signal(SIGPIPE, SIG_IGN);
+
+    if (pipe(input_fd) == -1 || pipe(output_fd) == -1)
+        errno_abort ("Create pipe");
+    child = fork();
+    if (child == -1)
+        errno_abort ("Fork");
+    if (child == 0) {
+        null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd == -1)
+            errno_abort ("Open /dev/null");
+        dup2(input_fd[0], STDIN_FILENO);
+        dup2(output_fd[1], STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(input_fd[0]);
+        close(input_fd[1]);
+        close(output_fd[0]);
+        close(output_fd[1]);
+        close(null_fd);
+        execv(program, program_argv);
+        _exit(127);
+    }
+    close(input_fd[0]);
+    close(output_fd[1]);
+    if (fcntl(input_fd[1], F_SETFL, O_NONBLOCK) == -1)
+        errno_abort ("Set non-blocking");
+
+    /*
+     * Commands are written on schedule, one every 1/rate seconds; a
+     * command that cannot be written at once waits in "line" and
+     * holds up the rest. The output is read whenever there is any.
+     * Once every command is sent, the run goes on until the last
+     * expected expiry is seen, or DRAIN_NS after it was due.
+     */
+    send_ns = (long long)(NSEC_PER_SEC / load.rate);
+    begin = monotonic_ns();
+    next_send = begin;
+    next_sample = begin;
+    while (1) {
+        now = monotonic_ns();
+        if (now >= next_sample) {
+            sample_process(child, &threads, &peak_kb);
+            next_sample = now + SAMPLE_NS;
+        }
+        while (sent < load.commands && now >= next_send) {
+            if (pending_len == 0) {
+                pending_len = make_command(&load, line, now);
+                pending_off = 0;
+            }
+            bytes = write(input_fd[1], line + pending_off, pending_len - pending_off);
+            if (bytes == -1) {
+                if (errno == EAGAIN || errno == EINTR)
+                    break;
+                errno_abort ("Write commands");
+            }
+            pending_off += bytes;
+            if (pending_off < pending_len)
+                break;
+            pending_len = 0;
+            sent++;
+            next_send += send_ns;
+        }
+        if (sent == load.commands) {
+            if (last_deadline == 0) {
+                elapsed = now - begin;
+                for (i = 1; i <= next_id; i++)
+                    if (deadline[i] > last_deadline)
+                        last_deadline = deadline[i];
+                if (last_deadline == 0)
+                    last_deadline = now;
+            }
+            if (live_count == 0 || now > last_deadline + DRAIN_NS)
+                break;
+        }
+
+        fds[0].fd = output_fd[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = input_fd[1];
+        fds[1].events = pending_len > 0 ? POLLOUT : 0;
+        if (poll(fds, 2, sent < load.commands && pending_len == 0 ? 1 : 10) == -1 && errno != EINTR)
+            errno_abort ("Poll");
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            bytes = read(output_fd[0], output + output_len, sizeof(output) - 1 - output_len);
+            if (bytes <= 0)
+                break;
+            now = monotonic_ns();
+            output_len += bytes;
+            output[output_len] = '\0';
+            for (start = output; (newline = strchr(start, '\n')) != NULL; start = newline + 1) {
+                *newline = '\0';
+                output_line(start, now);
+            }
+            output_len -= start - output;
+            memmove(output, start, output_len);
+            if (output_len == sizeof(output) - 1)
+                output_len = 0;
+        }
+    }
+    sample_process(child, &threads, &peak_kb);
+    close(input_fd[1]);
+    kill(child, SIGTERM);
+    while (read(output_fd[0], output, sizeof(output)) > 0)
+        ;
+    waitpid(child, &status, 0);
+
+    qsort(lateness, lateness_count, sizeof(long long), compare_ns);
+    printf("%s: %d commands at %.0f/s requested, %.0f/s achieved\n", label, sent,
+        load.rate, elapsed > 0 ? (double)sent * NSEC_PER_SEC / elapsed : 0.0);
+    printf("expiries seen %d, missed %d\n", lateness_count, live_count);
+    printf("expiry lateness ms: p50 %.3f  p99 %.3f  p999 %.3f  max %.3f\n",
+        percentile_ms(0.5), percentile_ms(0.99), percentile_ms(0.999), percentile_ms(1.0));
+    printf("peak threads %d, peak RSS %.1f MB\n", threads, peak_kb / 1024.0);
+
+    if (results != NULL) {
+        file = fopen(results, "a");
+        if (file == NULL)
+            errno_abort ("Open results");
+        fprintf(file, "%s commands=%d rate=%.0f achieved=%.0f expiries=%d missed=%d "
+            "p50_ms=%.3f p99_ms=%.3f p999_ms=%.3f threads=%d rss_mb=%.1f\n",
+            label, sent, load.rate, elapsed > 0 ? (double)sent * NSEC_PER_SEC / elapsed : 0.0,
+            lateness_count, live_count, percentile_ms(0.5), percentile_ms(0.99),
+            percentile_ms(0.999), threads, peak_kb / 1024.0);
+        fclose(file);
+    }
+    return 0;
+}
@@ -0,0 +1,312 @@
+/*
+ * bench_recurring.c
+ *
+ * Benchmark of recurring alarms in new_alarm_mutex.c against the way
+ * periodic jobs were run before there were any: sending Start_Alarm
+ * again every interval. Both runs keep -n alarms going off every -t
+ * milliseconds, -r times each, on the same schedule: the k-th time
+ * an alarm goes off is due k intervals after the first command was
+ * written.
+ *
+ *  - "recurring" writes one Start_Recurring_Alarm per alarm, with a
+ *    count of -r, and nothing more.
+ *  - "resubmit" writes a Start_Alarm per alarm at the start of each
+ *    interval, with fresh ids, since an alarm that has gone off may
+ *    not have been removed yet when the next one is sent.
+ *
+ * It reads the program's output as it comes and notes when each
+ * "Alarm Went Off" or "Alarm Expired" line arrives. The drift of a
+ * firing is how long after its place in the schedule the line was
+ * read. It reports the firings seen, the drift percentiles, the
+ * bytes of commands written, the program's CPU time (user and
+ * system, from wait4), and its peak resident set size.
+ *
+ *      cc new_alarm_mutex.c -o new_alarm_mutex -lpthread
+ *      cc -O2 bench_recurring.c -o bench_recurring
+ *      ./bench_recurring [-p program] [-n alarms] [-t interval_ms] [-r times] [-k types] [-- program options]
+ */
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "errors.h"
+
+#define NSEC_PER_SEC        1000000000LL
+#define NSEC_PER_MSEC       1000000LL
+#define OUTPUT_SIZE         65536
+#define DRAIN_NS            (5 * NSEC_PER_SEC)      /* wait past the last firing */
+#define PROGRAM_ARGS_MAX    32
+
+typedef struct result_tag {
+    long                fired;
+    long long           *drift;     /* one per firing seen */
+    long long           written;    /* command bytes */
+    double              cpu_seconds;
+    long                peak_kb;
+} result_t;
+
+int alarms = 100000, interval_ms = 1000, times = 5, types = 16;
+int *fired_count;                   /* per alarm, the times seen to go off */
+
+long long monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+/*
+ * Format the commands written at the start of interval "round":
+ * every recurring alarm at once in the first, or one more one-shot
+ * alarm per alarm in each. Returns their length, 0 if there are
+ * none.
+ */
+size_t make_round(char *text, int recurring, int round)
+{
+    size_t used = 0;
+    int i;
+
+    if (recurring && round > 0)
+        return 0;
+    for (i = 0; i < alarms; i++) {
+        if (recurring)
+            used += sprintf(text + used, "Start_Recurring_Alarm(%d): Ttype%d %dms*%d job %d\n",
+                i + 1, i % types, interval_ms, times, i);
+        else
+            used += sprintf(text + used, "Start_Alarm(%d): Ttype%d %dms job %d\n",
+                round * alarms + i + 1, i % types, interval_ms, i);
+    }
+    return used;
+}
+
+/*
+ * Handle one line of the program's output, read at "now". The k-th
+ * firing of an alarm is due k intervals after "begin".
+ */
+void output_line(const char *line, long long begin, long long now, result_t *result)
+{
+    int id, alarm;
+
+    if (sscanf(line, "Alarm(%d): Alarm ", &id) != 1
+            || (strstr(line, "Alarm Went Off") == NULL && strstr(line, "Alarm Expired") == NULL))
+        return;
+    if (id <= 0 || id > alarms * times)
+        return;
+    alarm = (id - 1) % alarms;
+    fired_count[alarm]++;
+    result->drift[result->fired++] = now - (begin + fired_count[alarm] * (long long)interval_ms * NSEC_PER_MSEC);
+}
+
+long sample_peak_kb(pid_t pid)
+{
+    char path[64], line[256];
+    FILE *status;
+    long kb = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    status = fopen(path, "r");
+    if (status == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), status) != NULL)
+        if (sscanf(line, "VmHWM: %ld", &kb) == 1)
+            break;
+    fclose(status);
+    return kb;
+}
+
+/*
+ * Run the program once, writing each interval's commands on
+ * schedule, until every firing has been seen or DRAIN_NS after the
+ * last was due.
+ */
+void run(const char *program, char **extra, int extra_count, int recurring, char *text, result_t *result)
+{
+    const char *args[PROGRAM_ARGS_MAX + 2];
+    char output[OUTPUT_SIZE], *newline, *start;
+    int input_fd[2], output_fd[2], null_fd, status, round = 0, i;
+    long long begin, now, next_round, last_due;
+    size_t length = 0, offset = 0, output_len = 0;
+    struct pollfd fds[2];
+    struct rusage usage;
+    ssize_t bytes;
+    pid_t child;
+
+    args[0] = program;
+    for (i = 0; i < extra_count; i++)
+        args[1 + i] = extra[i];
+    args[1 + extra_count] = NULL;
+    memset(fired_count, 0, alarms * sizeof(int));
+    result->fired = 0;
+    result->written = 0;
+    result->peak_kb = 0;
+
+    if (pipe(input_fd) == -1 || pipe(output_fd) == -1)
+        errno_abort ("Create pipe");
+    child = fork();
+    if (child == -1)
+        errno_abort ("Fork");
+    if (child == 0) {
+        null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd == -1)
+            errno_abort ("Open /dev/null");
+        dup2(input_fd[0], STDIN_FILENO);
+        dup2(output_fd[1], STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(input_fd[0]);
+        close(input_fd[1]);
+        close(output_fd[0]);
+        close(output_fd[1]);
+        close(null_fd);
+        execv(program, (char * const *)args);
+        _exit(127);
+    }
+    close(input_fd[0]);
+    close(output_fd[1]);
+    if (fcntl(input_fd[1], F_SETFL, O_NONBLOCK) == -1)
+        errno_abort ("Set non-blocking");
+
+    begin = monotonic_ns();
+    next_round = begin;
+    last_due = begin + (long long)times * interval_ms * NSEC_PER_MSEC;
+    while (1) {
+        now = monotonic_ns();
+        if (offset == length && round < times && now >= next_round) {
+            length = make_round(text, recurring, round);
+            offset = 0;
+            result->written += length;
+            round++;
+            next_round += (long long)interval_ms * NSEC_PER_MSEC;
+        }
+        while (offset < length) {
+            bytes = write(input_fd[1], text + offset, length - offset);
+            if (bytes == -1) {
+                if (errno == EAGAIN || errno == EINTR)
+                    break;
+                errno_abort ("Write commands");
+            }
+            offset += bytes;
+        }
+        if (result->fired == (long)alarms * times || now > last_due + DRAIN_NS)
+            break;
+
+        fds[0].fd = output_fd[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = input_fd[1];
+        fds[1].events = offset < length ? POLLOUT : 0;
+        if (poll(fds, 2, 1) == -1 && errno != EINTR)
+            errno_abort ("Poll");
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            bytes = read(output_fd[0], output + output_len, sizeof(output) - 1 - output_len);
+            if (bytes <= 0)
+                break;
+            now = monotonic_ns();
+            output_len += bytes;
+            output[output_len] = '\0';
+            for (start = output; (newline = strchr(start, '\n')) != NULL; start = newline + 1) {
+                *newline = '\0';
+                output_line(start, begin, now, result);
+            }
+            output_len -= start - output;
+            memmove(output, start, output_len);
+            if (output_len == sizeof(output) - 1)
+                output_len = 0;
+        }
+    }
+    result->peak_kb = sample_peak_kb(child);
+    close(input_fd[1]);
+    kill(child, SIGTERM);
+    while (read(output_fd[0], output, sizeof(output)) > 0)
+        ;
+    close(output_fd[0]);
+    if (wait4(child, &status, 0, &usage) == -1)
+        errno_abort ("Wait for program");
+    result->cpu_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+        + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+int compare_ns(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+double percentile_ms(result_t *result, double fraction)
+{
+    long index;
+
+    if (result->fired == 0)
+        return 0;
+    index = (long)(fraction * (result->fired - 1) + 0.5);
+    return result->drift[index] / 1e6;
+}
+
+void report(const char *label, result_t *result)
+{
+    qsort(result->drift, result->fired, sizeof(long long), compare_ns);
+    printf("%-10s %9ld %11.1f %9.3f %9.3f %9.3f %9.2f %9.1f\n", label, result->fired,
+        result->written / 1e6, percentile_ms(result, 0.5), percentile_ms(result, 0.99),
+        percentile_ms(result, 1.0), result->cpu_seconds, result->peak_kb / 1024.0);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *program = "./new_alarm_mutex";
+    int option;
+    result_t result;
+    char *text;
+
+    while ((option = getopt(argc, argv, "p:n:t:r:k:")) != -1) {
+        switch (option) {
+        case 'p':
+            program = optarg;
+            break;
+        case 'n':
+            alarms = atoi(optarg);
+            break;
+        case 't':
+            interval_ms = atoi(optarg);
+            break;
+        case 'r':
+            times = atoi(optarg);
+            break;
+        case 'k':
+            types = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p program] [-n alarms] [-t interval_ms] [-r times] [-k types] [-- program options]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (alarms <= 0 || interval_ms <= 0 || times <= 0 || types <= 0 || (long long)alarms * times > 1000000000LL
+            || argc - optind > PROGRAM_ARGS_MAX) {
+        fprintf(stderr, "The alarms, interval, times and types must be positive, with at most %d program options\n",
+            PROGRAM_ARGS_MAX);
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    text = malloc((size_t)alarms * 96);
+    fired_count = malloc(alarms * sizeof(int));
+    result.drift = malloc((size_t)alarms * times * sizeof(long long));
+    if (text == NULL || fired_count == NULL || result.drift == NULL)
+        errno_abort ("Allocate benchmark state");
+
+    printf("%d alarms going off every %d ms, %d times, %d types, run by %s\n",
+        alarms, interval_ms, times, types, program);
+    printf("%-10s %9s %11s %9s %9s %9s %9s %9s\n", "mode", "fired", "written MB",
+        "p50 ms", "p99 ms", "max ms", "cpu s", "peak MB");
+    run(program, argv + optind, argc - optind, 0, text, &result);
+    report("resubmit", &result);
+    run(program, argv + optind, argc - optind, 1, text, &result);
+    report("recurring", &result);
+
+    free(result.drift);
+    free(fired_count);
+    free(text);
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * bench_restart.c
+ *
+ * Restart benchmark for the persistence of new_alarm_mutex.c (its -p
+ * option). It loads the given number of long-lived alarms into the
+ * program through standard input, lets the program exit, and then
+ * times a restart from what it left on disk: once with the write-ahead
+ * log alone (no snapshot taken), and once with snapshots taken every
+ * -P megabytes of log, so that only the log tail is replayed. The
+ * restarted program is given no commands, so it exits as soon as it
+ * has recovered the alarms and handed them to its alarm thread.
+ *
+ *      cc new_alarm_mutex.c -o new_alarm_mutex -lpthread
+ *      cc -O2 bench_restart.c -o bench_restart
+ *      ./bench_restart [-p program] [-n alarms] [-d directory] [-P snapshot_mb]
+ */
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "errors.h"
+
+#define NSEC_PER_SEC        1000000000LL
+#define NO_SNAPSHOT         "1000000"   /* -P large enough never to snapshot */
+
+long long monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+/*
+ * One Start_Alarm per alarm, each an hour long, so that none expires
+ * before the restart.
+ */
+char *make_commands(int alarms, size_t *length)
+{
+    size_t size = (size_t)alarms * 64, used = 0;
+    char *text = malloc(size);
+    int id;
+
+    if (text == NULL)
+        errno_abort ("Allocate commands");
+    for (id = 1; id <= alarms; id++)
+        used += sprintf(text + used, "Start_Alarm(%d): Ttype%d 3600 message %d\n", id, id % 13, id);
+    *length = used;
+    return text;
+}
+
+/*
+ * Remove the files a previous run left in the directory, and return
+ * the total size of those there now if "size_only" is set.
+ */
+long long scan_directory(const char *directory, int size_only)
+{
+    char path[4096];
+    struct dirent *entry;
+    struct stat info;
+    long long total = 0;
+    DIR *dir;
+
+    dir = opendir(directory);
+    if (dir == NULL) {
+        if (errno == ENOENT)
+            return 0;
+        errno_abort ("Open directory");
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, "snapshot") != 0 && strcmp(entry->d_name, "snapshot.tmp") != 0
+                && strncmp(entry->d_name, "wal.", 4) != 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        if (size_only) {
+            if (stat(path, &info) == 0)
+                total += info.st_size;
+        } else if (unlink(path) == -1)
+            errno_abort ("Remove persisted file");
+    }
+    closedir(dir);
+    return total;
+}
+
+/*
+ * Run the program once, feed it "text", and return the elapsed time
+ * in nanoseconds. Its standard error is kept in "report".
+ */
+long long run(const char *program, const char *directory, const char *snapshot_mb,
+    const char *text, size_t length, char *report, size_t report_size)
+{
+    int input_fd[2], error_fd[2], null_fd, status;
+    long long start, elapsed;
+    ssize_t bytes;
+    size_t offset = 0, got = 0;
+    pid_t child;
+
+    if (pipe(input_fd) == -1 || pipe(error_fd) == -1)
+        errno_abort ("Create pipe");
+
+    child = fork();
+    if (child == -1)
+        errno_abort ("Fork");
+    if (child == 0) {
+        null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd == -1)
+            errno_abort ("Open /dev/null");
+        dup2(input_fd[0], STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(error_fd[1], STDERR_FILENO);
+        close(input_fd[0]);
+        close(input_fd[1]);
+        close(error_fd[0]);
+        close(error_fd[1]);
+        close(null_fd);
+        execl(program, program, "-p", directory, "-P", snapshot_mb, (char *)NULL);
+        _exit(127);
+    }
+    close(input_fd[0]);
+    close(error_fd[1]);
+
+    start = monotonic_ns();
+    while (offset < length) {
+        bytes = write(input_fd[1], text + offset, length - offset);
+        if (bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            errno_abort ("Write commands");
+        }
+        offset += bytes;
+    }
+    close(input_fd[1]);
+    while ((bytes = read(error_fd[0], report + got, report_size - 1 - got)) > 0)
+        got += bytes;
+    report[got] = '\0';
+    close(error_fd[0]);
+    if (waitpid(child, &status, 0) == -1)
+        errno_abort ("Wait for program");
+    elapsed = monotonic_ns() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s -p %s did not run to completion: %s\n", program, directory, report);
+        exit(EXIT_FAILURE);
+    }
+    return elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *program = "./new_alarm_mutex", *directory = "/tmp/bench_restart";
+    const char *snapshot_mb = "16", *modes[2], *names[2] = { "log only", "snapshot+log" };
+    char report[4096], *recovered;
+    long long load_ns, restart_ns, bytes;
+    int alarms = 1000000, option, mode;
+    size_t length;
+    char *text;
+
+    while ((option = getopt(argc, argv, "p:n:d:P:")) != -1) {
+        switch (option) {
+        case 'p':
+            program = optarg;
+            break;
+        case 'n':
+            alarms = atoi(optarg);
+            break;
+        case 'd':
+            directory = optarg;
+            break;
+        case 'P':
+            snapshot_mb = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p program] [-n alarms] [-d directory] [-P snapshot_mb]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (alarms <= 0) {
+        fprintf(stderr, "There must be at least one alarm\n");
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    modes[0] = NO_SNAPSHOT;
+    modes[1] = snapshot_mb;
+
+    text = make_commands(alarms, &length);
+    printf("%d pending alarms, persisted in %s\n", alarms, directory);
+    printf("%-14s %10s %12s %12s  %s\n", "mode", "load s", "on disk MB", "restart s", "recovery");
+    for (mode = 0; mode < 2; mode++) {
+        scan_directory(directory, 0);
+        load_ns = run(program, directory, modes[mode], text, length, report, sizeof(report));
+        bytes = scan_directory(directory, 1);
+        restart_ns = run(program, directory, modes[mode], "", 0, report, sizeof(report));
+        recovered = strstr(report, "Recovered");
+        if (recovered != NULL)
+            recovered[strcspn(recovered, "\n")] = '\0';
+        printf("%-14s %10.2f %12.1f %12.3f  %s\n", names[mode], (double)load_ns / NSEC_PER_SEC,
+            bytes / 1048576.0, (double)restart_ns / NSEC_PER_SEC, recovered != NULL ? recovered : "");
+        fflush(stdout);
+    }
+    scan_directory(directory, 0);
+    free(text);
+    return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * bench_scale.c
+ *
+ * Scaling benchmark for the schedulers of new_alarm_mutex.c (its -R
+ * option). It generates a burst of Start_Alarm, Change_Alarm and
+ * Cancel_Alarm commands, pipes the whole burst into the program with
+ * 1, 2, 4, ... schedulers up to the number of processors (or -r),
+ * and reports the command rate of each, and its speedup and
+ * efficiency over one scheduler. Each run is timed from the first
+ * write to the program's exit, and the best of -t runs is kept.
+ * Options after "--" are passed to the program; "-- -j file" takes
+ * the text output, which one log thread writes for all schedulers,
+ * out of the measurement.
+ *
+ *      cc new_alarm_mutex.c -o new_alarm_mutex -lpthread
+ *      cc -O2 bench_scale.c -o bench_scale
+ *      ./bench_scale [-p program] [-n commands] [-r max_schedulers] [-t runs] [-- program options]
+ */
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "errors.h"
+
+#define NSEC_PER_SEC        1000000000LL
+#define PROGRAM_ARGS_MAX    32
+
+long long monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+/*
+ * Build the command burst. It keeps a steady window of LIVE alarms,
+ * so that the cost of a command does not grow with the length of
+ * the run: each alarm is started, changed to another type (which
+ * keeps the alarm threads busy) once LIVE / 2 more have started,
+ * and cancelled once LIVE more have. One alarm in sixteen is
+ * started with 20 ms rather than ten minutes, so that every
+ * scheduler's expiry sweep has work during the run; its change and
+ * cancel then find nothing, and say so.
+ */
+#define LIVE                4096
+
+char *make_commands(int commands, size_t *length)
+{
+    size_t size = (size_t)commands * 64 + 64, used = 0;
+    char *text = malloc(size);
+    int id = 0, n = 0;
+
+    if (text == NULL)
+        errno_abort ("Allocate commands");
+    while (n < commands) {
+        id++;
+        used += sprintf(text + used, "Start_Alarm(%d): Ttype%d %s message %d\n", id, id % 13,
+            id % 16 == 0 ? "20ms" : "600", id);
+        if (++n < commands && id > LIVE / 2) {
+            used += sprintf(text + used, "Change_Alarm(%d): Tchanged%d 600 changed\n", id - LIVE / 2, id % 7);
+            n++;
+        }
+        if (n < commands && id > LIVE) {
+            used += sprintf(text + used, "Cancel_Alarm(%d)\n", id - LIVE);
+            n++;
+        }
+    }
+    *length = used;
+    return text;
+}
+
+/*
+ * Run the program once with "schedulers" schedulers, feed it the
+ * commands, and return the elapsed time in nanoseconds.
+ */
+long long run(const char *program, int schedulers, char **extra, int extra_count,
+    const char *text, size_t length)
+{
+    char schedulers_arg[16];
+    const char *args[PROGRAM_ARGS_MAX + 4];
+    int pipe_fd[2], null_fd, status, i;
+    long long start;
+    ssize_t written;
+    size_t offset = 0;
+    pid_t child;
+
+    if (pipe(pipe_fd) == -1)
+        errno_abort ("Create pipe");
+    snprintf(schedulers_arg, sizeof(schedulers_arg), "%d", schedulers);
+    args[0] = program;
+    args[1] = "-R";
+    args[2] = schedulers_arg;
+    for (i = 0; i < extra_count; i++)
+        args[3 + i] = extra[i];
+    args[3 + extra_count] = NULL;
+
+    child = fork();
+    if (child == -1)
+        errno_abort ("Fork");
+    if (child == 0) {
+        null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd == -1)
+            errno_abort ("Open /dev/null");
+        dup2(pipe_fd[0], STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        close(null_fd);
+        execv(program, (char * const *)args);
+        _exit(127);
+    }
+    close(pipe_fd[0]);
+
+    start = monotonic_ns();
+    while (offset < length) {
+        written = write(pipe_fd[1], text + offset, length - offset);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            errno_abort ("Write commands");
+        }
+        offset += written;
+    }
+    close(pipe_fd[1]);
+    if (waitpid(child, &status, 0) == -1)
+        errno_abort ("Wait for program");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s -R %d did not run to completion\n", program, schedulers);
+        exit(EXIT_FAILURE);
+    }
+    return monotonic_ns() - start;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *program = "./new_alarm_mutex";
+    int commands = 400000, runs = 3, option, schedulers, last, i;
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_schedulers = processors > 0 ? (int)processors : 1;
+    long long elapsed, best, base = 0;
+    size_t length;
+    char *text;
+
+    while ((option = getopt(argc, argv, "p:n:r:t:")) != -1) {
+        switch (option) {
+        case 'p':
+            program = optarg;
+            break;
+        case 'n':
+            commands = atoi(optarg);
+            break;
+        case 'r':
+            max_schedulers = atoi(optarg);
+            break;
+        case 't':
+            runs = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p program] [-n commands] [-r max_schedulers] [-t runs] [-- program options]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (commands <= 0 || max_schedulers <= 0 || runs <= 0 || argc - optind > PROGRAM_ARGS_MAX) {
+        fprintf(stderr, "There must be at least one command, scheduler and run, and at most %d program options\n",
+            PROGRAM_ARGS_MAX);
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    text = make_commands(commands, &length);
+    printf("%d commands (%zu bytes) piped into %s, %ld processors, best of %d\n",
+        commands, length, program, processors, runs);
+    printf("%10s %10s %14s %9s %11s\n", "schedulers", "seconds", "commands/s", "speedup", "efficiency");
+    for (schedulers = 1, last = 0; !last; schedulers *= 2) {
+        //the largest count is always measured, even when it is not a power of two
+        if (schedulers >= max_schedulers) {
+            schedulers = max_schedulers;
+            last = 1;
+        }
+        best = 0;
+        for (i = 0; i < runs; i++) {
+            elapsed = run(program, schedulers, argv + optind, argc - optind, text, length);
+            if (best == 0 || elapsed < best)
+                best = elapsed;
+        }
+        if (base == 0)
+            base = best;
+        printf("%10d %10.3f %14.0f %8.2fx %10.0f%%\n", schedulers, (double)best / NSEC_PER_SEC,
+            (double)commands * NSEC_PER_SEC / best, (double)base / best,
+            100.0 * base / best / schedulers);
+        fflush(stdout);
+    }
+    free(text);
+    return 0;
+}
@@ -0,0 +1,250 @@
+/*
+ * bench_server.c
+ *
+ * Benchmark for the socket front end of new_alarm_mutex.c (its -u
+ * option). It starts the program as a server and, for 1, 2, 4, ...
+ * concurrent clients, has every client connect and send its share of
+ * commands, keeping up to -w of them in flight without waiting for
+ * their replies. Each client works through its own alarms: a
+ * Start_Alarm, then a Change_Alarm, then a Cancel_Alarm for each, so
+ * the alarm list stays small and every command gets a reply. It
+ * reports the aggregate commands per second and the reply latency,
+ * from when a command was written to when the empty line that ends
+ * its reply was read.
+ *
+ *      cc new_alarm_mutex.c -o new_alarm_mutex -lpthread
+ *      cc -O2 bench_server.c -o bench_server -lpthread
+ *      ./bench_server [-p program] [-u socket] [-c max_clients] [-n commands_per_client] [-w window]
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "errors.h"
+
+#define NSEC_PER_SEC        1000000000LL
+#define REPLY_SIZE          65536
+
+typedef struct client_tag {
+    pthread_t           thread;
+    int                 index;
+    int                 commands;
+    int                 window;
+    const char          *path;
+    long long           *latency;   /* one per command */
+} client_t;
+
+long long monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+int connect_socket(const char *path)
+{
+    struct sockaddr_un address;
+    int fd;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        errno_abort ("Create socket");
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Command n of a client: Start, Change and Cancel of one alarm in
+ * turn. Every alarm is cancelled by the end of a run, so the next
+ * run can use the same ids.
+ */
+int make_command(client_t *client, int n, char *line)
+{
+    int id = client->index * 8000000 + n / 3;
+
+    switch (n % 3) {
+    case 0:
+        return sprintf(line, "Start_Alarm(%d): Tc%d 3600 message %d\n", id, client->index, n);
+    case 1:
+        return sprintf(line, "Change_Alarm(%d): Tc%d 1800 changed %d\n", id, client->index, n);
+    default:
+        return sprintf(line, "Cancel_Alarm(%d)\n", id);
+    }
+}
+
+void *client_routine(void *arg)
+{
+    client_t *client = arg;
+    char requests[REPLY_SIZE], replies[REPLY_SIZE];
+    long long *sent_at, now;
+    int fd, sent = 0, received = 0, line_start = 1, first, i;
+    size_t used;
+    ssize_t bytes;
+
+    sent_at = malloc(client->window * sizeof(long long));
+    if (sent_at == NULL)
+        errno_abort ("Allocate send times");
+    fd = connect_socket(client->path);
+    if (fd == -1)
+        errno_abort ("Connect to server");
+
+    while (received < client->commands) {
+        //fill the window, in one write
+        used = 0;
+        for (first = sent; sent < client->commands && sent - received < client->window
+                && used + 128 < sizeof(requests); sent++)
+            used += make_command(client, sent, requests + used);
+        if (used > 0) {
+            now = monotonic_ns();
+            if (write(fd, requests, used) != (ssize_t)used)
+                errno_abort ("Write commands");
+            for (i = first; i < sent; i++)
+                sent_at[i % client->window] = now;
+        }
+
+        //a reply ends at an empty line
+        bytes = read(fd, replies, sizeof(replies));
+        if (bytes <= 0)
+            errno_abort ("Read replies");
+        for (i = 0; i < bytes; i++) {
+            if (replies[i] != '\n')
+                line_start = 0;
+            else if (!line_start)
+                line_start = 1;
+            else {
+                client->latency[received] = monotonic_ns() - sent_at[received % client->window];
+                received++;
+            }
+        }
+    }
+    close(fd);
+    free(sent_at);
+    return NULL;
+}
+
+int compare_ns(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *program = "./new_alarm_mutex", *path = "/tmp/bench_server.sock";
+    int max_clients = 8, commands = 30000, window = 16, option, clients, i, status;
+    int input_fd[2], null_fd;
+    client_t *client;
+    long long start, elapsed, *latency, total;
+    pid_t child;
+
+    while ((option = getopt(argc, argv, "p:u:c:n:w:")) != -1) {
+        switch (option) {
+        case 'p':
+            program = optarg;
+            break;
+        case 'u':
+            path = optarg;
+            break;
+        case 'c':
+            max_clients = atoi(optarg);
+            break;
+        case 'n':
+            commands = atoi(optarg);
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p program] [-u socket] [-c max_clients] [-n commands_per_client] [-w window]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (max_clients <= 0 || max_clients > 256 || commands <= 0 || commands > 24000000 || window <= 0) {
+        fprintf(stderr, "There must be 1 to 256 clients, up to 24000000 commands each, and at least one in flight\n");
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    //standard input is a pipe held open, so the server has nothing to read but its clients
+    if (pipe(input_fd) == -1)
+        errno_abort ("Create pipe");
+    child = fork();
+    if (child == -1)
+        errno_abort ("Fork");
+    if (child == 0) {
+        null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd == -1)
+            errno_abort ("Open /dev/null");
+        dup2(input_fd[0], STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        close(input_fd[0]);
+        close(input_fd[1]);
+        close(null_fd);
+        execl(program, program, "-u", path, (char *)NULL);
+        _exit(127);
+    }
+    close(input_fd[0]);
+    for (i = 0; i < 500; i++) {
+        status = connect_socket(path);
+        if (status != -1) {
+            close(status);
+            break;
+        }
+        usleep(10000);
+    }
+    if (i == 500) {
+        fprintf(stderr, "%s -u %s did not start listening\n", program, path);
+        exit(EXIT_FAILURE);
+    }
+
+    client = calloc(max_clients, sizeof(client_t));
+    latency = malloc((long)max_clients * commands * sizeof(long long));
+    if (client == NULL || latency == NULL)
+        errno_abort ("Allocate clients");
+
+    printf("%d commands per client, %d in flight\n", commands, window);
+    printf("%7s %14s %12s %12s %12s\n", "clients", "commands/s", "p50 us", "p99 us", "max us");
+    for (clients = 1; clients <= max_clients; clients *= 2) {
+        start = monotonic_ns();
+        for (i = 0; i < clients; i++) {
+            client[i].index = i;
+            client[i].commands = commands;
+            client[i].window = window;
+            client[i].path = path;
+            client[i].latency = latency + (long)i * commands;
+            status = pthread_create(&client[i].thread, NULL, client_routine, &client[i]);
+            if (status != 0)
+                err_abort (status, "Create client");
+        }
+        for (i = 0; i < clients; i++) {
+            status = pthread_join(client[i].thread, NULL);
+            if (status != 0)
+                err_abort (status, "Join client");
+        }
+        elapsed = monotonic_ns() - start;
+        total = (long long)clients * commands;
+        qsort(latency, total, sizeof(long long), compare_ns);
+        printf("%7d %14.0f %12.1f %12.1f %12.1f\n", clients, (double)total * NSEC_PER_SEC / elapsed,
+            latency[total / 2] / 1e3, latency[(long long)(total * 0.99)] / 1e3, latency[total - 1] / 1e3);
+        fflush(stdout);
+    }
+
+    kill(child, SIGTERM);
+    if (waitpid(child, &status, 0) == -1)
+        errno_abort ("Wait for program");
+    close(input_fd[1]);
+    free(latency);
+    free(client);
+    return 0;
+}
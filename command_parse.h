@@ -0,0 +1,351 @@
+/*
+ * command_parse.h
+ *
+ * The command line parser of new_alarm_mutex.c, kept apart so that
+ * bench_parse.c can time it. A line is tokenized in a single pass,
+ * with every field bounds-checked, into a command_t the caller
+ * provides; nothing is allocated. The keyword is recognized by
+ * switching on its length and first letters, then confirmed with
+ * one memcmp, instead of trying each keyword in turn.
+ *
+ *      Start_Alarm(<id>): T<type> <time>[~<slack>] <message>
+ *      Start_Recurring_Alarm(<id>): T<type> <time>[~<slack>][*<count>] <message>
+ *      Change_Alarm(<id>): T<type> <time>[~<slack>] <message>
+ *      Cancel_Alarm(<id>)
+ *      View_Alarms
+ *      Stats
+ *
+ * and the bulk commands, each of which acts on many alarms at once:
+ *
+ *      Start_Alarms(<id>..<id>): T<type> <time>[~<slack>] <message>
+ *      Cancel_Range(<id>..<id>)
+ *      Cancel_Type(T<type>)
+ *      Change_Type(T<type> -> T<type>)
+ *
+ * <time> is whole seconds ("5") or milliseconds ("250ms"). <slack>,
+ * in the same units, is how much later than <time> the alarm may go
+ * off, so that its expiry can share a wakeup with others; without
+ * it, the program's default applies. A recurring alarm goes off
+ * every <time>, <count> times or until it is cancelled. Id ranges
+ * include both ends.
+ */
+#ifndef __command_parse_h
+#define __command_parse_h
+
+#include <limits.h>
+#include <string.h>
+
+#define COMMAND_BAD         -1
+#define COMMAND_EMPTY       0
+#define COMMAND_CANCEL      1
+#define COMMAND_VIEW        2
+#define COMMAND_START       3
+#define COMMAND_CHANGE      4
+#define COMMAND_STATS       5
+#define COMMAND_START_RANGE 6       /* the bulk commands, see command_bulk */
+#define COMMAND_CANCEL_RANGE 7
+#define COMMAND_CANCEL_TYPE 8
+#define COMMAND_CHANGE_TYPE 9
+#define COMMAND_START_RECURRING 10
+
+#define COMMAND_TEXT_MAX    128     /* sizes of the type and message fields */
+#define COMMAND_START_MAX   65536   /* alarms one Start_Alarms may start */
+#define COMMAND_FOREVER     -1      /* repeats of a recurring alarm without a count */
+#define COMMAND_DEFAULT_SLACK -1    /* slack of an alarm given none */
+
+typedef struct command_tag {
+    int                 kind;       /* one of COMMAND_* */
+    int                 id;         /* first of a range */
+    int                 last_id;    /* last of a range */
+    int                 msecs;
+    int                 repeats;    /* times a recurring alarm goes off, 0 for a one-shot */
+    int                 slack;      /* milliseconds it may go off late, or COMMAND_DEFAULT_SLACK */
+    char                type[COMMAND_TEXT_MAX];
+    int                 type_id;    /* left for the caller to intern */
+    char                message[COMMAND_TEXT_MAX];
+    char                to_type[COMMAND_TEXT_MAX];  /* Change_Type's new type */
+    int                 to_type_id;
+} command_t;
+
+/*
+ * Whether a command kind acts on every alarm in an id range or of
+ * a type, rather than on one alarm id.
+ */
+static inline int command_bulk(int kind)
+{
+    return kind >= COMMAND_START_RANGE && kind <= COMMAND_CHANGE_TYPE;
+}
+
+/*
+ * Whether a command kind starts one alarm.
+ */
+static inline int command_start(int kind)
+{
+    return kind == COMMAND_START || kind == COMMAND_START_RECURRING;
+}
+
+static inline int command_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char *command_skip_space(const char *p)
+{
+    while (command_is_space(*p))
+        p++;
+    return p;
+}
+
+/*
+ * Parse an optionally signed decimal int. Returns the position
+ * after it, or NULL if there is none or it does not fit.
+ */
+static inline const char *command_parse_int(const char *p, int *value)
+{
+    long long result = 0;
+    int negative = 0;
+
+    if (*p == '-' || *p == '+')
+        negative = *p++ == '-';
+    if (*p < '0' || *p > '9')
+        return NULL;
+    while (*p >= '0' && *p <= '9') {
+        result = result * 10 + (*p++ - '0');
+        if (result > (long long)INT_MAX + 1)
+            return NULL;
+    }
+    if (negative)
+        result = -result;
+    if (result > INT_MAX || result < INT_MIN)
+        return NULL;
+    *value = (int)result;
+    return p;
+}
+
+/*
+ * Parse a duration of whole seconds ("5") or milliseconds
+ * ("250ms") into milliseconds. It must be followed by whitespace
+ * or by one of the characters of "stops". Returns the position
+ * after it, or NULL.
+ */
+static inline const char *command_parse_duration(const char *p, int *msecs, const char *stops)
+{
+    long long value = 0;
+
+    if (*p < '0' || *p > '9')
+        return NULL;
+    while (*p >= '0' && *p <= '9') {
+        value = value * 10 + (*p++ - '0');
+        if (value > 2000000000LL)
+            return NULL;
+    }
+    if (p[0] == 'm' && p[1] == 's')
+        p += 2;
+    else if (value > 2000000LL)
+        return NULL;
+    else
+        value *= 1000;
+    if (!command_is_space(*p) && (*p == '\0' || strchr(stops, *p) == NULL))
+        return NULL;
+    *msecs = (int)value;
+    return p;
+}
+
+/*
+ * Copy characters up to (not including) a space if "word" is set,
+ * "stop" unless it is '\0', or the end of the line, into a field
+ * of COMMAND_TEXT_MAX bytes. Returns the position after the copied
+ * text, or NULL if it is empty or does not fit.
+ */
+static inline const char *command_copy(const char *p, char *field, int word, char stop)
+{
+    const char *start = p;
+
+    while (*p != '\0' && *p != '\n' && !(word && command_is_space(*p)) && (stop == '\0' || *p != stop))
+        p++;
+    if (p == start || p - start >= COMMAND_TEXT_MAX)
+        return NULL;
+    memcpy(field, start, p - start);
+    field[p - start] = '\0';
+    return p;
+}
+
+/*
+ * Parse an id range "<id>..<id>", whose first id is not above its
+ * last. Returns the position after it, or NULL.
+ */
+static inline const char *command_parse_range(const char *p, command_t *command)
+{
+    if ((p = command_parse_int(p, &command->id)) == NULL || p[0] != '.' || p[1] != '.')
+        return NULL;
+    if ((p = command_parse_int(p + 2, &command->last_id)) == NULL || command->id > command->last_id)
+        return NULL;
+    return p;
+}
+
+/*
+ * Parse "T<type>" up to a space or ")" into a type field. Returns
+ * the position after it, or NULL.
+ */
+static inline const char *command_parse_type(const char *p, char *field)
+{
+    if (*p++ != 'T')
+        return NULL;
+    return command_copy(p, field, 1, ')');
+}
+
+/*
+ * Identify the keyword that starts a line, returning its command
+ * kind and setting *end past it, or COMMAND_BAD.
+ */
+static inline int command_keyword(const char *line, const char **end)
+{
+    const char *p = line;
+    int kind;
+
+    while (*p != '\0' && *p != '(' && *p != '\n' && !command_is_space(*p))
+        p++;
+    *end = p;
+    switch (p - line) {
+    case 5:
+        if (line[0] != 'S')
+            return COMMAND_BAD;
+        kind = COMMAND_STATS;
+        break;
+    case 11:
+        if (line[0] == 'S')
+            kind = COMMAND_START;
+        else if (line[0] == 'V')
+            kind = COMMAND_VIEW;
+        else if (line[0] != 'C')
+            return COMMAND_BAD;
+        else if (line[1] == 'h')
+            kind = COMMAND_CHANGE_TYPE;
+        else
+            kind = COMMAND_CANCEL_TYPE;
+        break;
+    case 21:
+        kind = COMMAND_START_RECURRING;
+        break;
+    case 12:
+        if (line[0] == 'S')
+            kind = COMMAND_START_RANGE;
+        else if (line[0] != 'C')
+            return COMMAND_BAD;
+        else if (line[1] == 'h')
+            kind = COMMAND_CHANGE;
+        else if (line[7] == 'R')
+            kind = COMMAND_CANCEL_RANGE;
+        else
+            kind = COMMAND_CANCEL;
+        break;
+    default:
+        return COMMAND_BAD;
+    }
+    switch (kind) {
+    case COMMAND_START:     return memcmp(line, "Start_Alarm", 11) == 0 ? kind : COMMAND_BAD;
+    case COMMAND_VIEW:      return memcmp(line, "View_Alarms", 11) == 0 ? kind : COMMAND_BAD;
+    case COMMAND_CHANGE:    return memcmp(line, "Change_Alarm", 12) == 0 ? kind : COMMAND_BAD;
+    case COMMAND_STATS:     return memcmp(line, "Stats", 5) == 0 ? kind : COMMAND_BAD;
+    case COMMAND_START_RANGE:   return memcmp(line, "Start_Alarms", 12) == 0 ? kind : COMMAND_BAD;
+    case COMMAND_CANCEL_RANGE:  return memcmp(line, "Cancel_Range", 12) == 0 ? kind : COMMAND_BAD;
+    case COMMAND_CANCEL_TYPE:   return memcmp(line, "Cancel_Type", 11) == 0 ? kind : COMMAND_BAD;
+    case COMMAND_CHANGE_TYPE:   return memcmp(line, "Change_Type", 11) == 0 ? kind : COMMAND_BAD;
+    case COMMAND_START_RECURRING:
+        return memcmp(line, "Start_Recurring_Alarm", 21) == 0 ? kind : COMMAND_BAD;
+    default:                return memcmp(line, "Cancel_Alarm", 12) == 0 ? kind : COMMAND_BAD;
+    }
+}
+
+/*
+ * Parse one command line (without its newline) into *command, and
+ * return its kind: COMMAND_EMPTY for a blank line, COMMAND_BAD if
+ * the line is not a well-formed command.
+ */
+static inline int command_parse(const char *line, command_t *command)
+{
+    const char *p = command_skip_space(line);
+
+    command->kind = COMMAND_EMPTY;
+    if (*p == '\0' || *p == '\n')
+        return COMMAND_EMPTY;
+
+    command->kind = command_keyword(p, &p);
+    if (command->kind == COMMAND_BAD)
+        return COMMAND_BAD;
+    if (command->kind == COMMAND_VIEW || command->kind == COMMAND_STATS) {
+        p = command_skip_space(p);
+        if (*p != '\0' && *p != '\n')
+            return command->kind = COMMAND_BAD;
+        return command->kind;
+    }
+
+    if (*p++ != '(')
+        return command->kind = COMMAND_BAD;
+    switch (command->kind) {
+    case COMMAND_START_RANGE:
+    case COMMAND_CANCEL_RANGE:
+        p = command_parse_range(p, command);
+        if (p != NULL && command->kind == COMMAND_START_RANGE
+                && (long long)command->last_id - command->id >= COMMAND_START_MAX)
+            p = NULL;
+        break;
+    case COMMAND_CANCEL_TYPE:
+        p = command_parse_type(command_skip_space(p), command->type);
+        if (p != NULL)
+            p = command_skip_space(p);
+        break;
+    case COMMAND_CHANGE_TYPE:
+        p = command_parse_type(command_skip_space(p), command->type);
+        if (p != NULL) {
+            p = command_skip_space(p);
+            p = p[0] == '-' && p[1] == '>' ? command_parse_type(command_skip_space(p + 2), command->to_type) : NULL;
+        }
+        if (p != NULL)
+            p = command_skip_space(p);
+        break;
+    default:
+        p = command_parse_int(p, &command->id);
+        command->last_id = command->id;
+        break;
+    }
+    if (p == NULL || *p++ != ')')
+        return command->kind = COMMAND_BAD;
+    if (!command_start(command->kind) && command->kind != COMMAND_CHANGE && command->kind != COMMAND_START_RANGE) {
+        p = command_skip_space(p);
+        if (*p != '\0' && *p != '\n')
+            return command->kind = COMMAND_BAD;
+        return command->kind;
+    }
+
+    //Start_Alarm, Change_Alarm and Start_Alarms go on with ": T<type> <time> <message>"
+    command->repeats = 0;
+    command->slack = COMMAND_DEFAULT_SLACK;
+    if (*p++ != ':')
+        return command->kind = COMMAND_BAD;
+    p = command_skip_space(p);
+    if (*p++ != 'T' || (p = command_copy(p, command->type, 1, '\0')) == NULL)
+        return command->kind = COMMAND_BAD;
+    p = command_skip_space(p);
+    if ((p = command_parse_duration(p, &command->msecs, command->kind == COMMAND_START_RECURRING ? "~*" : "~")) == NULL)
+        return command->kind = COMMAND_BAD;
+    //the time may be followed by "~<slack>"
+    if (*p == '~' && (p = command_parse_duration(p + 1, &command->slack,
+            command->kind == COMMAND_START_RECURRING ? "*" : "")) == NULL)
+        return command->kind = COMMAND_BAD;
+    //a recurring alarm's period may be followed by "*<count>"
+    if (command->kind == COMMAND_START_RECURRING) {
+        command->repeats = COMMAND_FOREVER;
+        if (*p == '*' && ((p = command_parse_int(p + 1, &command->repeats)) == NULL || command->repeats <= 0
+                || !command_is_space(*p)))
+            return command->kind = COMMAND_BAD;
+        if (command->msecs == 0)
+            return command->kind = COMMAND_BAD;
+    }
+    p = command_skip_space(p);
+    if (command_copy(p, command->message, 0, '\0') == NULL)
+        return command->kind = COMMAND_BAD;
+    return command->kind;
+}
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * command_ring.h
+ *
+ * A bounded, lock-free, multi-producer/single-consumer ring of
+ * alarms handed from the command readers to the alarm thread of
+ * new_alarm_mutex.c, replacing the single "new_alarm" slot that a
+ * second command could overwrite before the alarm thread took it.
+ *
+ * Each cell carries a sequence number (after D. Vyukov's bounded
+ * queue): a producer claims the cell at "tail" with a single
+ * compare-and-swap and publishes it by advancing the cell's
+ * sequence, and the consumer takes cells from "head" in order.
+ * Producers never take a lock. The consumer sleeps on a semaphore
+ * only after announcing so in "waiting", and a producer posts the
+ * semaphore only when it sees that announcement, so an idle ring
+ * costs no system calls on the producer side.
+ */
+#ifndef __command_ring_h
+#define __command_ring_h
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include "errors.h"
+
+struct alarm_tag;
+
+typedef struct command_cell_tag {
+    atomic_size_t       sequence;
+    struct alarm_tag    *alarm;
+} command_cell_t;
+
+typedef struct command_ring_tag {
+    command_cell_t      *cells;
+    size_t              mask;       /* capacity - 1, capacity a power of two */
+    atomic_size_t       tail;       /* next cell to be claimed by a producer */
+    size_t              head;       /* next cell to be taken by the consumer */
+    atomic_int          waiting;    /* 1 while the consumer sleeps, or is about to */
+    sem_t               wakeup;
+} command_ring_t;
+
+static inline void command_ring_init(command_ring_t *ring, size_t capacity)
+{
+    size_t i;
+
+    ring->cells = malloc(capacity * sizeof(command_cell_t));
+    if (ring->cells == NULL)
+        errno_abort ("Allocate command ring");
+    for (i = 0; i < capacity; i++)
+        atomic_init(&ring->cells[i].sequence, i);
+    ring->mask = capacity - 1;
+    atomic_init(&ring->tail, 0);
+    ring->head = 0;
+    atomic_init(&ring->waiting, 0);
+    if (sem_init(&ring->wakeup, 0, 0) == -1)
+        errno_abort ("Init semaphore");
+}
+
+/*
+ * Wake the consumer if it is waiting, after something was pushed.
+ */
+static inline void command_ring_notify(command_ring_t *ring)
+{
+    //pairs with the fence in command_ring_wait: either it sees the cell, or we see it waiting
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->waiting, memory_order_relaxed)
+            && atomic_exchange(&ring->waiting, 0)) {
+        if (sem_post(&ring->wakeup) == -1)
+            errno_abort ("Post semaphore");
+    }
+}
+
+/*
+ * Append an alarm to the ring, without waking the consumer.
+ * Returns -1, without waiting, if the ring is full.
+ */
+static inline int command_ring_try_push(command_ring_t *ring, struct alarm_tag *alarm)
+{
+    command_cell_t *cell;
+    size_t position, sequence;
+
+    position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (1) {
+        cell = &ring->cells[position & ring->mask];
+        sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        if (sequence == position) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &position, position + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if ((long)(sequence - position) < 0) {
+            return -1;
+        } else {
+            position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+    cell->alarm = alarm;
+    atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+    return 0;
+}
+
+/*
+ * Append an alarm to the ring. A full ring means the consumer is
+ * a whole ring behind; the producer yields until a cell frees up,
+ * but it never blocks on a lock the consumer might hold.
+ */
+static inline void command_ring_push(command_ring_t *ring, struct alarm_tag *alarm)
+{
+    while (command_ring_try_push(ring, alarm) != 0) {
+        command_ring_notify(ring);
+        sched_yield();
+    }
+    command_ring_notify(ring);
+}
+
+/*
+ * Append a batch of alarms to the ring, in order, waking the
+ * consumer once for the whole batch (or once per ring-full).
+ */
+static inline void command_ring_push_batch(command_ring_t *ring, struct alarm_tag **alarms, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        while (command_ring_try_push(ring, alarms[i]) != 0) {
+            command_ring_notify(ring);
+            sched_yield();
+        }
+    }
+    command_ring_notify(ring);
+}
+
+/*
+ * Take up to "max" alarms off the ring, oldest first. Returns the
+ * number taken, 0 if the ring is empty. Only the consumer may call
+ * this.
+ */
+static inline int command_ring_pop(command_ring_t *ring, struct alarm_tag **batch, int max)
+{
+    command_cell_t *cell;
+    int count = 0;
+
+    while (count < max) {
+        cell = &ring->cells[ring->head & ring->mask];
+        if (atomic_load_explicit(&cell->sequence, memory_order_acquire) != ring->head + 1)
+            break;
+        batch[count++] = cell->alarm;
+        atomic_store_explicit(&cell->sequence, ring->head + ring->mask + 1, memory_order_release);
+        ring->head++;
+    }
+    return count;
+}
+
+/*
+ * Sleep until a producer has pushed something. May return early,
+ * so the consumer must check the ring again afterwards.
+ */
+static inline void command_ring_wait(command_ring_t *ring)
+{
+    command_cell_t *cell = &ring->cells[ring->head & ring->mask];
+
+    atomic_store(&ring->waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&cell->sequence, memory_order_acquire) == ring->head + 1) {
+        atomic_store(&ring->waiting, 0);
+        return;
+    }
+    while (sem_wait(&ring->wakeup) == -1) {
+        if (errno != EINTR)
+            errno_abort ("Wait on semaphore");
+    }
+}
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * command_server.h
+ *
+ * The Unix domain socket front end of new_alarm_mutex.c (its -u
+ * option). Any number of local clients connect to the socket and
+ * send command lines in the same grammar as standard input, as many
+ * at a time as they like. Each command's reply -- the lines the
+ * program would have printed for it -- goes back to the client that
+ * sent it, in order, followed by an empty line, so a client can
+ * pipeline requests and still match up replies. Alarm expiry and
+ * display thread output is not a reply, and still goes to standard
+ * output.
+ *
+ * The server runs inside the main thread's epoll loop: the listening
+ * socket and every client are nonblocking, and a client is only
+ * watched for output while it has replies it could not take yet. A
+ * client is not read from while more than CLIENT_OUTPUT_MAX bytes of
+ * replies wait for it, so a client that does not read its replies
+ * slows down only itself.
+ */
+#ifndef __command_server_h
+#define __command_server_h
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "errors.h"
+
+#define CLIENT_INPUT_SIZE   16384   /* unparsed input per client */
+#define CLIENT_OUTPUT_MAX   (1024 * 1024)   /* replies waiting before reading stops */
+
+typedef struct client_tag {
+    int                 fd;
+    char                input[CLIENT_INPUT_SIZE];
+    size_t              input_len;
+    char                *output;    /* replies not yet written */
+    size_t              output_len;
+    size_t              output_size;
+    size_t              output_sent;
+    unsigned int        events;     /* what epoll watches it for */
+    int                 closing;    /* sent all it will; dropped once its replies are out */
+} client_t;
+
+typedef struct server_tag {
+    int                 fd;         /* listening socket, -1 if none */
+    const char          *path;
+    client_t            **clients;  /* indexed by file descriptor */
+    int                 slots;
+    int                 count;      /* connected clients */
+} server_t;
+
+/*
+ * Listen on a Unix domain socket at "path", replacing any socket
+ * a previous run left there.
+ */
+static inline void server_open(server_t *server, const char *path)
+{
+    struct sockaddr_un address;
+
+    memset(server, 0, sizeof(*server));
+    server->path = path;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, path);
+    server->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->fd == -1)
+        errno_abort ("Create socket");
+    if (unlink(path) == -1 && errno != ENOENT)
+        errno_abort ("Remove old socket");
+    if (bind(server->fd, (struct sockaddr *)&address, sizeof(address)) == -1)
+        errno_abort ("Bind socket");
+    if (listen(server->fd, SOMAXCONN) == -1)
+        errno_abort ("Listen on socket");
+}
+
+/*
+ * The client on file descriptor "fd", or NULL if it is not one.
+ */
+static inline client_t *server_client(server_t *server, int fd)
+{
+    return fd >= 0 && fd < server->slots ? server->clients[fd] : NULL;
+}
+
+static inline void server_watch(int epoll_fd, client_t *client, unsigned int events)
+{
+    struct epoll_event event;
+
+    if (client->events == events)
+        return;
+    event.events = events;
+    event.data.fd = client->fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event) == -1)
+        errno_abort ("Watch client");
+    client->events = events;
+}
+
+/*
+ * Accept every connection waiting on the listening socket.
+ */
+static inline void server_accept(server_t *server, int epoll_fd)
+{
+    struct epoll_event event;
+    client_t *client, **clients;
+    int fd, slots;
+
+    while ((fd = accept(server->fd, NULL, NULL)) != -1) {
+        if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1 || fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+            errno_abort ("Set client flags");
+        if (fd >= server->slots) {
+            slots = server->slots ? server->slots : 64;
+            while (slots <= fd)
+                slots *= 2;
+            clients = realloc(server->clients, slots * sizeof(client_t *));
+            if (clients == NULL)
+                errno_abort ("Allocate client table");
+            memset(clients + server->slots, 0, (slots - server->slots) * sizeof(client_t *));
+            server->clients = clients;
+            server->slots = slots;
+        }
+        client = calloc(1, sizeof(client_t));
+        if (client == NULL)
+            errno_abort ("Allocate client");
+        client->fd = fd;
+        client->events = EPOLLIN;
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+            errno_abort ("Watch client");
+        server->clients[fd] = client;
+        server->count++;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR)
+        errno_abort ("Accept client");
+}
+
+/*
+ * Disconnect a client, dropping any replies it has not taken.
+ * Closing the socket also takes it out of the epoll set.
+ */
+static inline void server_drop(server_t *server, client_t *client)
+{
+    server->clients[client->fd] = NULL;
+    server->count--;
+    close(client->fd);
+    free(client->output);
+    free(client);
+}
+
+/*
+ * Queue reply text for a client.
+ */
+static inline void client_append(client_t *client, const char *text, size_t length)
+{
+    size_t size;
+    char *output;
+
+    if (client->output_len + length > client->output_size) {
+        size = client->output_size ? client->output_size : 4096;
+        while (size < client->output_len + length)
+            size *= 2;
+        output = realloc(client->output, size);
+        if (output == NULL)
+            errno_abort ("Allocate client replies");
+        client->output = output;
+        client->output_size = size;
+    }
+    memcpy(client->output + client->output_len, text, length);
+    client->output_len += length;
+}
+
+/*
+ * Write as many of a client's replies as it will take, and watch it
+ * for whatever it is now ready for: output while replies remain,
+ * input unless too many do. Returns -1 if the client has gone, or
+ * has closed its end and taken every reply, and has been dropped.
+ */
+static inline int server_flush(server_t *server, client_t *client, int epoll_fd)
+{
+    unsigned int events;
+    ssize_t bytes;
+
+    while (client->output_sent < client->output_len) {
+        bytes = send(client->fd, client->output + client->output_sent,
+            client->output_len - client->output_sent, MSG_NOSIGNAL);
+        if (bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            server_drop(server, client);
+            return -1;
+        }
+        client->output_sent += bytes;
+    }
+    if (client->output_sent == client->output_len)
+        client->output_sent = client->output_len = 0;
+    else if (client->output_sent >= client->output_size / 2) {
+        memmove(client->output, client->output + client->output_sent, client->output_len - client->output_sent);
+        client->output_len -= client->output_sent;
+        client->output_sent = 0;
+    }
+
+    if (client->closing && client->output_len == 0) {
+        server_drop(server, client);
+        return -1;
+    }
+
+    events = 0;
+    if (!client->closing && client->output_len - client->output_sent <= CLIENT_OUTPUT_MAX)
+        events |= EPOLLIN;
+    if (client->output_len > client->output_sent)
+        events |= EPOLLOUT;
+    server_watch(epoll_fd, client, events);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,159 @@
+/*
+ * epoch.h
+ *
+ * Epoch-based reclamation for new_alarm_mutex.c. View_Alarms and
+ * Stats walk the alarm list and the display registry without taking
+ * their locks, so an alarm, a display thread or an alarm shard's old
+ * hash table may be unlinked while such a reader still looks at it.
+ * Readers therefore run inside epoch_enter and epoch_exit, and
+ * whoever unlinks an object hands it to epoch_retire instead of
+ * freeing it.
+ *
+ * There is one global epoch. A reader announces the epoch it saw
+ * on entry; the epoch advances only when every reader inside has
+ * seen the current one. An object retired in epoch e was unlinked
+ * before any reader that entered in e + 1 started, so once the
+ * epoch reaches e + 2 no reader can still hold it, and it is
+ * released. Each thread keeps its retired objects in three lists,
+ * one per epoch still in play, and releases them itself, so
+ * retiring takes no lock. Readers never wait for writers; a long
+ * reader only delays the release of memory.
+ */
+#ifndef __epoch_h
+#define __epoch_h
+
+#include <stdatomic.h>
+#include "errors.h"
+
+#define EPOCH_BATCH         64      /* objects retired between attempts to release */
+
+typedef struct epoch_retired_tag {
+    void                *object;
+    void                (*release)(void *);
+} epoch_retired_t;
+
+typedef struct epoch_limbo_tag {
+    unsigned long       epoch;      /* when these objects were retired */
+    epoch_retired_t     *objects;
+    int                 count;
+    int                 capacity;
+} epoch_limbo_t;
+
+typedef struct epoch_thread_tag {
+    atomic_ulong        state;      /* epoch << 1 | 1 inside a reader, 0 outside */
+    epoch_limbo_t       limbo[3];
+    int                 retired;    /* since the last attempt to release */
+    struct epoch_thread_tag *next;
+} epoch_thread_t;
+
+static atomic_ulong epoch_global = 1;
+static _Atomic(epoch_thread_t *) epoch_threads = NULL;
+static __thread epoch_thread_t *epoch_self = NULL;
+
+static inline epoch_thread_t *epoch_thread(void)
+{
+    epoch_thread_t *thread = epoch_self;
+
+    if (thread != NULL)
+        return thread;
+    thread = calloc(1, sizeof(epoch_thread_t));
+    if (thread == NULL)
+        errno_abort ("Allocate epoch record");
+    thread->next = atomic_load(&epoch_threads);
+    while (!atomic_compare_exchange_weak(&epoch_threads, &thread->next, thread))
+        ;
+    epoch_self = thread;
+    return thread;
+}
+
+/*
+ * Begin and end a read section. Sections do not nest.
+ */
+static inline void epoch_enter(void)
+{
+    epoch_thread_t *thread = epoch_thread();
+
+    //sequentially consistent, so no read of the structures can move above it
+    atomic_store(&thread->state, atomic_load(&epoch_global) << 1 | 1);
+}
+
+static inline void epoch_exit(void)
+{
+    atomic_store_explicit(&epoch_self->state, 0, memory_order_release);
+}
+
+/*
+ * Advance the global epoch if every reader inside has seen it.
+ */
+static inline void epoch_advance(void)
+{
+    unsigned long epoch = atomic_load(&epoch_global), state;
+    epoch_thread_t *thread;
+
+    for (thread = atomic_load(&epoch_threads); thread != NULL; thread = thread->next) {
+        state = atomic_load(&thread->state);
+        if ((state & 1) && state >> 1 != epoch)
+            return;
+    }
+    atomic_compare_exchange_strong(&epoch_global, &epoch, epoch + 1);
+}
+
+static inline void epoch_release(epoch_limbo_t *limbo)
+{
+    int i;
+
+    for (i = 0; i < limbo->count; i++)
+        limbo->objects[i].release(limbo->objects[i].object);
+    limbo->count = 0;
+}
+
+/*
+ * Release every object the calling thread retired at least two
+ * epochs ago, after trying to advance the epoch.
+ */
+static inline void epoch_reclaim(void)
+{
+    epoch_thread_t *thread = epoch_thread();
+    unsigned long epoch;
+    int i;
+
+    epoch_advance();
+    epoch = atomic_load(&epoch_global);
+    for (i = 0; i < 3; i++)
+        if (thread->limbo[i].count > 0 && thread->limbo[i].epoch + 2 <= epoch)
+            epoch_release(&thread->limbo[i]);
+    thread->retired = 0;
+}
+
+/*
+ * Hand over an object, already unlinked from everything a reader
+ * can reach, to be released by "release" once no reader can hold
+ * it.
+ */
+static inline void epoch_retire(void *object, void (*release)(void *))
+{
+    epoch_thread_t *thread = epoch_thread();
+    unsigned long epoch = atomic_load(&epoch_global);
+    epoch_limbo_t *limbo = &thread->limbo[epoch % 3];
+    epoch_retired_t *objects;
+
+    //the list for this epoch last held objects from three epochs ago, which are safe
+    if (limbo->epoch != epoch) {
+        epoch_release(limbo);
+        limbo->epoch = epoch;
+    }
+    if (limbo->count == limbo->capacity) {
+        objects = realloc(limbo->objects, (limbo->capacity ? limbo->capacity * 2 : EPOCH_BATCH) * sizeof(epoch_retired_t));
+        if (objects == NULL)
+            errno_abort ("Allocate retired objects");
+        limbo->objects = objects;
+        limbo->capacity = limbo->capacity ? limbo->capacity * 2 : EPOCH_BATCH;
+    }
+    limbo->objects[limbo->count].object = object;
+    limbo->objects[limbo->count].release = release;
+    limbo->count++;
+    if (++thread->retired >= EPOCH_BATCH)
+        epoch_reclaim();
+}
+
+#endif
@@ -0,0 +1,201 @@
+/*
+ * journal.h
+ *
+ * The binary event journal of new_alarm_mutex.c (its -j option).
+ * Instead of a line of text, every lifecycle event -- an alarm
+ * inserted, changed, cancelled, assigned to a display thread,
+ * printed periodically, dropped by its display thread or expired,
+ * and a display thread created or terminated -- is appended to a
+ * memory-mapped file as a fixed-size record. journal_decode.c turns
+ * a journal back into the program's text output.
+ *
+ * A record is one JOURNAL_RECORD slot: the CLOCK_MONOTONIC time of
+ * the event, the alarm id, its interned type, its duration and the
+ * thread involved. The two events that give an alarm a new message
+ * (insert and change) are followed by the message text in as many
+ * further slots as it needs, and the first use of a type is
+ * recorded with its name the same way, so that nothing else need
+ * carry a string.
+ *
+ * A writer reserves the slots for its record with one atomic add on
+ * the file offset and then fills them in place; no lock is taken
+ * except to grow the file, which happens once every JOURNAL_GROW
+ * bytes. The whole of JOURNAL_MAP_MAX is mapped up front, so the
+ * mapping never moves.
+ */
+#ifndef __journal_h
+#define __journal_h
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "errors.h"
+
+#define JOURNAL_MAGIC       "ALRMJRN1"
+#define JOURNAL_RECORD      32              /* bytes per slot */
+#define JOURNAL_GROW        (16L << 20)     /* file growth step */
+#define JOURNAL_MAP_MAX     (64LL << 30)    /* largest journal */
+
+#define JOURNAL_INSERT      1   /* thread: main thread; message follows */
+#define JOURNAL_CHANGE      2   /* message follows */
+#define JOURNAL_CANCEL      3
+#define JOURNAL_EXPIRE      4   /* removed from the alarm list */
+#define JOURNAL_ASSIGN      5   /* thread: display thread it is assigned to */
+#define JOURNAL_PERIODIC    6   /* thread: display thread printing it */
+#define JOURNAL_STOP_CHANGED    7   /* thread: display thread that dropped it */
+#define JOURNAL_STOP_CANCELLED  8
+#define JOURNAL_STOP_EXPIRED    9
+#define JOURNAL_DISPLAY_CREATE  10  /* id: first alarm; thread: new display thread */
+#define JOURNAL_DISPLAY_TERMINATE 11    /* thread: display thread */
+#define JOURNAL_TYPE        12  /* type: interned id; name follows */
+#define JOURNAL_REARM       13  /* msecs: times a recurring alarm has left, -1 for ever */
+#define JOURNAL_EVENTS      14
+
+/*
+ * The first slot of a journal. Record times are monotonic; the two
+ * clocks read together at creation let the decoder print wall clock
+ * times.
+ */
+typedef struct journal_header_tag {
+    char                magic[8];
+    int                 record_size;
+    int                 reserved;
+    long long           monotonic_ns;
+    long long           realtime_ns;
+} journal_header_t;
+
+typedef struct journal_record_tag {
+    long long           time;       /* CLOCK_MONOTONIC nanoseconds */
+    unsigned short      event;      /* JOURNAL_*, 0 for a slot never filled */
+    unsigned short      length;     /* text bytes in the slots that follow */
+    int                 id;
+    int                 type;
+    int                 msecs;
+    unsigned long       thread;
+} journal_record_t;
+
+typedef struct journal_tag {
+    int                 fd;
+    char                *base;      /* NULL while the journal is off */
+    atomic_llong        used;       /* bytes reserved */
+    atomic_llong        extent;     /* size of the file */
+    pthread_mutex_t     grow_lock;
+} journal_t;
+
+static inline long long journal_clock_ns(clockid_t clock)
+{
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static inline int journal_enabled(journal_t *journal)
+{
+    return journal->base != NULL;
+}
+
+/*
+ * Create (or truncate) the journal file at "path" and map it.
+ */
+static inline void journal_open(journal_t *journal, const char *path)
+{
+    journal_header_t *header;
+    int status;
+
+    journal->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (journal->fd == -1)
+        errno_abort ("Open journal");
+    if (ftruncate(journal->fd, JOURNAL_GROW) == -1)
+        errno_abort ("Grow journal");
+    journal->base = mmap(NULL, JOURNAL_MAP_MAX, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_NORESERVE, journal->fd, 0);
+    if (journal->base == MAP_FAILED)
+        errno_abort ("Map journal");
+    status = pthread_mutex_init(&journal->grow_lock, NULL);
+    if (status != 0)
+        err_abort (status, "Init mutex");
+    atomic_init(&journal->extent, JOURNAL_GROW);
+    atomic_init(&journal->used, JOURNAL_RECORD);
+
+    header = (journal_header_t *)journal->base;
+    memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+    header->record_size = JOURNAL_RECORD;
+    header->monotonic_ns = journal_clock_ns(CLOCK_MONOTONIC);
+    header->realtime_ns = journal_clock_ns(CLOCK_REALTIME);
+}
+
+/*
+ * Append one record, with "text" (which may be NULL) in the slots
+ * after it. Safe from any thread.
+ */
+static inline void journal_event(journal_t *journal, int event, int id, int type,
+    int msecs, unsigned long thread, const char *text)
+{
+    journal_record_t *record;
+    long long offset, size, extent;
+    size_t length = text != NULL ? strlen(text) : 0;
+    int status;
+
+    size = JOURNAL_RECORD + (length + JOURNAL_RECORD - 1) / JOURNAL_RECORD * JOURNAL_RECORD;
+    offset = atomic_fetch_add_explicit(&journal->used, size, memory_order_relaxed);
+    //a record reserved after journal_close is dropped
+    if (offset + size > JOURNAL_MAP_MAX)
+        return;
+
+    //the pages must be inside the file before they are touched
+    if (offset + size > atomic_load_explicit(&journal->extent, memory_order_acquire)) {
+        status = pthread_mutex_lock(&journal->grow_lock);
+        if (status != 0)
+            err_abort (status, "Lock mutex");
+        extent = atomic_load_explicit(&journal->extent, memory_order_relaxed);
+        while (extent < offset + size) {
+            extent += JOURNAL_GROW;
+            if (ftruncate(journal->fd, extent) == -1)
+                errno_abort ("Grow journal");
+        }
+        atomic_store_explicit(&journal->extent, extent, memory_order_release);
+        status = pthread_mutex_unlock(&journal->grow_lock);
+        if (status != 0)
+            err_abort (status, "Unlock mutex");
+    }
+
+    record = (journal_record_t *)(journal->base + offset);
+    record->time = journal_clock_ns(CLOCK_MONOTONIC);
+    record->length = (unsigned short)length;
+    record->id = id;
+    record->type = type;
+    record->msecs = msecs;
+    record->thread = thread;
+    if (length > 0)
+        memcpy(record + 1, text, length);
+    record->event = (unsigned short)event;
+}
+
+/*
+ * Cut the file down to the records written so far. Records begun
+ * afterwards are dropped; the mapping is left in place for any
+ * thread still writing one begun before.
+ */
+static inline void journal_close(journal_t *journal)
+{
+    long long end;
+    int status;
+
+    if (!journal_enabled(journal))
+        return;
+    end = atomic_exchange(&journal->used, JOURNAL_MAP_MAX);
+    status = pthread_mutex_lock(&journal->grow_lock);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    if (ftruncate(journal->fd, end) == -1)
+        errno_abort ("Truncate journal");
+    atomic_store(&journal->extent, end);
+    status = pthread_mutex_unlock(&journal->grow_lock);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+#endif
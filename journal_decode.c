@@ -0,0 +1,247 @@
+/*
+ * journal_decode.c
+ *
+ * Print a binary journal written by new_alarm_mutex.c -j as the
+ * lines the program would have printed itself. Wall clock times are
+ * worked out from the journal's monotonic record times and the two
+ * clocks the program read when it created the journal.
+ *
+ * Records only carry an alarm's message when it is inserted or
+ * changed, so the decoder remembers each alarm's latest message by
+ * id. Display thread creation and alarm assignment, which the
+ * program does not print, are shown too with -a.
+ *
+ *      cc -O2 journal_decode.c -o journal_decode
+ *      ./journal_decode [-a] journal
+ */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "journal.h"
+
+#define DURATION_FMT        "%d%s"
+#define DURATION_ARGS(ms)   ((ms) % 1000 ? (ms) : (ms) / 1000), ((ms) % 1000 ? "ms" : "")
+
+/*
+ * The latest message of every alarm id seen, in an open-addressing
+ * hash table.
+ */
+typedef struct message_tag {
+    int                 used;
+    int                 id;
+    char                text[128];
+} message_t;
+
+message_t *messages = NULL;
+int message_capacity = 0, message_count = 0;
+char **type_names = NULL;
+int type_count = 0;
+
+unsigned int message_slot(int id, int capacity)
+{
+    return ((unsigned int)id * 2654435769u) & (unsigned int)(capacity - 1);
+}
+
+message_t *message_find(int id, int insert)
+{
+    message_t *old = messages;
+    unsigned int slot;
+    int capacity = message_capacity, i;
+
+    if (insert && (message_count + 1) * 2 > message_capacity) {
+        message_capacity = message_capacity ? message_capacity * 2 : 1024;
+        messages = calloc(message_capacity, sizeof(message_t));
+        if (messages == NULL)
+            errno_abort ("Allocate messages");
+        message_count = 0;
+        for (i = 0; i < capacity; i++)
+            if (old[i].used)
+                *message_find(old[i].id, 1) = old[i];
+        free(old);
+    }
+    if (message_capacity == 0)
+        return NULL;
+    for (slot = message_slot(id, message_capacity); messages[slot].used;
+         slot = (slot + 1) & (message_capacity - 1))
+        if (messages[slot].id == id)
+            return &messages[slot];
+    if (!insert)
+        return NULL;
+    messages[slot].used = 1;
+    messages[slot].id = id;
+    message_count++;
+    return &messages[slot];
+}
+
+void remember(int id, const char *text, int length)
+{
+    message_t *message = message_find(id, 1);
+
+    memcpy(message->text, text, length);
+    message->text[length] = '\0';
+}
+
+const char *message_of(int id)
+{
+    message_t *message = message_find(id, 0);
+
+    return message != NULL ? message->text : "";
+}
+
+const char *type_of(int type)
+{
+    return type >= 0 && type < type_count && type_names[type] != NULL ? type_names[type] : "?";
+}
+
+void name_type(int type, const char *name, int length)
+{
+    int count = type_count;
+
+    if (type < 0)
+        return;
+    if (type >= type_count) {
+        while (type >= count)
+            count = count ? count * 2 : 64;
+        type_names = realloc(type_names, count * sizeof(char *));
+        if (type_names == NULL)
+            errno_abort ("Allocate type names");
+        memset(type_names + type_count, 0, (count - type_count) * sizeof(char *));
+        type_count = count;
+    }
+    free(type_names[type]);
+    type_names[type] = strndup(name, length);
+    if (type_names[type] == NULL)
+        errno_abort ("Allocate type name");
+}
+
+int main(int argc, char *argv[])
+{
+    journal_header_t *header;
+    journal_record_t *record;
+    struct stat info;
+    struct tm local;
+    char *base, timeString[80];
+    const char *text;
+    long long offset, wall_ns;
+    time_t second, last_second = -1;
+    int fd, option, all = 0, length;
+
+    while ((option = getopt(argc, argv, "a")) != -1) {
+        switch (option) {
+        case 'a':
+            all = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-a] journal\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-a] journal\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd == -1)
+        errno_abort ("Open journal");
+    if (fstat(fd, &info) == -1)
+        errno_abort ("Stat journal");
+    if (info.st_size < JOURNAL_RECORD) {
+        fprintf(stderr, "%s is not a journal\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    base = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+        errno_abort ("Map journal");
+    header = (journal_header_t *)base;
+    if (memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0
+            || header->record_size != JOURNAL_RECORD) {
+        fprintf(stderr, "%s is not a journal\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * A slot whose event is 0, or not an event at all, was reserved
+     * but never filled -- the program stopped while writing it --
+     * and is stepped over one slot at a time.
+     */
+    for (offset = JOURNAL_RECORD; offset + JOURNAL_RECORD <= info.st_size; ) {
+        record = (journal_record_t *)(base + offset);
+        if (record->event == 0 || record->event >= JOURNAL_EVENTS
+                || offset + JOURNAL_RECORD + record->length > info.st_size) {
+            offset += JOURNAL_RECORD;
+            continue;
+        }
+        text = (const char *)(record + 1);
+        length = record->length < 127 ? record->length : 127;
+        offset += JOURNAL_RECORD + (record->length + JOURNAL_RECORD - 1) / JOURNAL_RECORD * JOURNAL_RECORD;
+
+        wall_ns = header->realtime_ns + (record->time - header->monotonic_ns);
+        second = (time_t)(wall_ns / 1000000000LL);
+        if (second != last_second) {
+            localtime_r(&second, &local);
+            strftime(timeString, sizeof(timeString), "%D %I:%M:%S %p", &local);
+            last_second = second;
+        }
+
+        switch (record->event) {
+        case JOURNAL_TYPE:
+            name_type(record->type, text, length);
+            break;
+        case JOURNAL_INSERT:
+            remember(record->id, text, length);
+            printf("Alarm(%d) Inserted by Main Thread (%lu) Into Alarm List at <%s>: " DURATION_FMT " %s \n",
+                record->id, record->thread, timeString, DURATION_ARGS(record->msecs), message_of(record->id));
+            break;
+        case JOURNAL_CHANGE:
+            remember(record->id, text, length);
+            printf("Alarm(%d) Changed at %s: %s " DURATION_FMT " %s \n",
+                record->id, timeString, type_of(record->type), DURATION_ARGS(record->msecs), message_of(record->id));
+            break;
+        case JOURNAL_CANCEL:
+            printf("Alarm(%d) cancelled at %s: %s " DURATION_FMT " %s \n",
+                record->id, timeString, type_of(record->type), DURATION_ARGS(record->msecs), message_of(record->id));
+            break;
+        case JOURNAL_EXPIRE:
+            printf("Alarm(%d): Alarm Expired at <%s>: Alarm Removed From Alarm List\n", record->id, timeString);
+            break;
+        case JOURNAL_REARM:
+            if (record->msecs < 0)
+                printf("Alarm(%d): Alarm Went Off at <%s>: Alarm Re-armed in Alarm List\n", record->id, timeString);
+            else
+                printf("Alarm(%d): Alarm Went Off at <%s>: Alarm Re-armed in Alarm List, %d Times Left\n",
+                    record->id, timeString, record->msecs);
+            break;
+        case JOURNAL_ASSIGN:
+            if (all)
+                printf("Alarm(%d) Assigned to Display Thread (%lu) at %s: T%s " DURATION_FMT " %s \n",
+                    record->id, record->thread, timeString, type_of(record->type), DURATION_ARGS(record->msecs), message_of(record->id));
+            break;
+        case JOURNAL_PERIODIC:
+            printf("Alarm(%d) Message PERIODICALLY PRINTED BY Display Thread (%lu) at %s: T%s " DURATION_FMT " %s \n",
+                record->id, record->thread, timeString, type_of(record->type), DURATION_ARGS(record->msecs), message_of(record->id));
+            break;
+        case JOURNAL_STOP_CHANGED:
+            printf("Alarm(%d) Changed Type; Display Thread (%lu) Stopped Printing Alarm Message at %s: %s " DURATION_FMT " %s \n",
+                record->id, record->thread, timeString, type_of(record->type), DURATION_ARGS(record->msecs), message_of(record->id));
+            break;
+        case JOURNAL_STOP_CANCELLED:
+            printf("Alarm(%d) Cancelled; Display Thread (%lu) Stopped Printing Alarm Message at %s: %s " DURATION_FMT " %s \n",
+                record->id, record->thread, timeString, type_of(record->type), DURATION_ARGS(record->msecs), message_of(record->id));
+            break;
+        case JOURNAL_STOP_EXPIRED:
+            printf("Alarm(%d) Expired; Display Thread (%lu) Stopped Printing Alarm Message at %s: T%s " DURATION_FMT " %s \n",
+                record->id, record->thread, timeString, type_of(record->type), DURATION_ARGS(record->msecs), message_of(record->id));
+            break;
+        case JOURNAL_DISPLAY_CREATE:
+            if (all)
+                printf("New Display Thread (%lu) Created at %s: T%s " DURATION_FMT " %s \n",
+                    record->thread, timeString, type_of(record->type), DURATION_ARGS(record->msecs), message_of(record->id));
+            break;
+        case JOURNAL_DISPLAY_TERMINATE:
+            printf("Display Thread Terminated (%lu) at %s \n", record->thread, timeString);
+            break;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * message_arena.h
+ *
+ * Variable-length storage for the alarm messages of
+ * new_alarm_mutex.c, kept out of alarm_t so that an alarm's hot
+ * fields fit in one cache line whatever its message. A message is
+ * copied, with its NUL, into the smallest of a few size classes that
+ * holds it, each a slab.h cache; most messages are short, and take
+ * 16 or 32 bytes rather than the 128 the longest one needs. Since
+ * every class is a slab cache, a message is freed with slab_free,
+ * by any thread.
+ */
+#ifndef __message_arena_h
+#define __message_arena_h
+
+#include <string.h>
+#include "slab.h"
+
+#define MESSAGE_CLASSES     4       /* 16, 32, 64 and 128 bytes */
+#define MESSAGE_CLASS_MIN   16
+#define MESSAGE_MAX         (MESSAGE_CLASS_MIN << (MESSAGE_CLASSES - 1))    /* with its NUL */
+
+typedef struct message_arena_tag {
+    slab_cache_t        classes[MESSAGE_CLASSES];
+} message_arena_t;
+
+static inline void message_arena_init(message_arena_t *arena)
+{
+    static const char *names[MESSAGE_CLASSES] = {
+        "messages of 16 bytes", "messages of 32 bytes", "messages of 64 bytes", "messages of 128 bytes"
+    };
+    int i;
+
+    for (i = 0; i < MESSAGE_CLASSES; i++)
+        slab_cache_init(&arena->classes[i], names[i], MESSAGE_CLASS_MIN << i);
+}
+
+/*
+ * Copy "length" characters of "text" into the arena, cut short to
+ * fit the largest class, and NUL-terminate them.
+ */
+static inline char *message_alloc(message_arena_t *arena, const char *text, size_t length)
+{
+    char *message;
+    int class = 0;
+
+    if (length >= MESSAGE_MAX)
+        length = MESSAGE_MAX - 1;
+    while ((size_t)(MESSAGE_CLASS_MIN << class) <= length)
+        class++;
+    message = slab_alloc(&arena->classes[class]);
+    memcpy(message, text, length);
+    message[length] = '\0';
+    return message;
+}
+
+#endif
@@ -2,540 +2,1310 @@
  * new_alarm_mutex.c
  *
  * This is an enhancement to the alarm_mutex.c program, which
- * created an "alarm thread" for each alarm command. This new
- * version uses a single alarm thread, which reads the next
- * entry in a list. The main thread places new requests onto the
- * list, in order of absolute expiration time. The list is
- * protected by a mutex, and the alarm thread sleeps for at
- * least 1 second, each iteration, to ensure that the main
- * thread can lock the mutex to add new work to the list.
+ * created an "alarm thread" for each alarm command. In this new
+ * version the main thread is a reactor: a single epoll loop reads
+ * commands from standard input (and local clients, with -u),
+ * parses them, and applies them in batches. The alarms are split
+ * among -R schedulers by id. Each scheduler keeps its alarm list
+ * in alarm_store.h, sharded by id, with an id hash table, deadline
+ * heaps and indexes by id range and by type, and arms a timerfd for
+ * the earliest deadline rather than sleeping and polling. When it
+ * fires, the expiry sweep removes every alarm that has come due,
+ * in the main thread or, with -R 2 or more, in the scheduler's
+ * own reactor thread.
+ *
+ * Each scheduler's alarm thread hands new alarms to display
+ * threads by type, and its periodic thread prints every alarm's
+ * message every 5 seconds. The display threads themselves run on
+ * a pool of display workers. All output goes through async_log.h,
+ * so no lock is held across a write. The alarm list may also be
+ * kept in a write-ahead log and snapshots (persist.h) and
+ * recovered on start.
  */
 #include <pthread.h>
 #include <time.h>
 #include "errors.h"
-#include <sys/select.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include "alarm_store.h"
+#include "command_ring.h"
+#include "command_parse.h"
+#include "slab.h"
+#include "message_arena.h"
+#include "type_intern.h"
+#include "async_log.h"
+#include "journal.h"
+#include "persist.h"
+#include "stats.h"
+#include "epoch.h"
+#include "command_server.h"
+
 
 /*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
- * enough, since the "alarm thread" cannot tell how long it has
- * been on the list.
+ * Durations are printed the way they may be entered: in whole
+ * seconds ("5"), or in milliseconds ("250ms") when they are not a
+ * whole number of seconds.
  */
-typedef struct alarm_tag {
-    struct alarm_tag    *link;
-    char                type[128];
-    int                 id;
-    int                 seconds;
-    time_t              time;   /* seconds from EPOCH */
-    char                message[128];
-    int                 cancelled;
+#define DURATION_FMT        "%d%s"
+#define DURATION_ARGS(ms)   ((ms) % 1000 ? (ms) : (ms) / 1000), ((ms) % 1000 ? "ms" : "")
+
+#define NSEC_PER_SEC        1000000000LL
 
-} alarm_t;
 
 //So alarm_thread can look for display threads, link display threads together as nodes in a list
 //Each node also contains the alarm type, alarms, and num of alarms for a given display thread.
 //This gives each display thread access to its own data
 //But probably have to treat display_alarms same as alarm_list in terms of synchronization
+//A display thread is a logical entity: it is run by whichever display worker picks it up
 typedef struct display_thread_node{
 
-    int num_of_alarms; // number of alarms currently being displayed
-    char type[128]; //type of alarms displayed
-    int end_of_life; // 0 indicates thread is running, 1 indicates thread terminated
-    long thread_address; // address of display thread for main thread access
-    pthread_t display_thread; // thread responsible for displaye
-    struct alarm_tag *display_alarms[2]; //list of display alarms
-    struct display_thread_node *link; //link to next display thread in list
+    int num_of_alarms; // number of alarms in display_alarms, up to display_capacity
+    int type; //interned type of alarms displayed
+    atomic_int end_of_life; // 0 indicates thread is running, 1 indicates thread terminated
+    long thread_address; // id of display thread, printed as its thread id
+    atomic_int scheduled; // 1 while queued on a display worker, so it is never freed under one
+    struct display_shard_tag *shard; //display registry shard the thread belongs to
+    _Atomic(struct display_thread_node *) link; //link to next display thread in list
+    struct display_thread_node *prev; //previous display thread in list, so it unlinks in O(1)
+    struct display_thread_node *load_prev; //links in its type's list of display threads with its load
+    struct display_thread_node *load_next;
+    _Atomic(struct alarm_tag *) display_alarms[]; //display_capacity slots, NULL if free
 
 } display_t;
 
+/*
+ * The display threads are registered in shards by alarm type, each
+ * with its own mutex, so that assigning an alarm of one type never
+ * waits for display threads of another type.
+ *
+ * Locks are always taken in this order: a display shard, then an
+ * alarm shard (alarm_store.h), then the periodic lock, all of the
+ * same scheduler (below). The display worker and pool locks are
+ * only ever taken last, on their own. An alarm's type, time,
+ * message and display thread are changed only with both its alarm
+ * shard and its scheduler's periodic lock held, so either one is
+ * enough to read them.
+ *
+ * View_Alarms and Stats take none of these locks. They walk the
+ * lists, whose links are atomic, inside an epoch read section
+ * (epoch.h), and copy alarms with alarm_read; a display thread or
+ * alarm that is unlinked meanwhile is retired, not freed.
+ */
+typedef struct display_shard_tag {
+    pthread_mutex_t     lock;       /* serializes changes to the list and its display threads */
+    _Atomic(display_t *) displays;
+    struct display_load_tag *loads; /* each of its types' display threads by load */
+    int                 load_slots;
+    long long           locked_at;  /* when the holder's sampled lock was taken, see stats.h */
+} display_shard_t;
 
+/*
+ * A new alarm goes to the least loaded display thread of its type
+ * that has a free slot, and a display thread is only created when
+ * every one of them is full. To find it in O(1), the display
+ * threads of a type that have alarms but room for more are kept in
+ * one list per load, and a bitmap tells which lists are not empty.
+ * Full display threads, and terminated ones, are in none of them.
+ */
+#define DISPLAY_CAPACITY    2       /* default alarms per display thread */
+#define DISPLAY_CAPACITY_MAX 26     /* View_Alarms letters a display thread's alarms */
 
-pthread_mutex_t new_alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
-pthread_cond_t alarm_expired = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t alarm_expiration_mutex = PTHREAD_MUTEX_INITIALIZER;
-alarm_t *alarm_list = NULL;
-display_t *display_threads = NULL; 
-time_t current_alarm = 0;
-alarm_t *new_alarm = NULL;
-int expired = 0;
-
-
-//if you lock alarm_mutex...then we in deadlock
-void *display_thread (void *arg){
-
-  int avaiable = 0;
-  int type;  
-  int* num_of_alarms = malloc(sizeof(int));
-  int status;
-  struct timespec timeout;
-  char timeString[80];
-  
-  time_t current_0, start_0, current_1, start_1; 
-  display_t* thread_data = (display_t*)arg;
-
-  thread_data->thread_address= (unsigned long) pthread_self();
-  
-  
- 
- time(&start_0);
- time(&start_1);
- status = pthread_mutex_lock (&alarm_expiration_mutex);
-            if (status != 0)
-            err_abort (status, "Lock mutex");
-  while (1){
-     timespec_get(&timeout, TIME_UTC + 5); // get current time + 5 seconds
+typedef struct display_load_tag {
+    display_t           **by_load;  /* display_capacity lists; NULL until the type has a display thread */
+    unsigned int        open;       /* bit n set if by_load[n] is not empty */
+} display_load_t;
 
-     // get current time string
-     time(&current_0);
-     strftime (timeString,80,"%D %I:%M:%S %p",localtime(&current_0));
-    
-    //Originally planned to have this thread lock alarm mutex and run whenever no new alarm is added, but this prevents
-    //main thread from running
-      
-    
-     
-    if(thread_data->display_alarms[0] == NULL && thread_data->display_alarms[1] == NULL){
-      printf("Display Thread Terminated (%lu) at %s \n", (unsigned long)pthread_self(), timeString);
-      thread_data->end_of_life = 1;
-      status = pthread_mutex_unlock (&alarm_expiration_mutex);
-            if (status != 0)
-            err_abort (status, "Lock mutex");
-    return NULL;
-    }
-   
-    /* A.3.4.3. if the alarm type of an alarm assigned the display thread in the alarm list
-       * has been changed, then the display thread will stop printing the message in that
-       * alarm. Then the display thread will print:
-       */ 
-     
-      if(thread_data->display_alarms[0] != NULL && strcmp(thread_data->display_alarms[0]->type, thread_data->type) != 0){ 
-        printf("Alarm(%d) Changed Type; Display Thread (%lu) Stopped Printing Alarm Message at %s: %s %d %s \n", thread_data->display_alarms[0]->id, (unsigned long)pthread_self(), timeString, thread_data->display_alarms[0]->type, thread_data->display_alarms[0]->seconds, thread_data->display_alarms[0]->message);
-        thread_data->display_alarms[0] = NULL;
-        num_of_alarms = num_of_alarms -1 ;
-      }  
+/*
+ * Display threads are not OS threads. They are run by a fixed pool
+ * of display workers, one per processor. Each worker owns a deque
+ * of display threads that need to run: the owner pushes and pops
+ * at the bottom, and an idle worker steals from the top of another
+ * worker's deque. A display thread is queued ("kicked") whenever
+ * something it must report on happens -- an alarm is assigned to
+ * it, expires, is cancelled or changes type.
+ */
+typedef struct display_worker_tag {
+    pthread_t           thread;
+    pthread_mutex_t     lock;       /* protects the deque */
+    display_t           **tasks;    /* ring buffer */
+    int                 capacity;
+    int                 top;        /* index of the oldest task */
+    int                 count;
+} display_worker_t;
 
-      /* A.3.4.2. if an alarm assigned the display thread in the alarm list has been cancelled,
-      * then the display thread will stop printing the message in that alarm. Then the display
-      * thread will print:
-      */
+/*
+ * The periodic prints of displayed alarms are made by one periodic
+ * scheduler per scheduler (below) rather than by each display
+ * thread. Time is
+ * divided into ticks of one alignment window, and the five-second
+ * print period into a ring of buckets, one per tick. An alarm sits
+ * in the bucket of the tick its next print is due in, and since the
+ * period is a whole number of ticks it stays in that bucket for
+ * good. When a bucket's tick arrives, every alarm in it is printed
+ * in one batched write, so the scheduler wakes once per distinct
+ * due tick however many alarms are displayed. A wider window
+ * coalesces more prints, at the cost of printing up to one window
+ * late.
+ */
+#define PERIODIC_NS         (5 * NSEC_PER_SEC)
+#define PERIODIC_WINDOW_MS  10              /* default alignment window */
+#define ULONG_BITS          (8 * (int)sizeof(unsigned long))
+
+typedef struct periodic_tag {
+    pthread_mutex_t     lock;       /* protects the ring and the alarms' links in it */
+    pthread_cond_t      cond;       /* wakes the periodic thread early */
+    long long           locked_at;  /* when the holder's sampled lock was taken, see stats.h */
+    long long           window;     /* tick length, ns */
+    int                 slots;      /* buckets in the ring */
+    alarm_t             **bucket;
+    unsigned long       *occupied;  /* bitmap of non-empty buckets */
+    int                 count;      /* alarms in all buckets */
+    long long           next_tick;  /* first tick not yet fired */
+    long long           wait_tick;  /* tick the scheduler sleeps until, 0 if none */
+} periodic_t;
 
-      if(thread_data->display_alarms[0] != NULL && thread_data->display_alarms[0]->cancelled == 1){
-        printf("Alarm(%d) Cancelled; Display Thread (%lu) Stopped Printing Alarm Message at %s: %s %d %s \n", thread_data->display_alarms[0]->id, (unsigned long)pthread_self(), timeString, thread_data->display_alarms[0]->type, thread_data->display_alarms[0]->seconds, thread_data->display_alarms[0]->message);
-        free(thread_data->display_alarms[0]);
-        thread_data->display_alarms[0] = NULL;
-        num_of_alarms = num_of_alarms -1 ;
-      }  
+/*
+ * Standard input is read in blocks of up to INPUT_SIZE bytes, and
+ * the complete lines in a block are applied in batches of up to
+ * "max" commands. This is the scratch space for one batch.
+ */
+#define INPUT_SIZE          65536
+#define BATCH_MAX           4096    /* default largest batch */
+#define EVENTS_MAX          64      /* epoll events handled per wakeup */
+
+typedef struct command_batch_tag {
+    int                 max;
+    char                **lines;
+    command_t           *commands;  /* each line, parsed */
+    size_t              *reply_from;    /* each command's reply, in its scheduler's replies */
+    size_t              *reply_to;
+    atomic_int          *affected;  /* alarms each bulk command acted on, over all schedulers */
+    atomic_int          *skipped;   /* ids Start_Alarms found already in use */
+} command_batch_t;
 
-      /*  A.3.4.1. If the expiry time of an alarm assigned to the display thread in the alarm list
-      *  has been reached, then the display thread will stop printing the message in that
-      *  alarm. Then the display thread will print:
-      */
-        
-            while(expired == 0){
-            
+/*
+ * Where the previous statistics report left off, so that each one
+ * can give the command rate since the last. The Stats command and
+ * the periodic dump keep one each.
+ */
+#define STATS_INTERVAL      10      /* default seconds between dumps */
 
-            status = pthread_cond_timedwait(&alarm_expired, &alarm_expiration_mutex, &timeout); 
-            if (status == ETIMEDOUT){
-                
-                break;
-            }
-            else if (status != 0){
-            err_abort (status, "Wait on cond");
-            }       
+typedef struct stats_mark_tag {
+    long long           time;       /* CLOCK_MONOTONIC nanoseconds */
+    long                commands;
+} stats_mark_t;
 
- 
-            }  
 
-            if(thread_data->display_alarms[0] != NULL && thread_data->display_alarms[0]->time < time(NULL)){
-            printf("Alarm(%d) Expired; Display Thread (%lu) Stopped Printing Alarm Message at %s: T%s %d %s \n", thread_data->display_alarms[0]->id, (unsigned long)pthread_self(), timeString, thread_data->display_alarms[0]->type, thread_data->display_alarms[0]->seconds, thread_data->display_alarms[0]->message);
-            free(thread_data->display_alarms[0]);
-            thread_data->display_alarms[0] = NULL;
-            num_of_alarms = num_of_alarms -1 ;
-            }
+/*
+ * The reply text of the commands a scheduler applied, kept for the
+ * router to send out in command order.
+ */
+typedef struct reply_text_tag {
+    char                *text;
+    size_t              used;
+    size_t              size;
+} reply_text_t;
 
-            if(thread_data->display_alarms[1] != NULL && thread_data->display_alarms[1]->time < time(NULL)){
-            //remove alarm from num_of_alarms           
-            printf("Alarm(%d) Expired; Display Thread (%lu) Stopped Printing Alarm Message at %s: T%s %d %s \n", thread_data->display_alarms[1]->id, (unsigned long)pthread_self(), timeString, thread_data->display_alarms[1]->type, thread_data->display_alarms[1]->seconds, thread_data->display_alarms[1]->message);
-            free(thread_data->display_alarms[1]);
-            thread_data->display_alarms[1] = NULL;
-            num_of_alarms = num_of_alarms -1 ;
-            }
+/*
+ * The alarms are partitioned by id among one or more schedulers
+ * (-R). A scheduler owns everything about its alarms: an alarm
+ * store, a display registry, a command ring and alarm thread to
+ * assign display threads, a periodic scheduler, and an expiry
+ * timer. Schedulers share nothing but the display workers, the
+ * type table, the log and the journal, so no lock is ever taken
+ * across two of them, and each can run on a processor of its own.
+ *
+ * The main thread is the router: it reads and parses commands,
+ * hands each run of them out to the schedulers they belong to,
+ * waits for them all, and then sends the replies in command order.
+ * With more than one scheduler each has a reactor thread, which
+ * applies what it is handed and runs its own expiry sweeps; with
+ * one, the main thread does both itself.
+ */
+typedef struct scheduler_tag {
+    alarm_store_t       store;
+    display_shard_t     *display_shards;
+    command_ring_t      commands;   /* alarms waiting for its alarm thread */
+    periodic_t          periodic;
+    int                 timer_fd;   /* expiry timer */
+    int                 wake_fd;    /* eventfd the router posts work to, -1 if no reactor */
+    int                 *work;      /* batch indices of the commands it is handed */
+    int                 work_count;
+    reply_text_t        replies;    /* their replies */
+    alarm_t             **handoffs; /* alarms to push onto the command ring */
+    int                 handoff_count;
+    int                 handoff_size;
+    char                *shard_used;    /* 1 for each alarm shard the work touches */
+    display_t           **notify;   /* display threads a bulk command or a sweep affects */
+    int                 notify_count;
+    int                 notify_size;
+    alarm_t             **range;    /* alarms a Cancel_Range finds in a shard */
+    int                 range_size;
+} scheduler_t;
+
+#define SHARDS              16      /* default number of shards */
+#define SCHEDULERS_MAX      64
+#define COMMAND_RING_SIZE   1024    /* alarms waiting for the alarm thread */
+#define COMMAND_BATCH       64      /* alarms the alarm thread takes at a time */
+
+scheduler_t *schedulers = NULL;
+int scheduler_count = 1;
+alarm_store_t **scheduler_stores = NULL;    /* each scheduler's store, for snapshots */
+int display_shard_count = 0;            /* per scheduler */
+pthread_mutex_t dispatch_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dispatch_cond = PTHREAD_COND_INITIALIZER;
+int dispatch_pending = 0;               /* schedulers still applying the router's run */
+__thread reply_text_t *reply_capture = NULL;    /* set while a scheduler applies commands */
+command_batch_t batch;
+slab_cache_t alarm_cache, display_cache;
+message_arena_t message_arena;
+type_table_t alarm_types;
+
+#define TYPE_NAME(type)     type_name (&alarm_types, (type))
+int alloc_stats = 0;                    /* -a: report allocator counters at exit */
+journal_t journal;                      /* -j: lifecycle events go to a binary journal */
+persist_t persist;                      /* -p: the alarm list survives restarts */
+long long restore_offset;               /* CLOCK_REALTIME - CLOCK_MONOTONIC, while recovering */
+FILE *stats_file = NULL;                /* -S: statistics are dumped here periodically */
+long long stats_start;                  /* when the program started */
+stats_mark_t stats_command_mark, stats_dump_mark;
+server_t server = { .fd = -1 };         /* -u: commands also come from socket clients */
+client_t *reply_client = NULL;          /* client of the command being carried out, NULL for standard input */
+
+display_worker_t *display_workers = NULL;
+int display_worker_count = 0;
+atomic_uint display_worker_next = 0;    /* round robin for kicks from other threads */
+__thread int display_worker_self = -1;  /* index of the calling worker, if it is one */
+pthread_mutex_t display_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t display_pool_cond = PTHREAD_COND_INITIALIZER;
+int display_pool_pending = 0;           /* tasks queued on all deques */
+int display_pool_idle = 0;              /* workers waiting on display_pool_cond */
+atomic_long display_count = 0;
+int display_capacity = DISPLAY_CAPACITY;    /* -c: alarms per display thread */
+int default_slack = 0;          /* -t: milliseconds an alarm given no slack may go off late */
 
-         
+/*
+ * The scheduler an alarm id belongs to. The multiplier differs
+ * from the one alarm_store.h spreads ids over shards with, so each
+ * scheduler's ids still spread over all of its shards.
+ */
+scheduler_t *scheduler_of(int id)
+{
+    return &schedulers[(((unsigned int)id * 2246822519u) >> 16) % scheduler_count];
+}
 
-    if(thread_data->display_alarms[0] != NULL){
+/*
+ * The display registry shard of a scheduler for an (interned)
+ * alarm type.
+ */
+display_shard_t *display_shard_of(scheduler_t *scheduler, int type)
+{
+    return &scheduler->display_shards[type % display_shard_count];
+}
 
-      /* A.3.4.5. For each alarm with an alarm type which the display thread is responsible
-       * for and the alarm has been assigned by the alarm thread to that display thread, the
-       * display thread will periodically print, every five (5) seconds, the message in that
-       * alarm as follows:
-       */
-        time(&current_0);
-        if (difftime(current_0, start_0) >= 5.0){
-         printf("Alarm(%d) Message PERIODICALLY PRINTED BY Display Thread (%lu) at %s: T%s %d %s \n", thread_data->display_alarms[0]->id, (unsigned long)pthread_self(), timeString, thread_data->display_alarms[0]->type, thread_data->display_alarms[0]->seconds, thread_data->display_alarms[0]->message);
-         start_0 = current_0;
-        }
-   }
-    
-     /* A.3.4.3. if the alarm type of an alarm assigned the display thread in the alarm list
-       * has been changed, then the display thread will stop printing the message in that
-       * alarm. Then the display thread will print:
-       */ 
-      if(thread_data->display_alarms[1] != NULL && strcmp(thread_data->display_alarms[1]->type,thread_data->type) != 0){
-        printf("Alarm(%d) Changed Type; Display Thread (%lu) Stopped Printing Alarm Message at %s: %s %d %s \n", thread_data->display_alarms[1]->id, (unsigned long)pthread_self(), timeString, thread_data->display_alarms[1]->type, thread_data->display_alarms[1]->seconds, thread_data->display_alarms[1]->message);
-        thread_data->display_alarms[1] = NULL;
-        num_of_alarms = num_of_alarms -1 ;
-      }  
-      
-     /* A.3.4.2. if an alarm assigned the display thread in the alarm list has been cancelled,
-      * then the display thread will stop printing the message in that alarm. Then the display
-      * thread will print:
-      */
+void display_shard_lock(display_shard_t *shard)
+{
+    long long locked_at = stats_lock(&shard->lock, STATS_DISPLAY_WAIT);
 
-      if(thread_data->display_alarms[1] != NULL && thread_data->display_alarms[1]->cancelled == 1){
-        printf("Alarm(%d) Cancelled; Display Thread (%lu) Stopped Printing Alarm Message at %s: %s %d %s \n", thread_data->display_alarms[1]->id, (unsigned long)pthread_self(), timeString, thread_data->display_alarms[1]->type, thread_data->display_alarms[1]->seconds, thread_data->display_alarms[1]->message);
-        free(thread_data->display_alarms[1]);
-        thread_data->display_alarms[1] = NULL;
-        num_of_alarms = num_of_alarms -1 ;
-      } 
-     
-     
-
-    if(thread_data->display_alarms[1] != NULL){
-
-      /* A.3.4.5. For each alarm with an alarm type which the display thread is responsible
-       * for and the alarm has been assigned by the alarm thread to that display thread, the
-       * display thread will periodically print, every five (5) seconds, the message in that
-       * alarm as follows:
-       */
-        time(&current_1);
-        if (difftime(current_1, start_1) >= 5.0){
-         printf("Alarm(%d) Message PERIODICALLY PRINTED BY Display Thread (%lu) at %s: T%s %d %s \n", thread_data->display_alarms[1]->id, (unsigned long)pthread_self(), timeString, thread_data->display_alarms[1]->type, thread_data->display_alarms[1]->seconds, thread_data->display_alarms[1]->message);
-         start_1 = current_1;
-        }
-    }
- 
+    shard->locked_at = locked_at;
+}
 
-  
+void display_shard_unlock(display_shard_t *shard)
+{
+    long long locked_at = shard->locked_at;
 
-         
-          
-  }
-  
+    shard->locked_at = 0;
+    stats_unlock(&shard->lock, STATS_DISPLAY_HOLD, locked_at);
+}
 
+/*
+ * The load lists of a type in its display shard, created the first
+ * time the type has a display thread. Called with the shard locked.
+ */
+display_load_t *display_load_of (display_shard_t *shard, int type)
+{
+    display_load_t *loads;
+    int index = type / display_shard_count, slots;
+
+    if (index >= shard->load_slots) {
+        slots = shard->load_slots ? shard->load_slots : 16;
+        while (slots <= index)
+            slots *= 2;
+        loads = realloc (shard->loads, slots * sizeof (display_load_t));
+        if (loads == NULL)
+            errno_abort ("Allocate display loads");
+        memset (loads + shard->load_slots, 0, (slots - shard->load_slots) * sizeof (display_load_t));
+        shard->loads = loads;
+        shard->load_slots = slots;
+    }
+    if (shard->loads[index].by_load == NULL) {
+        shard->loads[index].by_load = calloc (display_capacity, sizeof (display_t *));
+        if (shard->loads[index].by_load == NULL)
+            errno_abort ("Allocate display loads");
+    }
+    return &shard->loads[index];
 }
 
 /*
- * The alarm thread's start routine.
+ * Whether a display thread belongs in a load list: it is running,
+ * and has alarms but room for more.
  */
-void *alarm_thread (void *arg)
+int display_open (display_t *display)
 {
-    alarm_t *current_alarms;
-    
-    display_t *new, *next_thread, **last_thread;
-    int sleep_time;
-    time_t now;
-    int status;
-    int capacity;
-    int count = 0;
-    display_t *new_display_thread; //new display thread
+    return display->end_of_life == 0 && display->num_of_alarms > 0 && display->num_of_alarms < display_capacity;
+}
 
-    /*
-     * Loop forever, processing commands. The alarm thread will
-     * be disintegrated when the process exits.
-     */
+/*
+ * Put a display thread in the list of its load, or take it out,
+ * around every change to its num_of_alarms or end_of_life. Called
+ * with its shard locked.
+ */
+void display_load_link (display_t *display)
+{
+    display_load_t *load;
+    int n = display->num_of_alarms;
+
+    if (!display_open (display))
+        return;
+    load = display_load_of (display->shard, display->type);
+    display->load_prev = NULL;
+    display->load_next = load->by_load[n];
+    if (display->load_next != NULL)
+        display->load_next->load_prev = display;
+    load->by_load[n] = display;
+    load->open |= 1u << n;
+}
 
-    status = pthread_mutex_lock (&new_alarm_mutex);
-        if (status != 0)
-            err_abort (status, "Lock mutex");
-    while (1) {
+void display_load_unlink (display_t *display)
+{
+    display_load_t *load;
+    int n = display->num_of_alarms;
+
+    if (!display_open (display))
+        return;
+    load = display_load_of (display->shard, display->type);
+    if (display->load_prev != NULL)
+        display->load_prev->load_next = display->load_next;
+    else
+        load->by_load[n] = display->load_next;
+    if (display->load_next != NULL)
+        display->load_next->load_prev = display->load_prev;
+    if (load->by_load[n] == NULL)
+        load->open &= ~(1u << n);
+}
 
-        //If list is empty or no new alarms nothing to do just wait
-        //Should also wait on main thread to signal when new alarm or type change happened
-        
-        while(new_alarm == NULL){
-            
-          status = pthread_cond_wait (&alarm_cond, &new_alarm_mutex);
-            
-            if (status != 0)
-            err_abort (status, "Wait on cond");
-        }
-       
-        
+/*
+ * The least loaded display thread of a type with a free slot, or
+ * NULL if there is none. Called with the type's shard locked.
+ */
+display_t *display_least_loaded (display_shard_t *shard, int type)
+{
+    display_load_t *load = display_load_of (shard, type);
 
-        /*
-           A.3.3.1. For each newly inserted alarm or newly changed alarm with a type change
-           in the alarm list, if no display threads responsible for the alarm type of the alarm
-           currently exist, then create a new display thread for the alarm type of the alarm.
-           Then the alarm thread will print:
-           “First New Display Thread(<thread_id>) Created at <creation_time>: <type time
-            message>”.    
-        */
+    return load->open != 0 ? load->by_load[__builtin_ctz (load->open)] : NULL;
+}
 
-        /*
-          *  A.3.3.2. For each newly inserted alarm or newly changed alarm with a type change
-          *  in the alarm list, if all existing display threads responsible for the alarm type of the
-          *  alarm have already been assigned two (2) alarms, then create a new display thread
-          *  responsible for the alarm type of the alarm.Then the alarm thread will print:
-          *  “Additional New Display Thread(<thread_id> Created at <creation_time>: <type time message>”.  
-       */ 
+/*
+ * Lock and unlock a periodic scheduler, timing the wait and hold for
+ * the runtime statistics. The periodic thread, which holds the lock
+ * whenever it is not waiting on the condition, times its own holds.
+ */
+void periodic_lock (periodic_t *periodic)
+{
+    long long locked_at = stats_lock (&periodic->lock, STATS_PERIODIC_WAIT);
 
-            last_thread = &display_threads;
-            next_thread = *last_thread;
+    periodic->locked_at = locked_at;
+}
 
-            while (next_thread != NULL) {
-                //if display_thread is same type and hass less than 2 alarms
-                if (pthread_equal(next_thread->display_thread, (pthread_t) NULL) == 0 && strcmp(new_alarm->type, next_thread->type) == 0 && next_thread -> num_of_alarms < 2) {
-                    
+void periodic_unlock (periodic_t *periodic)
+{
+    long long locked_at = periodic->locked_at;
 
-                    if(next_thread -> display_alarms[1] ==NULL)
-                    next_thread -> display_alarms[1] = new_alarm;
-                    else
-                    next_thread -> display_alarms[0] = new_alarm;
-                    //assign this alarm to display thread
-                    next_thread -> num_of_alarms = next_thread -> num_of_alarms +1;
-                    
-                    break;
-                }
-                last_thread = &next_thread->link;
-                next_thread = next_thread->link;
-            }
+    periodic->locked_at = 0;
+    stats_unlock (&periodic->lock, STATS_PERIODIC_HOLD, locked_at);
+}
 
-            //Either no display threads, or no display threads for this type... create new display thread
-            if (next_thread == NULL) {
-                
-                //allocate memory for new display_thread_node
-                new_display_thread = malloc(sizeof(display_t));
-                
-             
-                
-               
+long long monotonic_ns(void)
+{
+    struct timespec now;
 
-                *last_thread = new_display_thread;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
 
-              
-                new_display_thread-> end_of_life = 0;
-                new_display_thread -> num_of_alarms = new_display_thread -> num_of_alarms + 1;
-                strcpy(new_display_thread -> type, new_alarm->type);
-                new_display_thread -> display_alarms[0] = new_alarm;
+/*
+ * Send part of the reply to a command: to standard output for a
+ * command read from standard input, or to the socket client that
+ * sent it (command_server.h).
+ */
+void reply_write(const char *text, size_t length)
+{
+    if (length == 0)
+        return;
+    if (reply_client == NULL)
+        log_printf("%.*s", (int)length, text);
+    else
+        client_append(reply_client, text, length);
+}
 
-                status = pthread_create (&new_display_thread->display_thread, NULL, display_thread, new_display_thread);
-                if (status != 0)
-                err_abort (status, "Create display thread");
-                
-            
-                
+/*
+ * Print part of the reply to a command. A scheduler applying
+ * commands keeps the text in its replies, for the router to send
+ * with reply_write in command order.
+ */
+void reply_printf(const char *format, ...)
+{
+    char text[LOG_RECORD_MAX];
+    reply_text_t *replies = reply_capture;
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    if (replies == NULL && reply_client == NULL)
+        log_vprintf(format, args);
+    else {
+        length = vsnprintf(text, sizeof(text), format, args);
+        if (length >= (int)sizeof(text))
+            length = sizeof(text) - 1;
+        if (length > 0 && replies != NULL) {
+            if (replies->used + length > replies->size) {
+                replies->size = replies->size ? replies->size * 2 : 65536;
+                while (replies->size < replies->used + length)
+                    replies->size *= 2;
+                replies->text = realloc(replies->text, replies->size);
+                if (replies->text == NULL)
+                    errno_abort ("Allocate replies");
             }
-           
-           
+            memcpy(replies->text + replies->used, text, length);
+            replies->used += length;
+        } else if (length > 0)
+            client_append(reply_client, text, length);
+    }
+    va_end(args);
+}
 
-            //after inserting new alarm, set new alarm pointer 
-            new_alarm = NULL;
 
-            
-            
-           
-      
 
-        /*
-         * Unlock the mutex before waiting, so that the main
-         * thread can lock it to insert a new alarm request. If
-         * the sleep_time is 0, then call sched_yield, giving
-         * the main thread a chance to run if it has been
-         * readied by user input, without delaying the message
-         * if there's no input.
-         */
-        /* status = pthread_mutex_unlock (&new_alarm_mutex);
-           if (status != 0)
-            err_abort (status, "Unlock mutex");
-        */
+/*
+ * Take an alarm out of its bucket. Called with the periodic lock
+ * held.
+ */
+static void periodic_unlink (periodic_t *periodic, alarm_t *alarm)
+{
+    int slot = alarm->periodic_tick % periodic->slots;
+
+    if (alarm->periodic_prev != NULL)
+        alarm->periodic_prev->periodic_next = alarm->periodic_next;
+    else
+        periodic->bucket[slot] = alarm->periodic_next;
+    if (alarm->periodic_next != NULL)
+        alarm->periodic_next->periodic_prev = alarm->periodic_prev;
+    if (periodic->bucket[slot] == NULL)
+        periodic->occupied[slot / ULONG_BITS] &= ~(1UL << (slot % ULONG_BITS));
+    periodic->count--;
+    alarm->periodic_tick = 0;
+    alarm->display = NULL;
+}
 
-       
+/*
+ * Start printing an alarm periodically for a display thread, the
+ * first time five seconds after "from". An alarm that is already
+ * being printed (for another display thread, before a type change)
+ * starts a new period. Called with the alarm's shard locked.
+ */
+void periodic_add (periodic_t *periodic, alarm_t *alarm, display_t *display, long long from)
+{
+    long long tick;
+    int slot, status;
+
+    periodic_lock (periodic);
+    if (alarm->periodic_tick != 0)
+        periodic_unlink (periodic, alarm);
+    alarm->display = display;
+    //rounded up, so a print may be up to one window late but never early
+    tick = (from + PERIODIC_NS + periodic->window - 1) / periodic->window;
+    slot = tick % periodic->slots;
+    alarm->periodic_tick = tick;
+    alarm->periodic_prev = NULL;
+    alarm->periodic_next = periodic->bucket[slot];
+    if (alarm->periodic_next != NULL)
+        alarm->periodic_next->periodic_prev = alarm;
+    periodic->bucket[slot] = alarm;
+    periodic->occupied[slot / ULONG_BITS] |= 1UL << (slot % ULONG_BITS);
+    periodic->count++;
+    if (periodic->wait_tick == 0 || tick < periodic->wait_tick) {
+        status = pthread_cond_signal (&periodic->cond);
+        if (status != 0)
+            err_abort (status, "Signal cond");
     }
+    periodic_unlock (periodic);
 }
 
-int input_validator(const char *keyword, int user_arg ) {
-    
-    //if input is valid, return flag that corresponds to the keyword
-    if((strcmp(keyword, "Cancel_Alarm") == 0) && (user_arg == 2)) {
-        return 1;
-    }
-    if((strcmp(keyword, "View_Alarms") == 0) && (user_arg == 1)) {
-        return 2;
-    }
-    if((strcmp(keyword, "Start_Alarm") == 0) && (user_arg == 5)) {
-        return 3;
-    }
-    if((strcmp(keyword, "Change_Alarm") == 0) && (user_arg == 5)) {
-        return 4;
+/*
+ * Stop printing an alarm periodically, and detach it from its
+ * display thread. Called with the alarm's shard locked.
+ */
+void periodic_remove (periodic_t *periodic, alarm_t *alarm)
+{
+    if (alarm->periodic_tick == 0)
+        return;
+    periodic_lock (periodic);
+    periodic_unlink (periodic, alarm);
+    periodic_unlock (periodic);
+}
+
+/*
+ * Return the first tick, from periodic->next_tick on, whose bucket
+ * holds any alarm. Called with the periodic lock held, and only
+ * when some bucket is occupied.
+ */
+long long periodic_next_tick (periodic_t *periodic)
+{
+    int start = periodic->next_tick % periodic->slots;
+    int offset = 0, slot, span;
+    unsigned long bits;
+
+    while (offset < periodic->slots) {
+        slot = (start + offset) % periodic->slots;
+        bits = periodic->occupied[slot / ULONG_BITS] >> (slot % ULONG_BITS);
+        if (bits != 0)
+            return periodic->next_tick + offset + __builtin_ctzl (bits);
+        //skip the rest of this bitmap word, but never past the end of the ring
+        span = ULONG_BITS - slot % ULONG_BITS;
+        if (span > periodic->slots - slot)
+            span = periodic->slots - slot;
+        offset += span;
     }
-    //otherwise we return 1
-    return -1;
+    return periodic->next_tick;
 }
 
-int main (int argc, char *argv[])
+/*
+ * The periodic scheduler's start routine. It sleeps until the next
+ * occupied bucket is due, then prints every alarm in every bucket
+ * that has come due. The lines go to the log writer together, so
+ * they leave in one write.
+ */
+void *periodic_thread (void *arg)
 {
+    periodic_t *periodic = arg;
+    struct timespec cond_time;
+    long long tick, now_tick, last_tick;
+    alarm_t *alarm;
+    const char *timeString;
     int status;
-    int first;
-    int counter;
-    int user_arg;
-    char a_or_b = 'a';
-    char line[128];
-    char keyword[13];
-    int flag_input;
-    alarm_t *alarm, **last, *next;
-    display_t *new, *next_thread, **last_thread;
-    pthread_t thread;
-    int sleep_time;
-    time_t now;
-    fd_set readfds;
-    struct timeval timeout;
-    int returned_value;
-    int removed_alarms = 0;
-    char timeString[80];
-    
-    
-    status = pthread_create (
-        &thread, NULL, alarm_thread, NULL);
-    if (status != 0)
-        err_abort (status, "Create alarm thread");
-        
-    printf ("alarm> ");
-    fflush(stdout);
 
+    periodic_lock (periodic);
     while (1) {
-        
-        FD_ZERO(&readfds);
-        FD_SET(STDIN_FILENO, &readfds);
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 500000;
-        expired = 0;
-        removed_alarms = 0;
-        
-        returned_value = select(STDIN_FILENO+1, &readfds, NULL, NULL, &timeout);
-        
-        if(returned_value == -1){
-            perror("select()");
-            exit(EXIT_FAILURE);
-        }
-        else if (returned_value){
-            printf ("alarm> ");
-            //take care of request
-             if (fgets (line, sizeof (line), stdin) == NULL) exit (0);
-        if (strlen (line) <= 1) continue;
-        
-        alarm = (alarm_t*)malloc (sizeof (alarm_t));
-        if (alarm == NULL)
-            errno_abort ("Allocate alarm");
-        
-        /*
-         * Parse input line into seconds (%d) and a message
-         * (%64[^\n]), consisting of up to 64 characters
-         * separated from the seconds by whitespace.
-         */
-        user_arg = sscanf(line, "%[^(\n](%d): T%128[^ ] %d %128[^\n]", keyword, &alarm->id, &alarm->type, &alarm->seconds, alarm->message);
-        flag_input = input_validator(keyword, user_arg);
-
-        if (flag_input == -1) {
-            fprintf (stderr, "Bad command\n");
-            free (alarm);
+        if (periodic->locked_at != 0)
+            stats_record (STATS_PERIODIC_HOLD, monotonic_ns() - periodic->locked_at);
+        if (periodic->count == 0) {
+            periodic->wait_tick = 0;
+            status = pthread_cond_wait (&periodic->cond, &periodic->lock);
         } else {
-           
-            status = pthread_mutex_lock (&new_alarm_mutex);
-            if (status != 0)
-                err_abort (status, "Lock mutex");
-            
-            alarm->time = time (NULL) + alarm->seconds;
-            alarm -> cancelled = 0;
+            periodic->wait_tick = periodic_next_tick (periodic);
+            cond_time.tv_sec = periodic->wait_tick * periodic->window / NSEC_PER_SEC;
+            cond_time.tv_nsec = periodic->wait_tick * periodic->window % NSEC_PER_SEC;
+            status = pthread_cond_timedwait (&periodic->cond, &periodic->lock, &cond_time);
+        }
+        if (status != 0 && status != ETIMEDOUT)
+            err_abort (status, "Wait on cond");
+        periodic->locked_at = stats_sampled () ? monotonic_ns() : 0;
+
+        now_tick = monotonic_ns() / periodic->window;
+        if (periodic->count == 0 || now_tick < periodic->next_tick)
+            continue;
+
+        //the periodic lock alone is enough to read the alarms' type, time and message
+
+        timeString = log_time();
+
+        //one pass round the ring is enough however far behind the scheduler is
+        last_tick = now_tick;
+        if (last_tick - periodic->next_tick >= periodic->slots)
+            last_tick = periodic->next_tick + periodic->slots - 1;
+        for (tick = periodic->next_tick; tick <= last_tick; tick++) {
+            for (alarm = periodic->bucket[tick % periodic->slots]; alarm != NULL; alarm = alarm->periodic_next) {
+                //an alarm added while the scheduler lagged behind waits for its own lap
+                if (alarm->periodic_tick > now_tick)
+                    continue;
+                while (alarm->periodic_tick <= now_tick)
+                    alarm->periodic_tick += periodic->slots;
+
+                /* A.3.4.5. For each alarm with an alarm type which the display thread is responsible
+                 * for and the alarm has been assigned by the alarm thread to that display thread, the
+                 * display thread will periodically print, every five (5) seconds, the message in that
+                 * alarm as follows:
+                 */
+                if (journal_enabled (&journal))
+                    journal_event (&journal, JOURNAL_PERIODIC, alarm->id, alarm->type, alarm->msecs, alarm->display->thread_address, NULL);
+                else
+                    log_printf ("Alarm(%d) Message PERIODICALLY PRINTED BY Display Thread (%lu) at %s: T%s " DURATION_FMT " %s \n",
+                        alarm->id, (unsigned long)alarm->display->thread_address, timeString, TYPE_NAME(alarm->type), DURATION_ARGS(alarm->msecs), alarm->message);
+            }
+        }
+        periodic->next_tick = now_tick + 1;
+    }
+}
 
-            //Check for dead display threads
-           last_thread = &display_threads;
-           next_thread = *last_thread;
+/*
+ * Set up the bucket ring for an alignment window of "window_ms"
+ * milliseconds, which must divide the five-second period, and
+ * start the periodic scheduler.
+ */
+void periodic_start (periodic_t *periodic, int window_ms)
+{
+    pthread_condattr_t cond_attr;
+    pthread_t thread;
+    int status;
 
-           while (next_thread != NULL) {
-            
-                //if display_thread is dead, remove from list. 
-                if (next_thread->end_of_life == 1) {
-                     
+    periodic->window = window_ms * 1000000LL;
+    periodic->slots = PERIODIC_NS / periodic->window;
+    periodic->bucket = calloc (periodic->slots, sizeof (alarm_t *));
+    periodic->occupied = calloc ((periodic->slots + ULONG_BITS - 1) / ULONG_BITS, sizeof (unsigned long));
+    if (periodic->bucket == NULL || periodic->occupied == NULL)
+        errno_abort ("Allocate periodic buckets");
+    periodic->next_tick = monotonic_ns() / periodic->window;
 
-                    *last_thread = next_thread->link;
+    status = pthread_mutex_init (&periodic->lock, NULL);
+    if (status != 0)
+        err_abort (status, "Init mutex");
+    status = pthread_condattr_init (&cond_attr);
+    if (status == 0)
+        status = pthread_condattr_setclock (&cond_attr, CLOCK_MONOTONIC);
+    if (status == 0)
+        status = pthread_cond_init (&periodic->cond, &cond_attr);
+    if (status != 0)
+        err_abort (status, "Init cond");
+    pthread_condattr_destroy (&cond_attr);
 
-                    display_t *temp = next_thread;
-                    
-                    next_thread = next_thread->link;
-                    
-                    free(temp);
+    status = pthread_create (&thread, NULL, periodic_thread, periodic);
+    if (status != 0)
+        err_abort (status, "Create periodic thread");
+}
 
-                    last_thread = &next_thread->link;
-                }
-                else {
-                last_thread = &next_thread->link;
-                
-                next_thread = next_thread->link;
-                }
-                
-            }
+/*
+ * Whether nothing refers to an alarm any more: it has left the
+ * alarm list, is not waiting on the command ring, no display
+ * thread prints it, and no display thread still has it in a slot.
+ * An alarm that changed type keeps its slot in the old display
+ * thread until that one runs, even if it has been assigned another
+ * since. Whoever finds this true, with the alarm's shard locked,
+ * frees the alarm. Since an alarm out of the list is never queued
+ * or assigned again, that happens exactly once.
+ */
+int alarm_released (alarm_t *alarm)
+{
+    return (alarm->cancelled == 1 || alarm->expired == 1) && alarm->pending == 0 && alarm->display == NULL
+        && alarm->held == 0;
+}
 
-            
+/*
+ * Free an alarm and its message. Released alarms are retired with
+ * it, so that View_Alarms may still be reading either.
+ */
+void alarm_free (void *alarm)
+{
+    slab_free (((alarm_t *)alarm)->message);
+    slab_free (alarm);
+}
 
-            /*
-             * A.3.2.1. For each valid Start_Alarm request received, the main thread will insert the
-             * corresponding alarm with the specified Alarm_ID into the alarm list, in which all the
-             * alarms are placed in the order of their Alarm_IDs. Then the main thread will print:
-             * “Alarm( <alarm_id>) Inserted by Main Thread (<thread-id>) Into Alarm List at
-             * <insert_time>: <time message>”.
+/*
+ * Run one pass of a display thread: report on and drop each of its
+ * alarms that changed type, was cancelled or expired. Called by a
+ * display worker with the display thread's shard locked.
+ */
+void display_run (display_t *thread_data){
 
-            */
-            if (flag_input == 3){
-            
-            /*
-             * Insert the new alarm into the list of alarms,
-             * sorted by expiration time.
-             */
+  int i, dropped, released, remaining;
+  alarm_t *alarm;
+  alarm_shard_t *shard;
+  periodic_t *periodic;
+  display_t *next_thread;
+  const char *timeString;
 
-            //last is the address of the alarm_list pointer
-            last = &alarm_list;
-            //next is the alarm_list pointer itself
-            next = *last;
-            while (next != NULL) {
-                if (next->id <= alarm->id) {
-                    alarm->link = next;
-                    *last = alarm;
-                    break;
-                }
-                last = &next->link; //address of next node's link
-                next = next->link;
-            }
-            /*
-             * If we reached the end of the list, insert the new
-             * alarm there. ("next" is NULL, and "last" points
-             * to the link field of the last item, or to the
-             * list header).
-             */
-            if (next == NULL) {
-                *last = alarm;
-                alarm->link = NULL;
-            }
-            
-            now = time(NULL);
-            strftime (timeString,80,"%D %I:%M:%S %p",localtime(&now));
+  //a display thread kicked again just before it terminated has nothing left to do
+  if (thread_data->end_of_life == 1)
+    return;
 
-            printf("Alarm(%d) Inserted by Main Thread (%lu) Into Alarm List at <%s>: %d %s \n", alarm->id, (unsigned long)pthread_self(), timeString, alarm->seconds, alarm->message);
-            
-            new_alarm = alarm;
-             
-            //signal alarm_cond because new alarm inserted
-            status = pthread_cond_signal(&alarm_cond); 
-            
-            if (status != 0)
-            err_abort (status, "Signal cond");
-            
+     // get current time string
+     timeString = log_time();
+
+  remaining = thread_data->num_of_alarms;
+  for (i = 0; i < display_capacity; i++) {
+    alarm = thread_data->display_alarms[i];
+    if (alarm == NULL)
+      continue;
+    //a display thread's alarms all belong to the scheduler of its registry
+    shard = alarm_store_shard(&scheduler_of(alarm->id)->store, alarm->id);
+    periodic = &scheduler_of(alarm->id)->periodic;
+    alarm_shard_lock(shard);
+    dropped = 1;
 
-            }
+    /* A.3.4.3. if the alarm type of an alarm assigned the display thread in the alarm list
+       * has been changed, then the display thread will stop printing the message in that
+       * alarm. Then the display thread will print:
+       */ 
+      //or was since given to another display thread, which it can only have been by changing type
+      if(alarm->type != thread_data->type || alarm->display != thread_data){ 
+        if (journal_enabled(&journal))
+          journal_event(&journal, JOURNAL_STOP_CHANGED, alarm->id, alarm->type, alarm->msecs, thread_data->thread_address, NULL);
+        else
+          log_printf("Alarm(%d) Changed Type; Display Thread (%lu) Stopped Printing Alarm Message at %s: %s " DURATION_FMT " %s \n", alarm->id, (unsigned long)thread_data->thread_address, timeString, TYPE_NAME(alarm->type), DURATION_ARGS(alarm->msecs), alarm->message);
+        //unless the alarm thread already handed it to its new display thread
+        if (alarm->display == thread_data)
+          periodic_remove(periodic, alarm);
+      }  
 
-           /*
+      /* A.3.4.2. if an alarm assigned the display thread in the alarm list has been cancelled,
+      * then the display thread will stop printing the message in that alarm. Then the display
+      * thread will print:
+      */
+
+      else if(alarm->cancelled == 1){
+        if (journal_enabled(&journal))
+          journal_event(&journal, JOURNAL_STOP_CANCELLED, alarm->id, alarm->type, alarm->msecs, thread_data->thread_address, NULL);
+        else
+          log_printf("Alarm(%d) Cancelled; Display Thread (%lu) Stopped Printing Alarm Message at %s: %s " DURATION_FMT " %s \n", alarm->id, (unsigned long)thread_data->thread_address, timeString, TYPE_NAME(alarm->type), DURATION_ARGS(alarm->msecs), alarm->message);
+        periodic_remove(periodic, alarm);
+      }  
+
+      /*  A.3.4.1. If the expiry time of an alarm assigned to the display thread in the alarm list
+      *  has been reached, then the display thread will stop printing the message in that
+      *  alarm. Then the display thread will print:
+      */
+      else if(alarm->expired == 1){
+        if (journal_enabled(&journal))
+          journal_event(&journal, JOURNAL_STOP_EXPIRED, alarm->id, alarm->type, alarm->msecs, thread_data->thread_address, NULL);
+        else
+          log_printf("Alarm(%d) Expired; Display Thread (%lu) Stopped Printing Alarm Message at %s: T%s " DURATION_FMT " %s \n", alarm->id, (unsigned long)thread_data->thread_address, timeString, TYPE_NAME(alarm->type), DURATION_ARGS(alarm->msecs), alarm->message);
+        periodic_remove(periodic, alarm);
+      }
+      else
+        dropped = 0;
+    if (dropped) {
+      thread_data->display_alarms[i] = NULL;
+      remaining--;
+      alarm->held--;
+    }
+    released = dropped && alarm_released(alarm);
+    alarm_shard_unlock(shard);
+
+    if (released)
+      epoch_retire(alarm, alarm_free);
+  }
+
+    //its load changes only now, under its shard lock, so the alarm thread never sees a slot freed early
+    display_load_unlink(thread_data);
+    thread_data->num_of_alarms = remaining;
+    display_load_link(thread_data);
+
+    if(thread_data->num_of_alarms == 0){
+      if (journal_enabled(&journal))
+        journal_event(&journal, JOURNAL_DISPLAY_TERMINATE, 0, thread_data->type, 0, thread_data->thread_address, NULL);
+      else
+        log_printf("Display Thread Terminated (%lu) at %s \n", (unsigned long)thread_data->thread_address, timeString);
+      thread_data->end_of_life = 1;
+
+      //the display worker frees the node once no kick for it is still queued
+      next_thread = thread_data->link;
+      if (thread_data->prev != NULL)
+        thread_data->prev->link = next_thread;
+      else
+        thread_data->shard->displays = next_thread;
+      if (next_thread != NULL)
+        next_thread->prev = thread_data->prev;
+    }
+}
+
+/*
+ * Add a display thread to the bottom of a worker's deque. Called
+ * with the worker's lock held.
+ */
+void display_push (display_worker_t *worker, display_t *display)
+{
+    display_t **tasks;
+    int i;
+
+    if (worker->count == worker->capacity) {
+        tasks = malloc ((worker->capacity ? worker->capacity * 2 : 64) * sizeof (display_t *));
+        if (tasks == NULL)
+            errno_abort ("Allocate display deque");
+        for (i = 0; i < worker->count; i++)
+            tasks[i] = worker->tasks[(worker->top + i) % worker->capacity];
+        free (worker->tasks);
+        worker->tasks = tasks;
+        worker->capacity = worker->capacity ? worker->capacity * 2 : 64;
+        worker->top = 0;
+    }
+    worker->tasks[(worker->top + worker->count++) % worker->capacity] = display;
+}
+
+/*
+ * The worker whose deque a kick goes on: the caller's own, if it is
+ * a worker, or else the next round robin.
+ */
+display_worker_t *display_kick_worker (void)
+{
+    if (display_worker_self >= 0)
+        return &display_workers[display_worker_self];
+    return &display_workers[atomic_fetch_add (&display_worker_next, 1) % display_worker_count];
+}
+
+/*
+ * Queue a display thread to run on a display worker, unless it is
+ * already queued. Workers queue onto their own deque; other
+ * threads spread their kicks over the workers round robin.
+ */
+void display_kick (display_t *display)
+{
+    display_worker_t *worker;
+    int status;
+
+    if (atomic_exchange (&display->scheduled, 1) != 0)
+        return;
+
+    worker = display_kick_worker ();
+    status = pthread_mutex_lock (&worker->lock);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    display_push (worker, display);
+    status = pthread_mutex_unlock (&worker->lock);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+
+    status = pthread_mutex_lock (&display_pool_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    display_pool_pending++;
+    if (display_pool_idle > 0) {
+        status = pthread_cond_signal (&display_pool_cond);
+        if (status != 0)
+            err_abort (status, "Signal cond");
+    }
+    status = pthread_mutex_unlock (&display_pool_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+int display_compare (const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)*(display_t * const *)a, y = (uintptr_t)*(display_t * const *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Kick every display thread in "displays" (which is sorted in the
+ * process), each only once however often it appears. They go onto
+ * one worker's deque under a single lock, and the idle workers are
+ * woken together to steal their share, so a bulk command costs one
+ * round of locking rather than one per alarm.
+ */
+void display_kick_all (display_t **displays, int count)
+{
+    display_worker_t *worker;
+    int queued = 0, status, i;
+
+    if (count == 0)
+        return;
+    qsort (displays, count, sizeof (display_t *), display_compare);
+    worker = display_kick_worker ();
+    status = pthread_mutex_lock (&worker->lock);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    for (i = 0; i < count; i++)
+        if ((i == 0 || displays[i] != displays[i - 1]) && atomic_exchange (&displays[i]->scheduled, 1) == 0) {
+            display_push (worker, displays[i]);
+            queued++;
+        }
+    status = pthread_mutex_unlock (&worker->lock);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    if (queued == 0)
+        return;
+
+    status = pthread_mutex_lock (&display_pool_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    display_pool_pending += queued;
+    if (display_pool_idle > 0) {
+        status = pthread_cond_broadcast (&display_pool_cond);
+        if (status != 0)
+            err_abort (status, "Broadcast cond");
+    }
+    status = pthread_mutex_unlock (&display_pool_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+/*
+ * Take a task from a worker's deque: from the bottom (newest) if
+ * it is the caller's own deque, from the top (oldest) if stealing.
+ */
+display_t *display_take (display_worker_t *worker, int steal)
+{
+    display_t *display = NULL;
+    int status;
+
+    status = pthread_mutex_lock (&worker->lock);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    if (worker->count > 0) {
+        if (steal) {
+            display = worker->tasks[worker->top];
+            worker->top = (worker->top + 1) % worker->capacity;
+        } else {
+            display = worker->tasks[(worker->top + worker->count - 1) % worker->capacity];
+        }
+        worker->count--;
+    }
+    status = pthread_mutex_unlock (&worker->lock);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    return display;
+}
+
+/*
+ * The display workers' start routine. A worker runs the display
+ * threads on its own deque, steals from the others when its own
+ * is empty, and otherwise waits for a kick.
+ */
+void *display_worker (void *arg)
+{
+    int self = (int)(long)arg;
+    display_t *display;
+    int status, i, free_display;
+
+    display_worker_self = self;
+    while (1) {
+        display = display_take (&display_workers[self], 0);
+        for (i = 1; display == NULL && i < display_worker_count; i++)
+            display = display_take (&display_workers[(self + i) % display_worker_count], 1);
+
+        if (display != NULL) {
+            status = pthread_mutex_lock (&display_pool_mutex);
+            if (status != 0)
+                err_abort (status, "Lock mutex");
+            display_pool_pending--;
+            status = pthread_mutex_unlock (&display_pool_mutex);
+            if (status != 0)
+                err_abort (status, "Unlock mutex");
+
+            /*
+             * A kick that arrives while the display thread runs
+             * queues it again. A terminated display thread is freed
+             * by whichever worker runs its last queued kick.
+             */
+            display_shard_lock (display->shard);
+            atomic_store (&display->scheduled, 0);
+            display_run (display);
+            free_display = display->end_of_life == 1 && atomic_load (&display->scheduled) == 0;
+            display_shard_unlock (display->shard);
+            if (free_display)
+                epoch_retire (display, slab_free);
+            continue;
+        }
+
+        status = pthread_mutex_lock (&display_pool_mutex);
+        if (status != 0)
+            err_abort (status, "Lock mutex");
+        if (display_pool_pending == 0) {
+            display_pool_idle++;
+            status = pthread_cond_wait (&display_pool_cond, &display_pool_mutex);
+            display_pool_idle--;
+            if (status != 0)
+                err_abort (status, "Wait on cond");
+        }
+        status = pthread_mutex_unlock (&display_pool_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock mutex");
+    }
+}
+
+/*
+ * Start one display worker per processor.
+ */
+void display_pool_start (void)
+{
+    long processors;
+    int status, i;
+
+    processors = sysconf (_SC_NPROCESSORS_ONLN);
+    display_worker_count = processors > 0 ? (int)processors : 1;
+    display_workers = calloc (display_worker_count, sizeof (display_worker_t));
+    if (display_workers == NULL)
+        errno_abort ("Allocate display workers");
+    for (i = 0; i < display_worker_count; i++) {
+        status = pthread_mutex_init (&display_workers[i].lock, NULL);
+        if (status != 0)
+            err_abort (status, "Init mutex");
+        status = pthread_create (&display_workers[i].thread, NULL, display_worker, (void *)(long)i);
+        if (status != 0)
+            err_abort (status, "Create display worker");
+    }
+}
+
+/*
+ * Assign an alarm to a display thread responsible for its type,
+ * creating a new display thread if there is none with room, and
+ * kick the display thread if "kick" is set. The kick is made with
+ * the display shard still locked: once it is unlocked, the alarm
+ * may be cancelled and the display thread run, terminate and be
+ * freed before a later kick.
+ */
+void assign_alarm (alarm_t *alarm, int kick)
+{
+    scheduler_t *scheduler = scheduler_of(alarm->id);
+    display_t *next_thread, *new_display_thread, *assigned;
+    display_shard_t *display_shard;
+    alarm_shard_t *alarm_shard;
+    int type, slot, released;
+
+    /*
+     * The type decides the display shard, but may only be read with
+     * the alarm's shard locked. The alarm stays pending until both
+     * are locked, so nobody frees it in between, and if its type
+     * changes meanwhile the right display shard is locked again.
+     */
+    alarm_shard = alarm_store_shard(&scheduler->store, alarm->id);
+    for (;;) {
+        alarm_shard_lock(alarm_shard);
+        type = alarm->type;
+        alarm_shard_unlock(alarm_shard);
+
+        display_shard = display_shard_of(scheduler, type);
+        display_shard_lock(display_shard);
+        alarm_shard_lock(alarm_shard);
+        if (alarm->type == type)
+            break;
+        alarm_shard_unlock(alarm_shard);
+        display_shard_unlock(display_shard);
+    }
+    alarm->pending = 0;
+
+    /*
+     * Nothing to do if the alarm is still with a display thread of
+     * its type (changed away and back), or if it left the alarm list
+     * before it was ever displayed.
+     */
+    if ((alarm->display != NULL && alarm->display->type == type) ||
+        alarm->cancelled == 1 || alarm->expired == 1) {
+        released = alarm_released(alarm);
+        alarm_shard_unlock(alarm_shard);
+        display_shard_unlock(display_shard);
+        if (released)
+            epoch_retire(alarm, alarm_free);
+        return;
+    }
+
+        /*
+           A.3.3.1. For each newly inserted alarm or newly changed alarm with a type change
+           in the alarm list, if no display threads responsible for the alarm type of the alarm
+           currently exist, then create a new display thread for the alarm type of the alarm.
+           Then the alarm thread will print:
+           “First New Display Thread(<thread_id>) Created at <creation_time>: <type time
+            message>”.    
+        */
+
+        /*
+          *  A.3.3.2. For each newly inserted alarm or newly changed alarm with a type change
+          *  in the alarm list, if all existing display threads responsible for the alarm type of the
+          *  alarm have already been assigned two (2) alarms, then create a new display thread
+          *  responsible for the alarm type of the alarm.Then the alarm thread will print:
+          *  “Additional New Display Thread(<thread_id> Created at <creation_time>: <type time message>”.  
+       */ 
+
+            //the least loaded display thread of this type with a free slot, found without a search
+            next_thread = display_least_loaded(display_shard, alarm->type);
+
+            if (next_thread != NULL) {
+                for (slot = 0; next_thread -> display_alarms[slot] != NULL; slot++)
+                    ;
+                next_thread -> display_alarms[slot] = alarm;
+                alarm->held++;
+                //assign this alarm to display thread
+                display_load_unlink(next_thread);
+                next_thread -> num_of_alarms = next_thread -> num_of_alarms +1;
+                display_load_link(next_thread);
+            }
+            assigned = next_thread;
+
+            //Either no display threads for this type, or all of them full... create new display thread
+            if (next_thread == NULL) {
+                
+                //allocate memory for new display_thread_node
+                new_display_thread = slab_alloc(&display_cache);
+                memset(new_display_thread, 0, display_cache.size);
+
+                new_display_thread-> end_of_life = 0;
+                new_display_thread -> thread_address = atomic_fetch_add(&display_count, 1) + 1;
+                new_display_thread -> num_of_alarms = new_display_thread -> num_of_alarms + 1;
+                new_display_thread -> type = alarm->type;
+                new_display_thread -> display_alarms[0] = alarm;
+                alarm->held++;
+                new_display_thread -> shard = display_shard;
+                new_display_thread -> link = display_shard->displays;
+                if (new_display_thread -> link != NULL)
+                    new_display_thread -> link -> prev = new_display_thread;
+                display_shard->displays = new_display_thread;
+                display_load_link(new_display_thread);
+                assigned = new_display_thread;
+                if (journal_enabled(&journal))
+                    journal_event(&journal, JOURNAL_DISPLAY_CREATE, alarm->id, alarm->type, alarm->msecs, assigned->thread_address, NULL);
+            }
+
+    //assignments are not part of the text output, only of the journal
+    if (journal_enabled(&journal))
+        journal_event(&journal, JOURNAL_ASSIGN, alarm->id, alarm->type, alarm->msecs, assigned->thread_address, NULL);
+
+    periodic_add(&scheduler->periodic, alarm, assigned, monotonic_ns());
+    alarm_shard_unlock(alarm_shard);
+    if (kick)
+        display_kick(assigned);
+    display_shard_unlock(display_shard);
+}
+
+/*
+ * The alarm thread's start routine. Each scheduler has one, which
+ * assigns display threads to its own alarms.
+ */
+void *alarm_thread (void *arg)
+{
+    scheduler_t *scheduler = arg;
+    alarm_t *batch[COMMAND_BATCH];
+    int count, i;
+
+    /*
+     * Loop forever, processing commands. The alarm thread will
+     * be disintegrated when the process exits.
+     */
+    while (1) {
+
+        //If no new alarms nothing to do just wait
+        //for the main thread to push a new alarm or type change onto the ring
+        count = command_ring_pop (&scheduler->commands, batch, COMMAND_BATCH);
+        if (count == 0) {
+            command_ring_wait (&scheduler->commands);
+            continue;
+        }
+
+        //no OS thread is created: the display thread runs on the display workers
+        for (i = 0; i < count; i++)
+            assign_alarm (batch[i], 1);
+    }
+}
+
+/*
+ * The slack, in milliseconds, of the alarm a command starts or
+ * changes: its own, or the -t default.
+ */
+int command_slack (const command_t *command)
+{
+    return command->slack == COMMAND_DEFAULT_SLACK ? default_slack : command->slack;
+}
+
+/*
+ * Create an alarm and add it to the alarm list, to be handed to the
+ * alarm thread. Called with its shard locked, once its id is known
+ * to be free.
+ */
+alarm_t *alarm_insert (alarm_shard_t *shard, int id, int type, int msecs, int repeats, int slack, const char *message)
+{
+    alarm_t *alarm = slab_alloc (&alarm_cache);
+
+    //slab memory is not zeroed, and an odd version would turn away every lock-free reader
+    memset (alarm, 0, sizeof (alarm_t));
+    alarm->id = id;
+    alarm->type = type;
+    alarm->msecs = msecs;
+    alarm->repeats = repeats;
+    alarm->time = monotonic_ns() + msecs * 1000000LL;
+    alarm->latest = alarm->time + slack * 1000000LL;
+    atomic_store_explicit(&alarm->message, message_alloc(&message_arena, message, strlen(message)), memory_order_relaxed);
+    alarm -> cancelled = 0;
+    alarm -> expired = 0;
+    alarm -> heap_index = -1;
+    alarm -> due_index = -1;
+    alarm -> display = NULL;
+    alarm -> held = 0;
+    alarm -> periodic_tick = 0;
+    alarm_shard_insert(shard, alarm);
+    alarm->pending = 1;
+    if (persist_enabled(&persist))
+        persist_log(&persist, PERSIST_START, alarm->id, alarm->msecs, alarm->repeats, slack, alarm->time, TYPE_NAME(alarm->type), alarm->message);
+    return alarm;
+}
+
+/*
+ * Take an alarm out of the alarm list as cancelled. Its display
+ * thread, which frees it, still has to be kicked. Called with its
+ * shard locked.
+ */
+void alarm_cancel (alarm_shard_t *shard, alarm_t *alarm)
+{
+    alarm_shard_remove(shard, alarm);
+    if (persist_enabled(&persist))
+        persist_log(&persist, PERSIST_CANCEL, alarm->id, 0, 0, 0, 0, NULL, NULL);
+    alarm -> cancelled = 1;
+}
+
+/*
+ * Carry out a parsed Start_Alarm, Change_Alarm or Cancel_Alarm
+ * command on the scheduler its alarm id belongs to. Called with the
+ * shard of the id locked. Returns the alarm to be handed to the
+ * scheduler's alarm thread once the shard is unlocked, if any.
+ */
+alarm_t *apply_command (scheduler_t *scheduler, command_t *command)
+{
+    int type_changed;
+    alarm_t *alarm, *next;
+    alarm_shard_t *shard;
+    const char *timeString;
+    char *message;
+
+            shard = alarm_store_shard(&scheduler->store, command->id);
+
+            /*
+             * A.3.2.1. For each valid Start_Alarm request received, the main thread will insert the
+             * corresponding alarm with the specified Alarm_ID into the alarm list, in which all the
+             * alarms are placed in the order of their Alarm_IDs. Then the main thread will print:
+             * “Alarm( <alarm_id>) Inserted by Main Thread (<thread-id>) Into Alarm List at
+             * <insert_time>: <time message>”.
+
+            */
+            if (command_start(command->kind)){
+
+            /*
+             * Insert the new alarm into both indexes: the hash
+             * table keyed by id, and the heap ordered by
+             * expiration time. Alarm ids are unique, and an alarm
+             * is only allocated once its id is known to be free.
+             */
+            if (alarm_hash_find(&shard->hash, command->id) != NULL) {
+                reply_printf("Alarm(%d) already exists in alarm list \n", command->id);
+                return NULL;
+            }
+            alarm = alarm_insert(shard, command->id, command->type_id, command->msecs, command->repeats, command_slack(command), command->message);
+
+            timeString = log_time();
+
+            if (journal_enabled(&journal))
+                journal_event(&journal, JOURNAL_INSERT, alarm->id, alarm->type, alarm->msecs, (unsigned long)pthread_self(), alarm->message);
+            else if (alarm->repeats > 0)
+                reply_printf("Alarm(%d) Inserted by Main Thread (%lu) Into Alarm List at <%s>: Every " DURATION_FMT ", %d Times: %s \n", alarm->id, (unsigned long)pthread_self(), timeString, DURATION_ARGS(alarm->msecs), alarm->repeats, alarm->message);
+            else if (alarm->repeats < 0)
+                reply_printf("Alarm(%d) Inserted by Main Thread (%lu) Into Alarm List at <%s>: Every " DURATION_FMT ": %s \n", alarm->id, (unsigned long)pthread_self(), timeString, DURATION_ARGS(alarm->msecs), alarm->message);
+            else
+                reply_printf("Alarm(%d) Inserted by Main Thread (%lu) Into Alarm List at <%s>: " DURATION_FMT " %s \n", alarm->id, (unsigned long)pthread_self(), timeString, DURATION_ARGS(alarm->msecs), alarm->message);
+            return alarm;
+            }
+
+           /*
             * A.3.2.2. For each valid Change_Alarm request received, the main thread will use the
             * specified Type, Time and Message values in the Change_Alarm request to replace the
             * Type, Time and Message values in the alarm with the specified Alarm_Id in the alarm list.
@@ -543,34 +1313,52 @@ int main (int argc, char *argv[])
             * Alarm(<alarm_id>) Changed at <change_time>: <type time message>”.
            */
 
-            if(flag_input == 4){
-            
-            last = &alarm_list;
-            next = *last;
-            while (next != NULL) {
-                if (next->id == alarm->id) {
-                    strcpy(next->type, alarm->type);
-                    next->time = alarm->time;
-                    strcpy(next->message, alarm->message);
-
-                   
-                    break;
+            if(command->kind == COMMAND_CHANGE){
+
+            next = alarm_hash_find(&shard->hash, command->id);
+            if (next == NULL) {
+                reply_printf("Alarm(%d) does not exist in alarm list \n", command->id);
+                return NULL;
+            }
+                periodic_lock (&scheduler->periodic);
+                alarm_version_begin(&next->version);
+                type_changed = next->type != command->type_id;
+                if (type_changed) {
+                    alarm_type_unlink(shard, next);
+                    next->type = command->type_id;
+                    alarm_type_link(shard, next);
                 }
-                
-                last = &next->link;
-                next = next->link;
+                next->msecs = command->msecs;
+                next->time = monotonic_ns() + next->msecs * 1000000LL;
+                next->latest = next->time + command_slack(command) * 1000000LL;
+                //a new copy, so that View_Alarms never reads one half written
+                message = atomic_load_explicit(&next->message, memory_order_relaxed);
+                atomic_store_explicit(&next->message, message_alloc(&message_arena, command->message, strlen(command->message)),
+                    memory_order_release);
+                alarm_version_end(&next->version);
+                periodic_unlock (&scheduler->periodic);
+                epoch_retire(message, slab_free);
+                alarm_shard_requeue(shard, next);
+                if (persist_enabled(&persist))
+                    persist_log(&persist, PERSIST_CHANGE, next->id, next->msecs, next->repeats, alarm_slack(next), next->time, TYPE_NAME(next->type), next->message);
+                //the old display thread reports the type change and drops the alarm
+                if (type_changed && next->display != NULL)
+                    display_kick(next->display);
+
+            timeString = log_time();
+
+            if (journal_enabled(&journal))
+                journal_event(&journal, JOURNAL_CHANGE, next->id, next->type, next->msecs, (unsigned long)pthread_self(), next->message);
+            else
+                reply_printf("Alarm(%d) Changed at %s: %s " DURATION_FMT " %s \n", next->id, timeString, TYPE_NAME(next->type), DURATION_ARGS(next->msecs), next->message);
+
+            //only a type change needs the alarm thread to find it a new display thread,
+            //and an alarm already on the ring will be assigned by its latest type anyway
+            if (type_changed && next->pending == 0) {
+                next->pending = 1;
+                return next;
             }
-            now = time(NULL);
-            strftime (timeString,80,"%D %I:%M:%S %p",localtime(&now));
-
-            printf("Alarm(%d) Changed at %s: %s %d %s \n", next->id, timeString, next->type, next->seconds, next->message);
-            
-            new_alarm = next;
-            //signal alarm_cond because alarm changed
-            status = pthread_cond_signal(&alarm_cond); 
-            if (status != 0)
-            err_abort (status, "Signal cond");
-
+            return NULL;
             }
 
             /*
@@ -579,73 +1367,211 @@ int main (int argc, char *argv[])
              *  Alarm(<alarm_id>) Cancelled at <cancel_time>: <type time message>”. 
             */
             
-            if(flag_input == 1){
-            if(alarm_list != NULL){
-            printf("here");    
-            last = &alarm_list;
-            next = *last;
-            while (next != NULL) {
-
-                if (next->id == alarm->id) {
-                    
-                    
-                    *last = next->link;
-
-                    now = time(NULL);
-                    strftime (timeString,80,"%D %I:%M:%S %p",localtime(&now));
+            next = alarm_hash_find(&shard->hash, command->id);
+            if(next != NULL){
+                alarm_cancel(shard, next);
+
+                timeString = log_time();
+
+                if (journal_enabled(&journal))
+                    journal_event(&journal, JOURNAL_CANCEL, next->id, next->type, next->msecs, (unsigned long)pthread_self(), NULL);
+                else
+                    reply_printf("Alarm(%d) cancelled at %s: %s " DURATION_FMT " %s \n", next->id, timeString, TYPE_NAME(next->type), DURATION_ARGS(next->msecs), next->message);
+                //the display thread frees the alarm once it sees it cancelled
+                if (next->display != NULL)
+                    display_kick(next->display);
+            }
+            else{
+            reply_printf("Alarm(%d) does not exist in alarm list \n", command->id);
+            }
+            return NULL;
+}
 
-                    printf("Alarm(%d) cancelled at %s: %s %d %s \n", next->id, timeString, next->type, next->seconds, next->message);
-                    next -> cancelled = 1;
-                    free(alarm);
-                    //free(next);
+/*
+ * Add an alarm to those a scheduler hands its alarm thread once the
+ * commands it applies are done.
+ */
+void scheduler_handoff (scheduler_t *scheduler, alarm_t *alarm)
+{
+    if (scheduler->handoff_count == scheduler->handoff_size) {
+        scheduler->handoff_size *= 2;
+        scheduler->handoffs = realloc (scheduler->handoffs, scheduler->handoff_size * sizeof (alarm_t *));
+        if (scheduler->handoffs == NULL)
+            errno_abort ("Allocate handoffs");
+    }
+    scheduler->handoffs[scheduler->handoff_count++] = alarm;
+}
 
-                 
-                    break;
-                }
-                
-                last = &next->link;
-                next = next->link;
-            }
+/*
+ * Note a display thread to kick once a bulk command, or a shard's
+ * part of an expiry sweep, is done.
+ */
+void scheduler_notify (scheduler_t *scheduler, display_t *display)
+{
+    if (display == NULL)
+        return;
+    if (scheduler->notify_count == scheduler->notify_size) {
+        scheduler->notify_size = scheduler->notify_size ? scheduler->notify_size * 2 : 64;
+        scheduler->notify = realloc (scheduler->notify, scheduler->notify_size * sizeof (display_t *));
+        if (scheduler->notify == NULL)
+            errno_abort ("Allocate display notifications");
+    }
+    scheduler->notify[scheduler->notify_count++] = display;
+}
 
-            
+/*
+ * Cancel an alarm for Cancel_Range or Cancel_Type. Like
+ * Cancel_Alarm, but its display thread is only noted, to be kicked
+ * at the end, and only the journal hears of each alarm.
+ */
+void bulk_cancel (scheduler_t *scheduler, alarm_shard_t *shard, alarm_t *alarm)
+{
+    alarm_cancel (shard, alarm);
+    if (journal_enabled (&journal))
+        journal_event (&journal, JOURNAL_CANCEL, alarm->id, alarm->type, alarm->msecs, (unsigned long)pthread_self (), NULL);
+    scheduler_notify (scheduler, alarm->display);
+}
 
+/*
+ * Carry out a scheduler's part of a bulk command: Start_Alarms on
+ * the ids of its range that belong to the scheduler, or
+ * Cancel_Range, Cancel_Type or Change_Type on the alarms of its
+ * shards, found through their secondary indexes. Called with every
+ * shard of the scheduler locked. A display thread is kicked once
+ * at the end, however many of its alarms were affected. The counts
+ * are added to the batch's, for the router to reply with.
+ */
+void apply_bulk (scheduler_t *scheduler, int index)
+{
+    command_t *command = &batch.commands[index];
+    alarm_store_t *store = &scheduler->store;
+    alarm_shard_t *shard;
+    alarm_t *alarm, *next;
+    long long id;
+    int affected = 0, skipped = 0, found, i, j;
+
+    scheduler->notify_count = 0;
+    switch (command->kind) {
+    case COMMAND_START_RANGE:
+        for (id = command->id; id <= command->last_id; id++) {
+            if (scheduler_of ((int)id) != scheduler)
+                continue;
+            shard = alarm_store_shard (store, (int)id);
+            if (alarm_hash_find (&shard->hash, (int)id) != NULL) {
+                skipped++;
+                continue;
             }
-            else{
-            printf("Alarm(%d) does not exist in alarm list \n", alarm->id);
-            free(alarm);
+            alarm = alarm_insert (shard, (int)id, command->type_id, command->msecs, 0, command_slack (command), command->message);
+            if (journal_enabled (&journal))
+                journal_event (&journal, JOURNAL_INSERT, alarm->id, alarm->type, alarm->msecs, (unsigned long)pthread_self (), alarm->message);
+            scheduler_handoff (scheduler, alarm);
+            affected++;
+        }
+        break;
+
+    case COMMAND_CANCEL_RANGE:
+        for (i = 0; i < store->shards; i++) {
+            shard = &store->shard[i];
+            found = 0;
+            alarm_tree_range (shard->by_id, command->id, command->last_id, &scheduler->range, &found, &scheduler->range_size);
+            for (j = 0; j < found; j++)
+                bulk_cancel (scheduler, shard, scheduler->range[j]);
+            affected += found;
+        }
+        break;
+
+    case COMMAND_CANCEL_TYPE:
+        for (i = 0; i < store->shards; i++) {
+            shard = &store->shard[i];
+            for (alarm = alarm_type_first (shard, command->type_id); alarm != NULL; alarm = next) {
+                next = alarm->type_next;
+                bulk_cancel (scheduler, shard, alarm);
+                affected++;
             }
-            
+        }
+        break;
+
+    default:
+        /*
+         * Change_Type keeps each alarm's time and message, and, as
+         * for Change_Alarm, its old display thread reports the
+         * change and the alarm thread finds it a new one.
+         */
+        for (i = 0; i < store->shards; i++) {
+            shard = &store->shard[i];
+            if (command->type_id == command->to_type_id) {
+                for (alarm = alarm_type_first (shard, command->type_id); alarm != NULL; alarm = alarm->type_next)
+                    affected++;
+                continue;
             }
-            
-            /*
-             *  A3.2.5. For each View_Alarms request received, the main thread will print out the
-             *  following:
-             *  - A list of all the current existing display threads, together with the alarms in the alarm
-             *  list that the alarm thread has assigned to each display thread, in the following format:
-            */
-             if(flag_input == 2){
+            periodic_lock (&scheduler->periodic);
+            for (alarm = alarm_type_first (shard, command->type_id); alarm != NULL; alarm = next) {
+                next = alarm->type_next;
+                alarm_version_begin (&alarm->version);
+                alarm_type_unlink (shard, alarm);
+                alarm->type = command->to_type_id;
+                alarm_type_link (shard, alarm);
+                alarm_version_end (&alarm->version);
+                if (persist_enabled (&persist))
+                    persist_log (&persist, PERSIST_CHANGE, alarm->id, alarm->msecs, alarm->repeats, alarm_slack (alarm), alarm->time, TYPE_NAME(alarm->type), alarm->message);
+                if (journal_enabled (&journal))
+                    journal_event (&journal, JOURNAL_CHANGE, alarm->id, alarm->type, alarm->msecs, (unsigned long)pthread_self (), alarm->message);
+                scheduler_notify (scheduler, alarm->display);
+                if (alarm->pending == 0) {
+                    alarm->pending = 1;
+                    scheduler_handoff (scheduler, alarm);
+                }
+                affected++;
+            }
+            periodic_unlock (&scheduler->periodic);
+        }
+        break;
+    }
+    //still under the shard locks, so that no display thread kicked here can have been freed
+    display_kick_all (scheduler->notify, scheduler->notify_count);
+    atomic_fetch_add (&batch.affected[index], affected);
+    atomic_fetch_add (&batch.skipped[index], skipped);
+}
 
-             now = time(NULL);
-             strftime (timeString,80,"%D %I:%M:%S %p",localtime(&now));
+/*
+ *  A3.2.5. For each View_Alarms request received, the main thread will print out the
+ *  following:
+ *  - A list of all the current existing display threads, together with the alarms in the alarm
+ *  list that the alarm thread has assigned to each display thread, in the following format:
+*/
+void view_alarms (void)
+{
+    int counter;
+    char a_or_b = 'a';
+    alarm_t **listing, **part, *alarm;
+    alarm_copy_t copy;
+    display_t *next_thread;
+    scheduler_t *scheduler;
+    int listed, parted, i, j, s;
+    const char *timeString;
+
+             timeString = log_time();
                 
-             printf("View Alarms at %s: <%s>:\n", timeString, timeString);
-               last_thread = &display_threads;
-               next_thread = *last_thread;
-               counter = 1;
-
-              while (next_thread != NULL) {
-                //if display_thread is same type and hass less than 2 alarms
-                if (pthread_equal(next_thread->display_thread, (pthread_t) NULL) == 0) {
-
-                    printf("%d. Display Thread <%lu> Assigned:\n", counter, next_thread->thread_address);
-
-                    if (next_thread -> display_alarms[0] != NULL){
-                    printf("%d%c. Alarm(%d): %s %d %s\n", counter, a_or_b, next_thread->display_alarms[0]->id, next_thread->display_alarms[0]->type, next_thread->display_alarms[0]->seconds, next_thread->display_alarms[0]->message);
-                    a_or_b = 'b';
+             reply_printf("View Alarms at %s: <%s>:\n", timeString, timeString);
+              counter = 1;
+
+              //no lock is taken: whatever is unlinked while we look stays allocated until epoch_exit
+              epoch_enter();
+              for (s = 0; s < scheduler_count; s++) {
+              scheduler = &schedulers[s];
+              for (i = 0; i < display_shard_count; i++) {
+              for (next_thread = scheduler->display_shards[i].displays; next_thread != NULL; next_thread = next_thread->link) {
+                if (next_thread->end_of_life == 0) {
+
+                    reply_printf("%d. Display Thread <%lu> Assigned:\n", counter, next_thread->thread_address);
+
+                    for (j = 0; j < display_capacity; j++) {
+                    alarm = next_thread -> display_alarms[j];
+                    if (alarm != NULL){
+                    alarm_read(&scheduler->store, alarm, &copy);
+                    reply_printf("%d%c. Alarm(%d): %s " DURATION_FMT " %s\n", counter, a_or_b, copy.id, TYPE_NAME(copy.type), DURATION_ARGS(copy.msecs), copy.message);
+                    a_or_b++;
                     }
-
-                    if (next_thread -> display_alarms[1] != NULL){
-                    printf("%d%c. Alarm(%d): %s %d %s\n", counter, a_or_b, next_thread->display_alarms[1]->id, next_thread->display_alarms[1]->type, next_thread->display_alarms[1]->seconds, next_thread->display_alarms[1]->message);
                     }
 
                     a_or_b = 'a';
@@ -653,81 +1579,1071 @@ int main (int argc, char *argv[])
 
                     
                 }
+              }
+              }
+              }
 
-                last_thread = &next_thread->link;
-                next_thread = next_thread->link;
+              //followed by the alarm list itself, in order of alarm id, merged from every scheduler
+              listing = alarm_store_snapshot(&schedulers[0].store, &listed);
+              for (s = 1; s < scheduler_count; s++) {
+                part = alarm_store_snapshot(&schedulers[s].store, &parted);
+                listing = realloc(listing, (listed + parted + 1) * sizeof(alarm_t *));
+                if (listing == NULL)
+                  errno_abort ("Allocate alarm listing");
+                memcpy(listing + listed, part, parted * sizeof(alarm_t *));
+                listed += parted;
+                free(part);
               }
-                counter = 1;
-             }
+              if (scheduler_count > 1)
+                qsort(listing, listed, sizeof(alarm_t *), alarm_id_compare);
+              reply_printf("Alarm List:\n");
+              for (i = 0; i < listed; i++) {
+                alarm_read(&scheduler_of(listing[i]->id)->store, listing[i], &copy);
+                reply_printf("Alarm(%d): T%s " DURATION_FMT " %s\n", copy.id, TYPE_NAME(copy.type), DURATION_ARGS(copy.msecs), copy.message);
+              }
+              epoch_exit();
+              free(listing);
+}
 
+/*
+ * Print a snapshot of the runtime statistics: the counters and
+ * histograms of every thread added together (stats.h), the length
+ * of the alarm list, and the display threads of each type. It is
+ * the reply to the Stats command, or is appended to "file" for the
+ * periodic dump. Like View_Alarms, it takes no
+ * shard lock.
+ */
+void stats_print (FILE *file, stats_mark_t *mark)
+{
+    static const char *names[STATS_HISTOGRAMS] = {
+        "alarm shard lock wait", "alarm shard lock hold", "display shard lock wait",
+        "display shard lock hold", "periodic lock wait", "periodic lock hold",
+        "expiry sweep", "expiry lateness"
+    };
+    stats_snapshot_t snapshot;
+    display_t *display;
+    char *text, *line, *newline;
+    size_t size;
+    FILE *out;
+    long long now;
+    long commands;
+    int *by_type, types, alarms = 0, displays = 0, i, s;
+
+    stats_collect (&snapshot);
+    now = monotonic_ns ();
+    commands = snapshot.counter[STATS_COMMANDS];
+    for (s = 0; s < scheduler_count; s++)
+        alarms += alarm_store_count (&schedulers[s].store);
+    types = atomic_load (&alarm_types.count);
+    by_type = calloc (types > 0 ? types : 1, sizeof (int));
+    if (by_type == NULL)
+        errno_abort ("Allocate display thread counts");
+    epoch_enter ();
+    for (s = 0; s < scheduler_count; s++)
+        for (i = 0; i < display_shard_count; i++)
+            for (display = schedulers[s].display_shards[i].displays; display != NULL; display = display->link)
+                if (display->end_of_life == 0 && display->type < types) {
+                    by_type[display->type]++;
+                    displays++;
+                }
+    epoch_exit ();
+
+    out = open_memstream (&text, &size);
+    if (out == NULL)
+        errno_abort ("Open statistics buffer");
+    fprintf (out, "Stats at %s:\n", log_time ());
+    fprintf (out, "Commands: %ld (%ld bad), %.0f/s since the last report, %.0f/s since start\n",
+        commands, snapshot.counter[STATS_BAD_COMMANDS],
+        (double)(commands - mark->commands) * NSEC_PER_SEC / (now > mark->time ? now - mark->time : 1),
+        (double)commands * NSEC_PER_SEC / (now > stats_start ? now - stats_start : 1));
+    fprintf (out, "Alarm List: %d alarms, %ld expired\n", alarms, snapshot.counter[STATS_EXPIRED]);
+    if (scheduler_count > 1) {
+        fprintf (out, "Schedulers: %d;", scheduler_count);
+        for (s = 0; s < scheduler_count; s++)
+            fprintf (out, " %d", alarm_store_count (&schedulers[s].store));
+        fprintf (out, " alarms\n");
+    }
+    fprintf (out, "Display Threads: %d\n", displays);
+    for (i = 0; i < types; i++)
+        if (by_type[i] > 0)
+            fprintf (out, "  T%s: %d\n", TYPE_NAME(i), by_type[i]);
+    fprintf (out, "%-24s %10s %10s %10s %10s %10s  (ns; locks sampled 1 in %d)\n",
+        "", "count", "mean", "p50", "p99", "max", STATS_SAMPLE);
+    for (i = 0; i < STATS_HISTOGRAMS; i++)
+        fprintf (out, "%-24s %10ld %10ld %10ld %10ld %10ld\n", names[i], snapshot.count[i],
+            snapshot.count[i] ? snapshot.sum[i] / snapshot.count[i] : 0,
+            stats_percentile (&snapshot, i, 0.5), stats_percentile (&snapshot, i, 0.99), snapshot.max[i]);
+    fclose (out);
+
+    if (file != NULL) {
+        fputs (text, file);
+        fflush (file);
+    } else {
+        //one record per line, to stay within the log's record size
+        for (line = text; *line != '\0'; line = newline + 1) {
+            newline = strchr (line, '\n');
+            reply_printf ("%.*s\n", (int)(newline - line), line);
+        }
+    }
+    mark->time = now;
+    mark->commands = commands;
+    free (text);
+    free (by_type);
+}
 
-            
-            
-            
+/*
+ * Standard input gets a prompt before each command. A socket client
+ * gets an empty line after each reply instead, so that it can tell
+ * where one ends even when the command printed nothing.
+ */
+void reply_prompt (void)
+{
+    if (reply_client == NULL)
+        log_printf ("alarm> ");
+}
 
-            status = pthread_mutex_unlock (&new_alarm_mutex);
-            if (status != 0)
-                err_abort (status, "Unlock mutex");
+void reply_end (int kind)
+{
+    if (reply_client != NULL && kind != COMMAND_EMPTY)
+        client_append (reply_client, "\n", 1);
+}
+
+/*
+ * Apply the commands the router handed a scheduler, keeping their
+ * replies. Rather than lock and unlock an alarm shard for every
+ * command, every shard they touch is locked once, in shard order,
+ * and all of them applied; a bulk command touches them all. The
+ * alarms they hand to the alarm thread are pushed onto the command
+ * ring together, with a single wakeup.
+ */
+void scheduler_apply (scheduler_t *scheduler)
+{
+    alarm_store_t *store = &scheduler->store;
+    alarm_t *handoff;
+    int i, w;
+
+    memset (scheduler->shard_used, 0, store->shards);
+    for (w = 0; w < scheduler->work_count; w++) {
+        i = scheduler->work[w];
+        if (command_bulk (batch.commands[i].kind)) {
+            memset (scheduler->shard_used, 1, store->shards);
+            break;
+        }
+        scheduler->shard_used[alarm_store_shard (store, batch.commands[i].id) - store->shard] = 1;
     }
+    for (i = 0; i < store->shards; i++)
+        if (scheduler->shard_used[i])
+            alarm_shard_lock (&store->shard[i]);
+
+    scheduler->replies.used = 0;
+    scheduler->handoff_count = 0;
+    reply_capture = &scheduler->replies;
+    for (w = 0; w < scheduler->work_count; w++) {
+        i = scheduler->work[w];
+        //every scheduler takes part in a bulk command, and the router replies for it
+        if (command_bulk (batch.commands[i].kind)) {
+            apply_bulk (scheduler, i);
+            continue;
         }
-        else{
+        batch.reply_from[i] = scheduler->replies.used;
+        handoff = apply_command (scheduler, &batch.commands[i]);
+        if (handoff != NULL)
+            scheduler_handoff (scheduler, handoff);
+        batch.reply_to[i] = scheduler->replies.used;
+    }
+    reply_capture = NULL;
+
+    for (i = store->shards - 1; i >= 0; i--)
+        if (scheduler->shard_used[i])
+            alarm_shard_unlock (&store->shard[i]);
+    //pushed only now: a full ring waits for the alarm thread, which may need those shards
+    if (scheduler->handoff_count > 0)
+        command_ring_push_batch (&scheduler->commands, scheduler->handoffs, scheduler->handoff_count);
+}
 
-           status = pthread_mutex_lock (&alarm_expiration_mutex);
-                    if (status != 0)
-                    err_abort (status, "Lock mutex");
-                    
-           //Main thread now responsible for alarm removal
+/*
+ * Hand the Start, Change and Cancel commands in [start, end) of the
+ * batch to their schedulers, and the bulk commands to every
+ * scheduler, and return once all of them have been applied. A
+ * single scheduler is run by the caller itself.
+ */
+void scheduler_dispatch (int start, int end)
+{
+    scheduler_t *scheduler;
+    uint64_t one = 1;
+    int status, i, s;
+
+    for (i = 0; i < scheduler_count; i++)
+        schedulers[i].work_count = 0;
+    for (i = start; i < end; i++)
+        if (command_bulk (batch.commands[i].kind)) {
+            atomic_store (&batch.affected[i], 0);
+            atomic_store (&batch.skipped[i], 0);
+            for (s = 0; s < scheduler_count; s++)
+                schedulers[s].work[schedulers[s].work_count++] = i;
+        } else if (batch.commands[i].kind > COMMAND_EMPTY) {
+            scheduler = scheduler_of (batch.commands[i].id);
+            scheduler->work[scheduler->work_count++] = i;
+        }
+    if (scheduler_count == 1) {
+        if (schedulers[0].work_count > 0)
+            scheduler_apply (&schedulers[0]);
+        return;
+    }
 
-            /*
-             * A3.2.4. For each alarm in the alarm list, if the specified number of n seconds has expired,
-             * then the main thread will remove that alarm from the alarm list, and it will print:
-             * “Alarm(<alarm_id>): Alarm Expired at <time>: Alarm Removed From Alarm List ”,
-             * where <time> is the actual time at which this was printed (<time> is expressed as the
-             * number of seconds from the Unix Epoch Jan 1 1970 00:00.
-            */
-            last = &alarm_list;
-            next = *last;
+    status = pthread_mutex_lock (&dispatch_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    for (i = 0; i < scheduler_count; i++)
+        if (schedulers[i].work_count > 0)
+            dispatch_pending++;
+    status = pthread_mutex_unlock (&dispatch_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    for (i = 0; i < scheduler_count; i++)
+        if (schedulers[i].work_count > 0 && write (schedulers[i].wake_fd, &one, sizeof (one)) != sizeof (one))
+            errno_abort ("Wake scheduler");
 
-            while (next != NULL) {
+    status = pthread_mutex_lock (&dispatch_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    while (dispatch_pending > 0) {
+        status = pthread_cond_wait (&dispatch_cond, &dispatch_mutex);
+        if (status != 0)
+            err_abort (status, "Wait on cond");
+    }
+    status = pthread_mutex_unlock (&dispatch_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
 
-             
+/*
+ * The id of a type named in a command, interned if it is new.
+ */
+int command_type (const char *name)
+{
+    int types = atomic_load (&alarm_types.count), type_id;
 
-               //remove any expired alarms
-                if (next->time <= time(NULL)) {
-                     
-                    removed_alarms = 1;
+    type_id = type_intern (&alarm_types, name);
+    //the journal names each type once, before its first use
+    if (journal_enabled (&journal) && type_id == types)
+        journal_event (&journal, JOURNAL_TYPE, 0, types, 0, 0, name);
+    return type_id;
+}
 
-                    now = time(NULL);
-                    strftime (timeString,80,"%D %I:%M:%S %p",localtime(&now));
+/*
+ * The reply to a bulk command, once every scheduler has done its
+ * part: how many alarms it acted on. Unlike the lines for single
+ * alarms, it is printed with the journal too.
+ */
+void reply_bulk (command_t *command, int index)
+{
+    const char *timeString = log_time ();
+    int affected = atomic_load (&batch.affected[index]);
+
+    switch (command->kind) {
+    case COMMAND_START_RANGE:
+        reply_printf ("Alarms(%d..%d) Inserted by Main Thread (%lu) Into Alarm List at <%s>: %d alarms (%d already existed): " DURATION_FMT " %s \n",
+            command->id, command->last_id, (unsigned long)pthread_self (), timeString, affected,
+            atomic_load (&batch.skipped[index]), DURATION_ARGS(command->msecs), command->message);
+        break;
+    case COMMAND_CANCEL_RANGE:
+        reply_printf ("Alarms(%d..%d) cancelled at %s: %d alarms \n", command->id, command->last_id, timeString, affected);
+        break;
+    case COMMAND_CANCEL_TYPE:
+        reply_printf ("Alarms of Type T%s cancelled at %s: %d alarms \n", command->type, timeString, affected);
+        break;
+    default:
+        reply_printf ("Alarms of Type T%s Changed to Type T%s at %s: %d alarms \n",
+            command->type, command->to_type, timeString, affected);
+        break;
+    }
+}
 
-                    printf("Alarm(%d): Alarm Expired at <%s>: Alarm Removed From Alarm List\n", next->id, timeString);
-                    *last = next->link;        
-                    next = next->link;
-                    last = &next->link;
-                    
+/*
+ * Parse and carry out a batch of command lines read from standard
+ * input or a socket client, printing their output in input order.
+ * Each run of commands up to the next View_Alarms or Stats is
+ * handed out to the schedulers at once; their replies are sent
+ * once every scheduler is done with it.
+ */
+void process_batch (char **lines, int count)
+{
+    command_t *command;
+    scheduler_t *scheduler;
+    int start, end, i, commands = 0, bad = 0;
+
+    //types are interned as they are parsed; from here on they are compared as ints
+    for (i = 0; i < count; i++) {
+        command = &batch.commands[i];
+        command_parse (lines[i], command);
+        commands += command->kind > COMMAND_EMPTY;
+        bad += command->kind == COMMAND_BAD;
+        if (command_start (command->kind) || command->kind == COMMAND_CHANGE
+                || (command_bulk (command->kind) && command->kind != COMMAND_CANCEL_RANGE))
+            command->type_id = command_type (command->type);
+        if (command->kind == COMMAND_CHANGE_TYPE)
+            command->to_type_id = command_type (command->to_type);
+    }
+    stats_count (STATS_COMMANDS, commands);
+    stats_count (STATS_BAD_COMMANDS, bad);
+
+    for (start = 0; start < count; start = end) {
+        for (end = start; end < count && batch.commands[end].kind != COMMAND_VIEW
+                && batch.commands[end].kind != COMMAND_STATS; end++)
+            ;
+        scheduler_dispatch (start, end);
+
+        for (i = start; i < end; i++) {
+            command = &batch.commands[i];
+            reply_prompt ();
+            if (command->kind == COMMAND_BAD) {
+                if (reply_client == NULL)
+                    fprintf (stderr, "Bad command\n");
+                else
+                    reply_printf ("Bad command\n");
+            } else if (command_bulk (command->kind)) {
+                reply_bulk (command, i);
+            } else if (command->kind != COMMAND_EMPTY) {
+                scheduler = scheduler_of (command->id);
+                reply_write (scheduler->replies.text + batch.reply_from[i], batch.reply_to[i] - batch.reply_from[i]);
+            }
+            reply_end (command->kind);
+        }
 
-                }
-                else {
-                last = &next->link;
-                
-                next = next->link;
-                }
+        if (end < count) {
+            reply_prompt ();
+            if (batch.commands[end].kind == COMMAND_VIEW)
+                view_alarms ();
+            else
+                stats_print (NULL, &stats_command_mark);
+            reply_end (batch.commands[end].kind);
+            end++;
+        }
+    }
+
+    //group commit: one sync makes the whole batch durable before the next is read
+    if (persist_enabled (&persist))
+        persist_commit (&persist, 1);
+}
+
+/*
+ * Apply one record of the snapshot or the log to the alarm list
+ * while it is being recovered, before any other thread runs. Nothing
+ * is printed; the alarms are handed to the alarm thread afterwards.
+ */
+void restore_record (const persist_record_t *record, const char *type, const char *message)
+{
+    alarm_shard_t *shard = alarm_store_shard (&scheduler_of (record->id)->store, record->id);
+    alarm_t *alarm = alarm_hash_find (&shard->hash, record->id);
+    char name[COMMAND_TEXT_MAX];
+    int type_id;
+
+    if (record->op == PERSIST_CANCEL || record->op == PERSIST_EXPIRE) {
+        if (alarm != NULL) {
+            alarm_shard_remove (shard, alarm);
+            alarm_free (alarm);
+        }
+        return;
+    }
+    if (alarm == NULL && record->op == PERSIST_CHANGE)
+        return;
+
+    memcpy (name, type, record->type_length);
+    name[record->type_length] = '\0';
+    type_id = type_intern (&alarm_types, name);
+    if (alarm == NULL) {
+        alarm = slab_alloc (&alarm_cache);
+        memset (alarm, 0, sizeof (alarm_t));
+        alarm->id = record->id;
+        alarm->heap_index = -1;
+        alarm->due_index = -1;
+        alarm->type = type_id;
+        alarm_hash_insert (&shard->hash, alarm);
+        alarm_tree_insert (&shard->by_id, alarm);
+        alarm_type_link (shard, alarm);
+    } else if (alarm->type != type_id) {
+        alarm_type_unlink (shard, alarm);
+        alarm->type = type_id;
+        alarm_type_link (shard, alarm);
+    }
+    alarm->msecs = record->msecs;
+    alarm->repeats = record->repeats;
+    alarm->time = record->deadline - restore_offset;
+    alarm->latest = alarm->time + record->slack * 1000000LL;
+    slab_free (alarm->message);
+    alarm->message = message_alloc (&message_arena, message, record->message_length);
+    alarm_shard_requeue (shard, alarm);
+}
+
+/*
+ * Report the slab allocator's counters for alarms, display threads
+ * and each class of messages on standard error.
+ */
+void report_alloc_stats (void)
+{
+    slab_cache_t *caches[2 + MESSAGE_CLASSES] = { &alarm_cache, &display_cache };
+    slab_stats_t stats;
+    int i;
+
+    for (i = 0; i < MESSAGE_CLASSES; i++)
+        caches[2 + i] = &message_arena.classes[i];
+    for (i = 0; i < 2 + MESSAGE_CLASSES; i++) {
+        slab_cache_stats (caches[i], &stats);
+        fprintf (stderr, "%s: %ld live, %ld of %ld slab slots in use (%.1f%%) in %ld slabs, "
+            "%ld allocations (%ld freed by other threads), %.0f ns average / %ld ns worst allocation\n",
+            caches[i]->name, stats.live, stats.live, stats.capacity,
+            stats.capacity ? 100.0 * stats.live / stats.capacity : 0.0, stats.slabs,
+            stats.allocs, stats.remote_frees, stats.latency_avg_ns, stats.latency_max_ns);
+    }
+}
+
+/*
+ * Re-arm a recurring alarm that has gone off, in place: it stays in
+ * the alarm list with its display thread, and only moves down its
+ * shard's heap. Its next time is kept on its original schedule, a
+ * whole number of periods after the first, so it never drifts by
+ * more than one sweep's lateness. Times it was already due again
+ * when it went off are skipped, not made up, and count against the
+ * times it has left. Returns 0, leaving the alarm as it is, when it
+ * has gone off for the last time. Called with its shard locked.
+ */
+int alarm_rearm (scheduler_t *scheduler, alarm_shard_t *shard, alarm_t *alarm, long long now_ns)
+{
+    long long period = alarm->msecs * 1000000LL, due;
+
+    //a recurring alarm changed to no time at all goes off once more, and is done
+    if (alarm->repeats == 0 || period == 0)
+        return 0;
+    due = (now_ns - alarm->time) / period + 1;
+    if (alarm->repeats > 0 && alarm->repeats <= due)
+        return 0;
+    periodic_lock (&scheduler->periodic);
+    alarm_version_begin(&alarm->version);
+    alarm->time += due * period;
+    alarm->latest += due * period;
+    if (alarm->repeats > 0)
+        alarm->repeats -= (int)due;
+    alarm_version_end(&alarm->version);
+    periodic_unlock (&scheduler->periodic);
+    alarm_shard_requeue(shard, alarm);
+    return 1;
+}
+
+/*
+ * Remove every alarm of a scheduler whose expiration time has been
+ * reached from the alarm list, and wake the display threads so that
+ * they stop printing those alarms. Called whenever the scheduler's
+ * expiry timer fires.
+ *
+ * The timer is armed for the latest time the most pressing alarm
+ * may go off (see arm_expiry_timer), so with slack the sweep finds
+ * every alarm whose time came in the window before it, through the
+ * shards' heaps of alarms with slack, and expires them in one pass. Each shard's display threads are kicked together, once
+ * each, as for a bulk command.
+ */
+void expire_alarms (scheduler_t *scheduler)
+{
+    alarm_store_t *store = &scheduler->store;
+    alarm_shard_t *shard;
+    alarm_t *next;
+    long long now_ns, fired_ns;
+    const char *timeString;
+    int i, expired = 0;
+
+    /*
+     * A3.2.4. For each alarm in the alarm list, if the specified number of n seconds has expired,
+     * then the main thread will remove that alarm from the alarm list, and it will print:
+     * “Alarm(<alarm_id>): Alarm Expired at <time>: Alarm Removed From Alarm List ”,
+     * where <time> is the actual time at which this was printed (<time> is expressed as the
+     * number of seconds from the Unix Epoch Jan 1 1970 00:00.
+     */
+    //expired alarms come off the heap by latest time, and those with slack whose time has come off the one by time
+    timeString = log_time();
+    now_ns = monotonic_ns();
+    for (i = 0; i < store->shards; i++) {
+        shard = &store->shard[i];
+        alarm_shard_lock(shard);
+        scheduler->notify_count = 0;
+        while (((next = alarm_heap_top(&shard->heap)) != NULL && next->time <= now_ns)
+                || ((next = alarm_heap_top(&shard->due)) != NULL && next->time <= now_ns)) {
+            fired_ns = monotonic_ns();
+            stats_record(STATS_LATENESS, fired_ns - next->time);
+            expired++;
+
+            //a recurring alarm with times left stays where it is, for its next time
+            if (alarm_rearm(scheduler, shard, next, now_ns)) {
+                if (journal_enabled(&journal))
+                    journal_event(&journal, JOURNAL_REARM, next->id, next->type, next->repeats, (unsigned long)pthread_self(), NULL);
+                else if (next->repeats < 0)
+                    log_printf("Alarm(%d): Alarm Went Off at <%s>: Alarm Re-armed in Alarm List\n", next->id, timeString);
+                else
+                    log_printf("Alarm(%d): Alarm Went Off at <%s>: Alarm Re-armed in Alarm List, %d Times Left\n", next->id, timeString, next->repeats);
+                continue;
             }
-             
-            if(removed_alarms == 1){
-                    expired = 1;
-                    status = pthread_cond_signal(&alarm_expired); 
-                    if (status != 0)
+
+            if (journal_enabled(&journal))
+                journal_event(&journal, JOURNAL_EXPIRE, next->id, next->type, next->msecs, (unsigned long)pthread_self(), NULL);
+            else
+                log_printf("Alarm(%d): Alarm Expired at <%s>: Alarm Removed From Alarm List\n", next->id, timeString);
+            alarm_shard_remove(shard, next);
+            if (persist_enabled(&persist))
+                persist_log(&persist, PERSIST_EXPIRE, next->id, 0, 0, 0, 0, NULL, NULL);
+
+            //its display thread is woken with the shard's others, to stop printing the alarm and free it
+            next->expired = 1;
+            scheduler_notify(scheduler, next->display);
+        }
+        //still under the shard lock, so that no display thread kicked here can have been freed
+        display_kick_all(scheduler->notify, scheduler->notify_count);
+        alarm_shard_unlock(shard);
+    }
+    stats_count(STATS_EXPIRED, expired);
+    stats_record(STATS_SWEEP, monotonic_ns() - now_ns);
+}
+
+/*
+ * Arm a scheduler's expiry timer for the earliest time by which an
+ * alarm in any shard's heap must go off, its slack included, or
+ * disarm it if there are no alarms. The timer is absolute, so an
+ * alarm that is already due fires immediately.
+ */
+void arm_expiry_timer (scheduler_t *scheduler)
+{
+    struct itimerspec spec;
+    long long first;
+
+    memset(&spec, 0, sizeof(spec));
+    first = alarm_store_earliest(&scheduler->store);
+    if (first != 0) {
+        spec.it_value.tv_sec = first / NSEC_PER_SEC;
+        spec.it_value.tv_nsec = first % NSEC_PER_SEC;
+        if (first < 0)
+            spec.it_value.tv_nsec = 1;
+    }
+    if (timerfd_settime(scheduler->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
+        errno_abort ("Arm expiry timer");
+}
+
+/*
+ * A scheduler's reactor, when there is more than one scheduler. It
+ * applies the commands the router hands it when its eventfd is
+ * posted, and sweeps its alarms when its expiry timer fires.
+ */
+void *scheduler_thread (void *arg)
+{
+    scheduler_t *scheduler = arg;
+    struct epoll_event event, events[2];
+    uint64_t count;
+    int epoll_fd, ready, status, i;
+
+    epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+        errno_abort ("Create epoll instance");
+    event.events = EPOLLIN;
+    event.data.fd = scheduler->timer_fd;
+    if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, scheduler->timer_fd, &event) == -1)
+        errno_abort ("Watch expiry timer");
+    event.data.fd = scheduler->wake_fd;
+    if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, scheduler->wake_fd, &event) == -1)
+        errno_abort ("Watch scheduler eventfd");
+    arm_expiry_timer (scheduler);
+
+    while (1) {
+        ready = epoll_wait (epoll_fd, events, 2, -1);
+        if (ready == -1) {
+            if (errno == EINTR)
+                continue;
+            errno_abort ("Wait for scheduler events");
+        }
+        for (i = 0; i < ready; i++) {
+            if (read (events[i].data.fd, &count, sizeof (count)) == -1 && errno != EAGAIN)
+                errno_abort ("Read scheduler event");
+            if (events[i].data.fd == scheduler->timer_fd) {
+                expire_alarms (scheduler);
+                continue;
+            }
+
+            //the router filled in the work before releasing dispatch_mutex, so taking it orders the two
+            status = pthread_mutex_lock (&dispatch_mutex);
+            if (status != 0)
+                err_abort (status, "Lock mutex");
+            status = pthread_mutex_unlock (&dispatch_mutex);
+            if (status != 0)
+                err_abort (status, "Unlock mutex");
+            scheduler_apply (scheduler);
+            status = pthread_mutex_lock (&dispatch_mutex);
+            if (status != 0)
+                err_abort (status, "Lock mutex");
+            if (--dispatch_pending == 0) {
+                status = pthread_cond_signal (&dispatch_cond);
+                if (status != 0)
                     err_abort (status, "Signal cond");
             }
+            status = pthread_mutex_unlock (&dispatch_mutex);
+            if (status != 0)
+                err_abort (status, "Unlock mutex");
+        }
+        arm_expiry_timer (scheduler);
+    }
+}
 
-            status = pthread_mutex_unlock (&alarm_expiration_mutex);
-                   if (status != 0)
-                   err_abort (status, "Unlock mutex");
+/*
+ * Set up a scheduler with "shards" alarm and display registry
+ * shards, and start its periodic scheduler. Its alarm thread and
+ * reactor are started later, by scheduler_start, once recovery is
+ * done.
+ */
+void scheduler_init (scheduler_t *scheduler, int shards, int window_ms)
+{
+    int status, i;
+
+    alarm_store_init (&scheduler->store, shards);
+    scheduler->display_shards = calloc (shards, sizeof (display_shard_t));
+    if (scheduler->display_shards == NULL)
+        errno_abort ("Allocate display shards");
+    for (i = 0; i < shards; i++) {
+        status = pthread_mutex_init (&scheduler->display_shards[i].lock, NULL);
+        if (status != 0)
+            err_abort (status, "Init mutex");
+    }
+    command_ring_init (&scheduler->commands, COMMAND_RING_SIZE);
+    scheduler->work = malloc (batch.max * sizeof (int));
+    scheduler->handoff_size = batch.max;
+    scheduler->handoffs = malloc (batch.max * sizeof (alarm_t *));
+    scheduler->shard_used = malloc (shards);
+    if (scheduler->work == NULL || scheduler->handoffs == NULL || scheduler->shard_used == NULL)
+        errno_abort ("Allocate scheduler");
+    scheduler->timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (scheduler->timer_fd == -1)
+        errno_abort ("Create expiry timer");
+    scheduler->wake_fd = -1;
+    periodic_start (&scheduler->periodic, window_ms);
+}
 
-            
+/*
+ * Start a scheduler's alarm thread and, if there is more than one
+ * scheduler, its reactor.
+ */
+void scheduler_start (scheduler_t *scheduler)
+{
+    pthread_t thread;
+    int status;
+
+    status = pthread_create (&thread, NULL, alarm_thread, scheduler);
+    if (status != 0)
+        err_abort (status, "Create alarm thread");
+    if (scheduler_count == 1)
+        return;
+    scheduler->wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (scheduler->wake_fd == -1)
+        errno_abort ("Create scheduler eventfd");
+    status = pthread_create (&thread, NULL, scheduler_thread, scheduler);
+    if (status != 0)
+        err_abort (status, "Create scheduler");
+}
+
+/*
+ * Carry out every complete command line in an input buffer of
+ * "size" bytes that holds "*input_len", in batches, and keep the
+ * partial line that may follow them at the start of the buffer.
+ * A line longer than the whole buffer is handled in pieces. At the
+ * end of the input ("last" set), a final unterminated line is
+ * carried out too.
+ */
+void process_input (char *input, size_t *input_len, size_t size, int last)
+{
+    char *line, *newline;
+    int count = 0;
+
+    input[*input_len] = '\0';
+    line = input;
+    while ((newline = strchr (line, '\n')) != NULL) {
+        newline[0] = '\0';
+        batch.lines[count++] = line;
+        line = newline + 1;
+        if (count == batch.max) {
+            process_batch (batch.lines, count);
+            count = 0;
         }
-        
-       
+    }
+    if (count > 0)
+        process_batch (batch.lines, count);
+    *input_len -= line - input;
+    memmove (input, line, *input_len);
+
+    if (*input_len == size - 1 || (last && *input_len > 0)) {
+        input[*input_len] = '\0';
+        batch.lines[0] = input;
+        process_batch (batch.lines, 1);
+        *input_len = 0;
+    }
+}
+
+/*
+ * Read what a socket client has sent, carry out its commands, and
+ * send it their replies. A client that closes its end is dropped
+ * once it has taken them all.
+ */
+void client_read (client_t *client, int epoll_fd)
+{
+    ssize_t bytes;
+
+    bytes = read (client->fd, client->input + client->input_len, sizeof (client->input) - 1 - client->input_len);
+    if (bytes == -1) {
+        if (errno == EINTR || errno == EAGAIN)
+            return;
+        server_drop (&server, client);
+        return;
+    }
+    client->input_len += bytes;
+    reply_client = client;
+    process_input (client->input, &client->input_len, sizeof (client->input), bytes == 0);
+    reply_client = NULL;
+    if (bytes == 0)
+        client->closing = 1;
+    server_flush (&server, client, epoll_fd);
+}
+
+/*
+ * Make everything durable and written out, and exit.
+ */
+void finish (void)
+{
+    if (persist_enabled (&persist)) {
+        persist_commit (&persist, 1);
+        persist_snapshot_finish (&persist, 1);
+    }
+    if (stats_file != NULL)
+        stats_print (stats_file, &stats_dump_mark);
+    log_flush ();
+    journal_close (&journal);
+    if (alloc_stats)
+        report_alloc_stats ();
+    if (server.fd != -1)
+        unlink (server.path);
+    exit (0);
 }
+
+int main (int argc, char *argv[])
+{
+    int status;
+    int epoll_fd, timer_fd = -1, stats_timer_fd = -1, signal_fd = -1;
+    struct epoll_event event, events[EVENTS_MAX];
+    sigset_t signals;
+    client_t *client;
+    struct itimerspec stats_spec;
+    static char input[INPUT_SIZE];
+    size_t input_len = 0;
+    ssize_t bytes;
+    uint64_t expirations;
+    int ready, i, j, snapshot_fd;
+    int option, window_ms = PERIODIC_WINDOW_MS, shards = SHARDS, stats_interval = STATS_INTERVAL;
+    const char *persist_directory = NULL;
+    long long persist_threshold = PERSIST_THRESHOLD;
+    alarm_t **restored = NULL;
+    int restored_count = 0;
+
+    /*
+     * -w sets the periodic print alignment window, in milliseconds.
+     * It must divide the five-second period evenly.
+     * -s sets the number of alarm and display registry shards;
+     * -s 1 gives the original single-lock behaviour.
+     * -b sets the largest number of commands applied as one batch;
+     * -b 1 applies every command on its own.
+     * -a reports the allocator's counters when the input ends.
+     * -j writes lifecycle events to a binary journal file instead
+     * of standard output; journal_decode prints them as text.
+     * -p keeps the alarm list in a log and snapshots in a
+     * directory, and recovers it from there on start; -P sets how
+     * many megabytes of log are written between snapshots.
+     * -S appends the runtime statistics, as printed by the Stats
+     * command, to a file every -I seconds.
+     * -u also takes commands from clients of a Unix domain socket;
+     * the program then runs until SIGINT or SIGTERM rather than to
+     * the end of standard input.
+     * -R splits the alarms among that many schedulers, each with a
+     * reactor thread of its own; -s is then per scheduler.
+     * -c sets how many alarms a display thread prints (default 2).
+     * -t sets the slack, in milliseconds, of alarms whose command
+     * gives none: how late they may go off, so that alarms due
+     * within it of each other expire in one sweep (default 0).
+     */
+    batch.max = BATCH_MAX;
+    while ((option = getopt (argc, argv, "w:s:b:aj:p:P:S:I:u:R:c:t:")) != -1) {
+        switch (option) {
+        case 'a':
+            alloc_stats = 1;
+            break;
+        case 'j':
+            journal_open (&journal, optarg);
+            break;
+        case 'p':
+            persist_directory = optarg;
+            break;
+        case 'P':
+            persist_threshold = atoll (optarg) << 20;
+            break;
+        case 'S':
+            stats_file = fopen (optarg, "a");
+            if (stats_file == NULL)
+                errno_abort ("Open statistics file");
+            break;
+        case 'I':
+            stats_interval = atoi (optarg);
+            break;
+        case 'u':
+            server.path = optarg;
+            break;
+        case 'R':
+            scheduler_count = atoi (optarg);
+            break;
+        case 'c':
+            display_capacity = atoi (optarg);
+            break;
+        case 't':
+            default_slack = atoi (optarg);
+            break;
+        case 'b':
+            batch.max = atoi (optarg);
+            break;
+        case 'w':
+            window_ms = atoi (optarg);
+            break;
+        case 's':
+            shards = atoi (optarg);
+            break;
+        default:
+            fprintf (stderr, "usage: %s [-w window_ms] [-s shards] [-b batch] [-a] [-j journal] [-p directory [-P snapshot_mb]] [-S stats_file [-I seconds]] [-u socket] [-R schedulers] [-c capacity] [-t slack_ms]\n", argv[0]);
+            exit (EXIT_FAILURE);
+        }
+    }
+    if (window_ms <= 0 || window_ms > 5000 || 5000 % window_ms != 0) {
+        fprintf (stderr, "Alignment window must divide 5000 ms\n");
+        exit (EXIT_FAILURE);
+    }
+    if (shards <= 0) {
+        fprintf (stderr, "There must be at least one shard\n");
+        exit (EXIT_FAILURE);
+    }
+    if (scheduler_count <= 0 || scheduler_count > SCHEDULERS_MAX) {
+        fprintf (stderr, "There must be 1 to %d schedulers\n", SCHEDULERS_MAX);
+        exit (EXIT_FAILURE);
+    }
+    if (display_capacity <= 0 || display_capacity > DISPLAY_CAPACITY_MAX) {
+        fprintf (stderr, "A display thread must hold 1 to %d alarms\n", DISPLAY_CAPACITY_MAX);
+        exit (EXIT_FAILURE);
+    }
+    if (default_slack < 0 || default_slack > 2000000000) {
+        fprintf (stderr, "The default slack must be 0 to 2000000000 ms\n");
+        exit (EXIT_FAILURE);
+    }
+    if (batch.max <= 0) {
+        fprintf (stderr, "A batch must hold at least one command\n");
+        exit (EXIT_FAILURE);
+    }
+    if (persist_threshold <= 0) {
+        fprintf (stderr, "The snapshot threshold must be at least 1 MB\n");
+        exit (EXIT_FAILURE);
+    }
+    if (stats_interval <= 0) {
+        fprintf (stderr, "The statistics interval must be at least 1 second\n");
+        exit (EXIT_FAILURE);
+    }
+    stats_start = monotonic_ns ();
+    stats_command_mark.time = stats_dump_mark.time = stats_start;
+    if (server.path != NULL) {
+        //a server stops on these, through a signalfd; blocked before any thread inherits the mask
+        sigemptyset (&signals);
+        sigaddset (&signals, SIGINT);
+        sigaddset (&signals, SIGTERM);
+        status = pthread_sigmask (SIG_BLOCK, &signals, NULL);
+        if (status != 0)
+            err_abort (status, "Block signals");
+    }
+
+    //every thread's output goes through the log writer, started before any of them
+    log_start ();
+    //whole cache lines, so that every alarm's hot fields share one
+    slab_cache_init (&alarm_cache, "alarms", (sizeof (alarm_t) + 63) & ~(size_t)63);
+    message_arena_init (&message_arena);
+    slab_cache_init (&display_cache, "display threads",
+        sizeof (display_t) + display_capacity * sizeof (_Atomic(alarm_t *)));
+    type_table_init (&alarm_types);
+    batch.lines = malloc (batch.max * sizeof (char *));
+    batch.commands = malloc (batch.max * sizeof (command_t));
+    batch.reply_from = malloc (batch.max * sizeof (size_t));
+    batch.reply_to = malloc (batch.max * sizeof (size_t));
+    batch.affected = malloc (batch.max * sizeof (atomic_int));
+    batch.skipped = malloc (batch.max * sizeof (atomic_int));
+    if (batch.lines == NULL || batch.commands == NULL || batch.reply_from == NULL ||
+        batch.reply_to == NULL || batch.affected == NULL || batch.skipped == NULL)
+        errno_abort ("Allocate command batch");
+
+    display_shard_count = shards;
+    schedulers = calloc (scheduler_count, sizeof (scheduler_t));
+    scheduler_stores = malloc (scheduler_count * sizeof (alarm_store_t *));
+    if (schedulers == NULL || scheduler_stores == NULL)
+        errno_abort ("Allocate schedulers");
+    for (i = 0; i < scheduler_count; i++) {
+        scheduler_init (&schedulers[i], shards, window_ms);
+        scheduler_stores[i] = &schedulers[i].store;
+    }
+
+    /*
+     * The recovered alarms are assigned their display threads here,
+     * before the display workers and the alarm threads start. A new
+     * assignment gives a display thread nothing to report, so there
+     * is no need to kick it, and doing it directly is far cheaper
+     * than a round trip through the command ring for each alarm.
+     */
+    if (persist_directory != NULL) {
+        persist_init (&persist, persist_directory, persist_threshold);
+        restore_offset = persist_clock_offset ();
+        persist_recover (&persist, restore_record);
+        for (j = 0; j < scheduler_count; j++) {
+            restored = alarm_store_by_id (&schedulers[j].store, &restored_count);
+            for (i = 0; i < restored_count; i++)
+                assign_alarm (restored[i], 0);
+            free (restored);
+        }
+    }
+    display_pool_start ();
+    for (i = 0; i < scheduler_count; i++)
+        scheduler_start (&schedulers[i]);
+
+    /*
+     * The main thread is a small reactor: epoll watches standard
+     * input for commands, and a timerfd that is always armed for
+     * the earliest expiration time in the alarm store. Expiry is
+     * therefore handled exactly when it is due, however busy the
+     * input is, and an idle process does not wake up at all. With
+     * more than one scheduler, each watches its own timer instead.
+     */
+    epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+        errno_abort ("Create epoll instance");
+    if (scheduler_count == 1)
+        timer_fd = schedulers[0].timer_fd;
+
+    event.events = EPOLLIN;
+    event.data.fd = STDIN_FILENO;
+    if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == -1) {
+        //a server may be started with standard input on /dev/null, which epoll cannot watch
+        if (errno != EPERM || server.path == NULL)
+            errno_abort ("Watch standard input");
+    }
+    event.data.fd = timer_fd;
+    if (timer_fd != -1 && epoll_ctl (epoll_fd, EPOLL_CTL_ADD, timer_fd, &event) == -1)
+        errno_abort ("Watch expiry timer");
+    if (stats_file != NULL) {
+        stats_timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (stats_timer_fd == -1)
+            errno_abort ("Create statistics timer");
+        memset (&stats_spec, 0, sizeof (stats_spec));
+        stats_spec.it_value.tv_sec = stats_spec.it_interval.tv_sec = stats_interval;
+        if (timerfd_settime (stats_timer_fd, 0, &stats_spec, NULL) == -1)
+            errno_abort ("Arm statistics timer");
+        event.data.fd = stats_timer_fd;
+        if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, stats_timer_fd, &event) == -1)
+            errno_abort ("Watch statistics timer");
+    }
+    if (server.path != NULL) {
+        server_open (&server, server.path);
+        event.data.fd = server.fd;
+        if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, server.fd, &event) == -1)
+            errno_abort ("Watch socket");
+        signal_fd = signalfd (-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (signal_fd == -1)
+            errno_abort ("Create signalfd");
+        event.data.fd = signal_fd;
+        if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) == -1)
+            errno_abort ("Watch signals");
+    }
+
+    log_printf ("alarm> ");
+    if (timer_fd != -1)
+        arm_expiry_timer (&schedulers[0]);
+
+    while (1) {
+
+        ready = epoll_wait (epoll_fd, events, EVENTS_MAX, -1);
+        if (ready == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait()");
+            exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < ready; i++) {
+            if (events[i].data.fd == timer_fd) {
+                //drain the expiration count so the timerfd stops polling readable
+                if (read (timer_fd, &expirations, sizeof (expirations)) == -1 && errno != EAGAIN)
+                    errno_abort ("Read expiry timer");
+                expire_alarms (&schedulers[0]);
+                continue;
+            }
+            if (events[i].data.fd == stats_timer_fd) {
+                if (read (stats_timer_fd, &expirations, sizeof (expirations)) == -1 && errno != EAGAIN)
+                    errno_abort ("Read statistics timer");
+                stats_print (stats_file, &stats_dump_mark);
+                continue;
+            }
+            if (persist.snapshot_pid != 0 && events[i].data.fd == persist.snapshot_fd) {
+                //closing the pidfd also takes it out of the epoll set
+                persist_snapshot_finish (&persist, 0);
+                continue;
+            }
+            if (events[i].data.fd == signal_fd)
+                finish ();
+            if (events[i].data.fd == server.fd) {
+                server_accept (&server, epoll_fd);
+                continue;
+            }
+            client = server_client (&server, events[i].data.fd);
+            if (client != NULL) {
+                if ((events[i].events & EPOLLOUT) && server_flush (&server, client, epoll_fd) == -1)
+                    continue;
+                if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !client->closing)
+                    client_read (client, epoll_fd);
+                continue;
+            }
+
+            /*
+             * Standard input is read directly rather than through
+             * stdio, so that no complete line can sit unseen in a
+             * stdio buffer while epoll reports nothing to read.
+             * Every complete line in the buffer is handled; a
+             * partial line waits for the rest of its bytes.
+             */
+            bytes = read (STDIN_FILENO, input + input_len, sizeof (input) - 1 - input_len);
+            if (bytes == -1) {
+                if (errno == EINTR || errno == EAGAIN)
+                    continue;
+                errno_abort ("Read standard input");
+            }
+            input_len += bytes;
+            process_input (input, &input_len, sizeof (input), bytes == 0);
+            if (bytes == 0) {
+                //a server keeps serving its clients after the end of standard input
+                if (server.fd == -1)
+                    finish ();
+                if (epoll_ctl (epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL) == -1)
+                    errno_abort ("Stop watching standard input");
+            }
+        }
+
+        if (timer_fd != -1)
+            arm_expiry_timer (&schedulers[0]);
+
+        //without a pidfd to watch, a finished snapshot writer is looked for every time round
+        if (persist.snapshot_pid != 0 && persist.snapshot_fd == -1)
+            persist_snapshot_finish (&persist, 0);
+        if (persist_snapshot_due (&persist)) {
+            snapshot_fd = persist_snapshot_start (&persist, scheduler_stores, scheduler_count, &alarm_types);
+            event.data.fd = snapshot_fd;
+            if (snapshot_fd != -1 && epoll_ctl (epoll_fd, EPOLL_CTL_ADD, snapshot_fd, &event) == -1)
+                errno_abort ("Watch snapshot writer");
+        }
+    }
 }
@@ -0,0 +1,625 @@
+/*
+ * persist.h
+ *
+ * Crash-safe persistence for new_alarm_mutex.c (its -p option):
+ * a write-ahead log of every change to the alarm list, and
+ * snapshots of the whole list that let the log be thrown away.
+ *
+ * Every Start, Change, Cancel and expiry is appended to an in-memory
+ * buffer as a persist_record_t followed by the alarm's type name and
+ * message. The buffer is written, and synced with one fdatasync, once
+ * per batch of commands ("group commit"), so a command is durable
+ * before the next batch is read. Expiries are written with the next
+ * batch but never synced for: one lost on a crash only expires the
+ * alarm again on restart.
+ *
+ * The log is kept in numbered files, "wal.<generation>". When the
+ * log has grown by the snapshot threshold, the current file is
+ * closed, a new generation started, and a child process forked,
+ * with every alarm shard locked, to write the alarms it inherited
+ * to "snapshot.tmp". Forking gives the child a consistent copy of
+ * the list without holding up the parent while it is written. Once
+ * the child has synced the file, the parent renames it to
+ * "snapshot" and removes the older generations of the log.
+ *
+ * A snapshot is a snapshot_header_t and one PERSIST_START record
+ * per alarm. On restart, the snapshot is mapped and loaded, and
+ * then the log generations from the snapshot's on are replayed.
+ * Replay of a generation stops at its first torn or corrupt record.
+ * Deadlines are stored as CLOCK_REALTIME times, since monotonic
+ * times do not survive a reboot.
+ *
+ * A recurring alarm is not logged each time it goes off: its next
+ * deadlines follow from the last one logged and its period, so on
+ * restart the expiry sweep catches it up, counting the times it
+ * missed against those it has left.
+ *
+ * Records may be logged from several threads -- each scheduler of
+ * new_alarm_mutex.c logs its own commands and expiries -- so the
+ * buffer has a mutex. Records are only ever logged with the alarm's
+ * shard locked. The one thread that commits writes a full buffer
+ * out after swapping in a spare, so loggers never wait for a write
+ * or a sync.
+ */
+#ifndef __persist_h
+#define __persist_h
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "errors.h"
+#include "alarm_store.h"
+#include "type_intern.h"
+
+#define PERSIST_START       1
+#define PERSIST_CHANGE      2
+#define PERSIST_CANCEL      3
+#define PERSIST_EXPIRE      4
+
+#define PERSIST_RECORD_MAX  (sizeof(persist_record_t) + 2 * 256)
+#define PERSIST_THRESHOLD   (64LL << 20)    /* default log growth between snapshots */
+#define PERSIST_CHUNK       (1 << 20)       /* snapshot write size */
+#define SNAPSHOT_MAGIC      "ALRMSNP2"
+
+typedef struct persist_record_tag {
+    unsigned int        checksum;   /* of the rest of the record and its text */
+    unsigned char       op;         /* PERSIST_* */
+    unsigned char       type_length;
+    unsigned char       message_length;
+    unsigned char       reserved;
+    int                 id;
+    int                 msecs;
+    int                 repeats;    /* of a recurring alarm, see alarm_t */
+    int                 slack;      /* milliseconds, 0 in records that predate it */
+    long long           lsn;        /* log sequence number */
+    long long           deadline;   /* CLOCK_REALTIME nanoseconds */
+} persist_record_t;
+
+typedef struct snapshot_header_tag {
+    char                magic[8];
+    long long           generation; /* first log generation not in the snapshot */
+    long long           lsn;        /* first log record not in the snapshot */
+    long long           count;      /* alarms */
+} snapshot_header_t;
+
+typedef struct persist_tag {
+    const char          *directory; /* NULL while persistence is off */
+    int                 wal_fd;
+    long long           generation; /* of the open log file */
+    long long           lsn;        /* of the next record */
+    pthread_mutex_t     lock;       /* protects lsn and the buffer */
+    char                *buffer;    /* records not yet written */
+    size_t              used;
+    size_t              capacity;
+    char                *spare;     /* the buffer being written, or last written */
+    size_t              spare_capacity;
+    long long           logged;     /* log bytes since the last snapshot began */
+    long long           threshold;
+    pid_t               snapshot_pid;   /* the child writing a snapshot, 0 if none */
+    int                 snapshot_fd;    /* pidfd of that child */
+    long long           snapshot_generation;
+} persist_t;
+
+/*
+ * Called with each record loaded or replayed; "type" and "message"
+ * are not NUL-terminated.
+ */
+typedef void (*persist_apply_t)(const persist_record_t *record, const char *type, const char *message);
+
+static inline int persist_enabled(persist_t *persist)
+{
+    return persist->directory != NULL;
+}
+
+static inline long long persist_clock_ns(clockid_t clock)
+{
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+ * The difference between CLOCK_REALTIME and CLOCK_MONOTONIC, to
+ * convert deadlines between them.
+ */
+static inline long long persist_clock_offset(void)
+{
+    return persist_clock_ns(CLOCK_REALTIME) - persist_clock_ns(CLOCK_MONOTONIC);
+}
+
+static inline unsigned int persist_checksum(const persist_record_t *record)
+{
+    const unsigned char *p = (const unsigned char *)record + sizeof(record->checksum);
+    const unsigned char *end = (const unsigned char *)(record + 1) + record->type_length + record->message_length;
+    unsigned int hash = 2166136261u;
+
+    while (p < end)
+        hash = (hash ^ *p++) * 16777619u;
+    return hash;
+}
+
+static inline size_t persist_record_size(const persist_record_t *record)
+{
+    return (sizeof(persist_record_t) + record->type_length + record->message_length + 7) & ~(size_t)7;
+}
+
+/*
+ * Encode a record at "to", which must have room for
+ * PERSIST_RECORD_MAX bytes. Returns its size.
+ */
+static inline size_t persist_encode(char *to, int op, long long lsn, int id, int msecs,
+    int repeats, int slack, long long deadline, const char *type, const char *message)
+{
+    persist_record_t *record = (persist_record_t *)to;
+    size_t type_length = type != NULL ? strlen(type) : 0;
+    size_t message_length = message != NULL ? strlen(message) : 0;
+    size_t size;
+
+    memset(record, 0, sizeof(*record));
+    record->op = (unsigned char)op;
+    record->type_length = (unsigned char)type_length;
+    record->message_length = (unsigned char)message_length;
+    record->id = id;
+    record->msecs = msecs;
+    record->repeats = repeats;
+    record->slack = slack;
+    record->lsn = lsn;
+    record->deadline = deadline;
+    if (type_length > 0)
+        memcpy(record + 1, type, type_length);
+    if (message_length > 0)
+        memcpy((char *)(record + 1) + type_length, message, message_length);
+    size = persist_record_size(record);
+    memset((char *)(record + 1) + type_length + message_length, 0,
+        size - sizeof(*record) - type_length - message_length);
+    record->checksum = persist_checksum(record);
+    return size;
+}
+
+static inline void persist_path(persist_t *persist, char *path, size_t size, const char *name, long long generation)
+{
+    if (generation >= 0)
+        snprintf(path, size, "%s/%s.%lld", persist->directory, name, generation);
+    else
+        snprintf(path, size, "%s/%s", persist->directory, name);
+}
+
+/*
+ * Make the creation, renaming or removal of files in the directory
+ * durable.
+ */
+static inline void persist_sync_directory(persist_t *persist)
+{
+    int fd = open(persist->directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd == -1)
+        errno_abort ("Open persistence directory");
+    if (fsync(fd) == -1)
+        errno_abort ("Sync persistence directory");
+    close(fd);
+}
+
+static inline void persist_write(int fd, const char *data, size_t size)
+{
+    ssize_t written;
+
+    while (size > 0) {
+        written = write(fd, data, size);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            errno_abort ("Write log");
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+static inline void persist_open_log(persist_t *persist)
+{
+    char path[4096];
+
+    persist_path(persist, path, sizeof(path), "wal", persist->generation);
+    persist->wal_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (persist->wal_fd == -1)
+        errno_abort ("Open log");
+    persist_sync_directory(persist);
+}
+
+/*
+ * Append a record to the log buffer. "deadline" is a CLOCK_MONOTONIC
+ * time, and "type" and "message" may be NULL.
+ */
+static inline void persist_log(persist_t *persist, int op, int id, int msecs,
+    int repeats, int slack, long long deadline, const char *type, const char *message)
+{
+    int status;
+
+    if (deadline != 0)
+        deadline += persist_clock_offset();
+    status = pthread_mutex_lock(&persist->lock);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    if (persist->used + PERSIST_RECORD_MAX > persist->capacity) {
+        persist->capacity = persist->capacity ? persist->capacity * 2 : 65536;
+        persist->buffer = realloc(persist->buffer, persist->capacity);
+        if (persist->buffer == NULL)
+            errno_abort ("Allocate log buffer");
+    }
+    persist->used += persist_encode(persist->buffer + persist->used, op, persist->lsn++,
+        id, msecs, repeats, slack, deadline, type, message);
+    status = pthread_mutex_unlock(&persist->lock);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+/*
+ * Write the buffered records to the log, and if "sync" is set make
+ * them durable.
+ */
+static inline void persist_commit(persist_t *persist, int sync)
+{
+    char *buffer;
+    size_t used, capacity;
+    int status;
+
+    status = pthread_mutex_lock(&persist->lock);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    buffer = persist->buffer;
+    used = persist->used;
+    capacity = persist->capacity;
+    if (used > 0) {
+        persist->buffer = persist->spare;
+        persist->capacity = persist->spare_capacity;
+        persist->used = 0;
+    }
+    status = pthread_mutex_unlock(&persist->lock);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    if (used == 0)
+        return;
+
+    persist_write(persist->wal_fd, buffer, used);
+    persist->logged += used;
+    persist->spare = buffer;
+    persist->spare_capacity = capacity;
+    if (sync && fdatasync(persist->wal_fd) == -1)
+        errno_abort ("Sync log");
+}
+
+static inline int persist_generation_compare(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Return a sorted, freshly allocated array of the log generations in
+ * the directory.
+ */
+static inline long long *persist_generations(persist_t *persist, int *count)
+{
+    long long *list = NULL, generation;
+    struct dirent *entry;
+    int n = 0, capacity = 0;
+    char *end;
+    DIR *dir;
+
+    dir = opendir(persist->directory);
+    if (dir == NULL)
+        errno_abort ("Open persistence directory");
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "wal.", 4) != 0)
+            continue;
+        generation = strtoll(entry->d_name + 4, &end, 10);
+        if (end == entry->d_name + 4 || *end != '\0' || generation < 0)
+            continue;
+        if (n == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            list = realloc(list, capacity * sizeof(long long));
+            if (list == NULL)
+                errno_abort ("Allocate log list");
+        }
+        list[n++] = generation;
+    }
+    closedir(dir);
+    if (n > 1)
+        qsort(list, n, sizeof(long long), persist_generation_compare);
+    *count = n;
+    return list;
+}
+
+/*
+ * Map a file read-only; returns NULL for a missing or empty file.
+ */
+static inline char *persist_map(const char *path, size_t *size)
+{
+    struct stat info;
+    char *base;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT)
+            return NULL;
+        errno_abort ("Open persisted file");
+    }
+    if (fstat(fd, &info) == -1)
+        errno_abort ("Stat persisted file");
+    if (info.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    base = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+        errno_abort ("Map persisted file");
+    madvise(base, info.st_size, MADV_SEQUENTIAL);
+    close(fd);
+    *size = info.st_size;
+    return base;
+}
+
+/*
+ * Pass each intact record in [base, base + size) from "lsn" on to
+ * "apply". Returns the number applied, and sets *last to the highest
+ * sequence number seen.
+ */
+static inline long persist_scan(const char *base, size_t size, long long lsn,
+    persist_apply_t apply, long long *last)
+{
+    const persist_record_t *record;
+    size_t offset = 0, record_size;
+    long applied = 0;
+
+    while (offset + sizeof(persist_record_t) <= size) {
+        record = (const persist_record_t *)(base + offset);
+        record_size = persist_record_size(record);
+        if (offset + record_size > size || record->checksum != persist_checksum(record))
+            break;
+        if (record->lsn >= lsn) {
+            apply(record, (const char *)(record + 1), (const char *)(record + 1) + record->type_length);
+            applied++;
+        }
+        if (record->lsn > *last)
+            *last = record->lsn;
+        offset += record_size;
+    }
+    return applied;
+}
+
+/*
+ * Load the snapshot and replay the log after it through "apply",
+ * then open a new log generation for this run. Reports what was
+ * recovered on standard error.
+ */
+static inline void persist_recover(persist_t *persist, persist_apply_t apply)
+{
+    snapshot_header_t *header;
+    long long *generations, start_generation = 0, start_lsn = 0, last = -1;
+    long long started = persist_clock_ns(CLOCK_MONOTONIC);
+    long loaded = 0, replayed = 0;
+    char path[4096], *base;
+    size_t size;
+    int count, i;
+
+    persist_path(persist, path, sizeof(path), "snapshot", -1);
+    base = persist_map(path, &size);
+    if (base != NULL) {
+        header = (snapshot_header_t *)base;
+        if (size < sizeof(*header) || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) {
+            fprintf(stderr, "%s is not a snapshot\n", path);
+            exit(EXIT_FAILURE);
+        }
+        start_generation = header->generation;
+        start_lsn = header->lsn;
+        last = start_lsn - 1;
+        loaded = persist_scan(base + sizeof(*header), size - sizeof(*header), 0, apply, &last);
+        munmap(base, size);
+    }
+
+    generations = persist_generations(persist, &count);
+    persist->generation = start_generation;
+    for (i = 0; i < count; i++) {
+        if (generations[i] < start_generation)
+            continue;
+        persist_path(persist, path, sizeof(path), "wal", generations[i]);
+        base = persist_map(path, &size);
+        if (base != NULL) {
+            replayed += persist_scan(base, size, start_lsn, apply, &last);
+            munmap(base, size);
+        }
+        persist->generation = generations[i] + 1;
+    }
+    free(generations);
+
+    persist->lsn = last + 1;
+    persist_open_log(persist);
+    fprintf(stderr, "Recovered %ld alarms from the snapshot and %ld log records in %.1f ms\n",
+        loaded, replayed, (persist_clock_ns(CLOCK_MONOTONIC) - started) / 1e6);
+}
+
+/*
+ * Turn persistence on, keeping its files in "directory".
+ */
+static inline void persist_init(persist_t *persist, const char *directory, long long threshold)
+{
+    int status;
+
+    memset(persist, 0, sizeof(*persist));
+    persist->directory = directory;
+    persist->threshold = threshold;
+    persist->wal_fd = -1;
+    persist->snapshot_fd = -1;
+    status = pthread_mutex_init(&persist->lock, NULL);
+    if (status != 0)
+        err_abort (status, "Init mutex");
+    if (mkdir(directory, 0755) == -1 && errno != EEXIST)
+        errno_abort ("Create persistence directory");
+}
+
+/*
+ * The snapshot child: write every alarm in the stores to
+ * "snapshot.tmp" and sync it. It must not take any lock or
+ * allocate, since another thread of the parent may have held one
+ * when it forked, so it writes through a static buffer and exits
+ * with _exit.
+ */
+static inline void persist_snapshot_child(persist_t *persist, alarm_store_t **stores, int count,
+    type_table_t *types, long long generation, long long lsn)
+{
+    static char buffer[PERSIST_CHUNK + PERSIST_RECORD_MAX];
+    snapshot_header_t header;
+    alarm_hash_t *hash;
+    alarm_t *alarm;
+    long long offset = persist_clock_offset();
+    size_t used = sizeof(header);
+    char path[4096];
+    ssize_t written;
+    int fd, s, i, j;
+
+    persist_path(persist, path, sizeof(path), "snapshot.tmp", -1);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        _exit(1);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.generation = generation;
+    header.lsn = lsn;
+    for (s = 0; s < count; s++)
+    for (i = 0; i < stores[s]->shards; i++) {
+        hash = &stores[s]->shard[i].hash;
+        for (j = 0; j < hash->capacity; j++) {
+            alarm = hash->slots[j];
+            if (alarm == NULL)
+                continue;
+            used += persist_encode(buffer + used, PERSIST_START, 0, alarm->id, alarm->msecs,
+                alarm->repeats, alarm_slack(alarm), alarm->time + offset, type_name(types, alarm->type), alarm->message);
+            header.count++;
+            if (used >= PERSIST_CHUNK) {
+                written = write(fd, buffer, used);
+                if (written != (ssize_t)used)
+                    _exit(1);
+                used = 0;
+            }
+        }
+    }
+    if (used > 0 && write(fd, buffer, used) != (ssize_t)used)
+        _exit(1);
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || fsync(fd) == -1)
+        _exit(1);
+    _exit(0);
+}
+
+/*
+ * Whether the log has grown enough since the last snapshot to take
+ * another, and none is being written.
+ */
+static inline int persist_snapshot_due(persist_t *persist)
+{
+    size_t used;
+    int status;
+
+    if (!persist_enabled(persist) || persist->snapshot_pid != 0)
+        return 0;
+    status = pthread_mutex_lock(&persist->lock);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    used = persist->used;
+    status = pthread_mutex_unlock(&persist->lock);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    return persist->logged + (long long)used >= persist->threshold;
+}
+
+/*
+ * Start a snapshot: begin a new log generation, then fork the child
+ * that writes it. Returns the child's pidfd, for the caller to
+ * watch, or -1 if it could not get one. Called by the thread that
+ * commits.
+ */
+static inline int persist_snapshot_start(persist_t *persist, alarm_store_t **stores, int count,
+    type_table_t *types)
+{
+    pid_t pid;
+    int i;
+
+    persist_commit(persist, 1);
+    close(persist->wal_fd);
+    persist->generation++;
+    persist_open_log(persist);
+    persist->logged = 0;
+
+    /*
+     * The child inherits the stores with no command half applied.
+     * Records logged since the commit, by other threads, are in
+     * the snapshot and numbered below its sequence number, so
+     * replay skips them in the new generation.
+     */
+    for (i = 0; i < count; i++)
+        alarm_store_lock_all(stores[i]);
+    pid = fork();
+    if (pid == 0)
+        persist_snapshot_child(persist, stores, count, types, persist->generation, persist->lsn);
+    for (i = count - 1; i >= 0; i--)
+        alarm_store_unlock_all(stores[i]);
+    if (pid == -1)
+        errno_abort ("Fork snapshot writer");
+    persist->snapshot_pid = pid;
+    persist->snapshot_generation = persist->generation;
+    persist->snapshot_fd = (int)syscall(SYS_pidfd_open, pid, 0);
+    return persist->snapshot_fd;
+}
+
+/*
+ * Collect the snapshot child. If it succeeded, install its snapshot
+ * and remove the log generations it covers. "wait" blocks until the
+ * child exits; otherwise nothing happens if it is still running.
+ */
+static inline void persist_snapshot_finish(persist_t *persist, int wait)
+{
+    char path[4096], snapshot[4096];
+    long long *generations;
+    pid_t pid;
+    int status, count, i;
+
+    if (persist->snapshot_pid == 0)
+        return;
+    do
+        pid = waitpid(persist->snapshot_pid, &status, wait ? 0 : WNOHANG);
+    while (pid == -1 && errno == EINTR);
+    if (pid == -1)
+        errno_abort ("Wait for snapshot writer");
+    if (pid == 0)
+        return;
+    persist->snapshot_pid = 0;
+    if (persist->snapshot_fd != -1)
+        close(persist->snapshot_fd);
+    persist->snapshot_fd = -1;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Snapshot failed; the log is kept\n");
+        return;
+    }
+
+    persist_path(persist, path, sizeof(path), "snapshot.tmp", -1);
+    persist_path(persist, snapshot, sizeof(snapshot), "snapshot", -1);
+    if (rename(path, snapshot) == -1)
+        errno_abort ("Install snapshot");
+    persist_sync_directory(persist);
+    generations = persist_generations(persist, &count);
+    for (i = 0; i < count && generations[i] < persist->snapshot_generation; i++) {
+        persist_path(persist, path, sizeof(path), "wal", generations[i]);
+        if (unlink(path) == -1)
+            errno_abort ("Remove log");
+    }
+    free(generations);
+}
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * slab.h
+ *
+ * A per-thread slab allocator for the fixed-size nodes of
+ * new_alarm_mutex.c (alarm_t and display_t).
+ *
+ * Each cache hands out objects of one size. Every thread that
+ * allocates from a cache gets its own pool of slabs: SLAB_SIZE
+ * blocks, aligned to their size, carved into objects. A thread
+ * allocates from, and frees its own objects to, its pool's free
+ * list without any locking. An object freed by another thread --
+ * an alarm freed by a display worker, say -- is pushed onto its
+ * owning pool's lock-free "remote" stack instead, and the owner
+ * takes the whole stack back in one exchange when its own free
+ * list runs dry. So objects always return to the slab they were
+ * carved from, and threads never contend in malloc for them.
+ *
+ * Slabs are kept once allocated, so a pool is as large as the
+ * most objects its thread ever had live at once.
+ */
+#ifndef __slab_h
+#define __slab_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include "errors.h"
+
+#define SLAB_SIZE           (64 * 1024)
+#define SLAB_HEADER         64          /* slab_t, padded to a cache line */
+#define SLAB_CACHES_MAX     8
+#define SLAB_SAMPLE         64          /* time one allocation in this many */
+
+typedef struct slab_object_tag {
+    struct slab_object_tag *next;
+} slab_object_t;
+
+typedef struct slab_tag {
+    struct slab_pool_tag *owner;
+    struct slab_tag     *next;
+} slab_t;
+
+typedef struct slab_pool_tag {
+    struct slab_cache_tag *cache;
+    slab_object_t       *free;      /* owner only */
+    _Atomic(slab_object_t *) remote;    /* freed by other threads */
+    slab_t              *slabs;     /* owner only */
+    atomic_long         slab_count;
+    atomic_long         allocs;
+    atomic_long         frees;      /* by the owner */
+    atomic_long         remote_frees;   /* by other threads */
+    atomic_long         latency_ns;     /* total over the sampled allocations */
+    atomic_long         latency_samples;
+    atomic_long         latency_max;
+    struct slab_pool_tag *next;
+} slab_pool_t;
+
+typedef struct slab_cache_tag {
+    const char          *name;
+    size_t              size;       /* object size, rounded up to 16 bytes */
+    int                 per_slab;
+    int                 index;      /* into slab_self */
+    pthread_mutex_t     lock;       /* protects the pool list */
+    slab_pool_t         *pools;
+} slab_cache_t;
+
+typedef struct slab_stats_tag {
+    long                live;       /* objects allocated and not yet freed */
+    long                capacity;   /* objects the slabs can hold */
+    long                slabs;
+    long                pools;
+    long                allocs;
+    long                remote_frees;
+    double              latency_avg_ns;
+    long                latency_max_ns;
+} slab_stats_t;
+
+static int slab_caches = 0;
+static __thread slab_pool_t *slab_self[SLAB_CACHES_MAX];
+
+static inline long long slab_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static inline void slab_cache_init(slab_cache_t *cache, const char *name, size_t size)
+{
+    int status;
+
+    if (slab_caches == SLAB_CACHES_MAX) {
+        fprintf(stderr, "Too many slab caches\n");
+        abort();
+    }
+    cache->name = name;
+    cache->size = (size + 15) & ~(size_t)15;
+    cache->per_slab = (SLAB_SIZE - SLAB_HEADER) / cache->size;
+    cache->index = slab_caches++;
+    cache->pools = NULL;
+    status = pthread_mutex_init(&cache->lock, NULL);
+    if (status != 0)
+        err_abort (status, "Init mutex");
+}
+
+/*
+ * The calling thread's pool in a cache, created on first use.
+ */
+static inline slab_pool_t *slab_pool(slab_cache_t *cache)
+{
+    slab_pool_t *pool = slab_self[cache->index];
+    int status;
+
+    if (pool != NULL)
+        return pool;
+    pool = calloc(1, sizeof(slab_pool_t));
+    if (pool == NULL)
+        errno_abort ("Allocate slab pool");
+    pool->cache = cache;
+    atomic_init(&pool->remote, NULL);
+    status = pthread_mutex_lock(&cache->lock);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    pool->next = cache->pools;
+    cache->pools = pool;
+    status = pthread_mutex_unlock(&cache->lock);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    slab_self[cache->index] = pool;
+    return pool;
+}
+
+/*
+ * Carve a new slab into the pool's free list.
+ */
+static inline void slab_grow(slab_pool_t *pool)
+{
+    slab_cache_t *cache = pool->cache;
+    slab_object_t *object;
+    slab_t *slab;
+    char *base;
+    int i;
+
+    slab = aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+    if (slab == NULL)
+        errno_abort ("Allocate slab");
+    slab->owner = pool;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    base = (char *)slab + SLAB_HEADER;
+    for (i = cache->per_slab - 1; i >= 0; i--) {
+        object = (slab_object_t *)(base + i * cache->size);
+        object->next = pool->free;
+        pool->free = object;
+    }
+    atomic_fetch_add_explicit(&pool->slab_count, 1, memory_order_relaxed);
+}
+
+static inline void *slab_alloc(slab_cache_t *cache)
+{
+    slab_pool_t *pool = slab_pool(cache);
+    slab_object_t *object;
+    long long start = 0, elapsed;
+    long count, max;
+
+    count = atomic_fetch_add_explicit(&pool->allocs, 1, memory_order_relaxed);
+    if (count % SLAB_SAMPLE == 0)
+        start = slab_now_ns();
+
+    if (pool->free == NULL)
+        pool->free = atomic_exchange_explicit(&pool->remote, NULL, memory_order_acquire);
+    if (pool->free == NULL)
+        slab_grow(pool);
+    object = pool->free;
+    pool->free = object->next;
+
+    if (start != 0) {
+        elapsed = slab_now_ns() - start;
+        atomic_fetch_add_explicit(&pool->latency_ns, elapsed, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pool->latency_samples, 1, memory_order_relaxed);
+        max = atomic_load_explicit(&pool->latency_max, memory_order_relaxed);
+        if (elapsed > max)
+            atomic_store_explicit(&pool->latency_max, elapsed, memory_order_relaxed);
+    }
+    return object;
+}
+
+/*
+ * Return an object to the pool it was allocated from, by any
+ * thread.
+ */
+static inline void slab_free(void *pointer)
+{
+    slab_object_t *object = pointer, *head;
+    slab_t *slab;
+    slab_pool_t *pool;
+
+    if (object == NULL)
+        return;
+    slab = (slab_t *)((uintptr_t)object & ~(uintptr_t)(SLAB_SIZE - 1));
+    pool = slab->owner;
+    if (slab_self[pool->cache->index] == pool) {
+        object->next = pool->free;
+        pool->free = object;
+        atomic_fetch_add_explicit(&pool->frees, 1, memory_order_relaxed);
+        return;
+    }
+
+    //only the owner ever takes from the remote stack, and it takes all of it, so there is no ABA
+    head = atomic_load_explicit(&pool->remote, memory_order_relaxed);
+    do
+        object->next = head;
+    while (!atomic_compare_exchange_weak_explicit(&pool->remote, &head, object,
+            memory_order_release, memory_order_relaxed));
+    atomic_fetch_add_explicit(&pool->remote_frees, 1, memory_order_relaxed);
+}
+
+/*
+ * Add up the counters of every pool in a cache.
+ */
+static inline void slab_cache_stats(slab_cache_t *cache, slab_stats_t *stats)
+{
+    slab_pool_t *pool;
+    long samples = 0, latency = 0, max;
+    int status;
+
+    memset(stats, 0, sizeof(*stats));
+    status = pthread_mutex_lock(&cache->lock);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    for (pool = cache->pools; pool != NULL; pool = pool->next) {
+        stats->pools++;
+        stats->slabs += atomic_load_explicit(&pool->slab_count, memory_order_relaxed);
+        stats->allocs += atomic_load_explicit(&pool->allocs, memory_order_relaxed);
+        stats->remote_frees += atomic_load_explicit(&pool->remote_frees, memory_order_relaxed);
+        stats->live += atomic_load_explicit(&pool->allocs, memory_order_relaxed)
+            - atomic_load_explicit(&pool->frees, memory_order_relaxed)
+            - atomic_load_explicit(&pool->remote_frees, memory_order_relaxed);
+        latency += atomic_load_explicit(&pool->latency_ns, memory_order_relaxed);
+        samples += atomic_load_explicit(&pool->latency_samples, memory_order_relaxed);
+        max = atomic_load_explicit(&pool->latency_max, memory_order_relaxed);
+        if (max > stats->latency_max_ns)
+            stats->latency_max_ns = max;
+    }
+    status = pthread_mutex_unlock(&cache->lock);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    stats->capacity = stats->slabs * cache->per_slab;
+    stats->latency_avg_ns = samples ? (double)latency / samples : 0;
+}
+
+#endif
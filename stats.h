@@ -0,0 +1,213 @@
+/*
+ * stats.h
+ *
+ * Runtime statistics for new_alarm_mutex.c: event counters, and
+ * histograms of lock wait and hold times, expiry sweep times and
+ * alarm lateness.
+ *
+ * Every thread that records anything gets its own stats_block_t,
+ * registered on first use, and only ever writes to its own block,
+ * so recording is a plain load and store with no shared cache line
+ * and no lock. A reader adds the blocks of all threads together;
+ * the sums it sees may be a few events behind, never torn.
+ *
+ * Histograms have one bucket per power of two nanoseconds. Lock
+ * times are sampled, one acquisition in STATS_SAMPLE per thread, to
+ * keep the two extra clock reads off most lock operations.
+ */
+#ifndef __stats_h
+#define __stats_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "errors.h"
+
+#define STATS_BUCKETS       40      /* up to 2^40 ns, about 18 minutes */
+#define STATS_SAMPLE        16      /* time one lock acquisition in this many */
+
+#define STATS_ALARM_WAIT    0       /* alarm shard locks */
+#define STATS_ALARM_HOLD    1
+#define STATS_DISPLAY_WAIT  2       /* display shard locks */
+#define STATS_DISPLAY_HOLD  3
+#define STATS_PERIODIC_WAIT 4       /* each scheduler's periodic lock */
+#define STATS_PERIODIC_HOLD 5
+#define STATS_SWEEP         6       /* one expiry sweep */
+#define STATS_LATENESS      7       /* expiry time past an alarm's deadline */
+#define STATS_HISTOGRAMS    8
+
+#define STATS_COMMANDS      0       /* commands carried out */
+#define STATS_BAD_COMMANDS  1
+#define STATS_EXPIRED       2       /* alarms removed by the expiry sweep */
+#define STATS_COUNTERS      3
+
+typedef struct stats_histogram_tag {
+    atomic_long         bucket[STATS_BUCKETS];
+    atomic_long         count;
+    atomic_long         sum;
+    atomic_long         max;
+} stats_histogram_t;
+
+typedef struct stats_block_tag {
+    stats_histogram_t   histogram[STATS_HISTOGRAMS];
+    atomic_long         counter[STATS_COUNTERS];
+    unsigned int        ticket;     /* for sampling */
+    struct stats_block_tag *next;
+} stats_block_t;
+
+/*
+ * The sum of every thread's block.
+ */
+typedef struct stats_snapshot_tag {
+    long                bucket[STATS_HISTOGRAMS][STATS_BUCKETS];
+    long                count[STATS_HISTOGRAMS];
+    long                sum[STATS_HISTOGRAMS];
+    long                max[STATS_HISTOGRAMS];
+    long                counter[STATS_COUNTERS];
+} stats_snapshot_t;
+
+static _Atomic(stats_block_t *) stats_blocks = NULL;
+static __thread stats_block_t *stats_self = NULL;
+
+static inline long long stats_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static inline stats_block_t *stats_block(void)
+{
+    stats_block_t *block = stats_self;
+
+    if (block != NULL)
+        return block;
+    block = calloc(1, sizeof(stats_block_t));
+    if (block == NULL)
+        errno_abort ("Allocate stats block");
+    block->next = atomic_load(&stats_blocks);
+    while (!atomic_compare_exchange_weak(&stats_blocks, &block->next, block))
+        ;
+    stats_self = block;
+    return block;
+}
+
+/*
+ * Add to a counter or histogram of the calling thread's block,
+ * which no other thread writes.
+ */
+static inline void stats_bump(atomic_long *value, long amount)
+{
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + amount,
+        memory_order_relaxed);
+}
+
+static inline void stats_count(int counter, long amount)
+{
+    stats_bump(&stats_block()->counter[counter], amount);
+}
+
+static inline void stats_record(int histogram, long long ns)
+{
+    stats_histogram_t *h = &stats_block()->histogram[histogram];
+    int bucket;
+
+    if (ns < 0)
+        ns = 0;
+    bucket = ns > 0 ? 63 - __builtin_clzll((unsigned long long)ns) : 0;
+    if (bucket >= STATS_BUCKETS)
+        bucket = STATS_BUCKETS - 1;
+    stats_bump(&h->bucket[bucket], 1);
+    stats_bump(&h->count, 1);
+    stats_bump(&h->sum, (long)ns);
+    if (ns > atomic_load_explicit(&h->max, memory_order_relaxed))
+        atomic_store_explicit(&h->max, (long)ns, memory_order_relaxed);
+}
+
+/*
+ * Whether to time this lock acquisition.
+ */
+static inline int stats_sampled(void)
+{
+    return stats_block()->ticket++ % STATS_SAMPLE == 0;
+}
+
+/*
+ * Lock a mutex, timing the wait if this acquisition is sampled.
+ * Returns the time it was acquired, or 0 if not sampled; the holder
+ * keeps it for stats_unlock to time the hold.
+ */
+static inline long long stats_lock(pthread_mutex_t *mutex, int wait_histogram)
+{
+    long long start = stats_sampled() ? stats_now_ns() : 0, now;
+    int status;
+
+    status = pthread_mutex_lock(mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    if (start == 0)
+        return 0;
+    now = stats_now_ns();
+    stats_record(wait_histogram, now - start);
+    return now;
+}
+
+static inline void stats_unlock(pthread_mutex_t *mutex, int hold_histogram, long long locked_at)
+{
+    int status;
+
+    if (locked_at != 0)
+        stats_record(hold_histogram, stats_now_ns() - locked_at);
+    status = pthread_mutex_unlock(mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+static inline void stats_collect(stats_snapshot_t *snapshot)
+{
+    stats_block_t *block;
+    long max;
+    int h, b, c;
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    for (block = atomic_load(&stats_blocks); block != NULL; block = block->next) {
+        for (h = 0; h < STATS_HISTOGRAMS; h++) {
+            for (b = 0; b < STATS_BUCKETS; b++)
+                snapshot->bucket[h][b] += atomic_load_explicit(&block->histogram[h].bucket[b], memory_order_relaxed);
+            snapshot->count[h] += atomic_load_explicit(&block->histogram[h].count, memory_order_relaxed);
+            snapshot->sum[h] += atomic_load_explicit(&block->histogram[h].sum, memory_order_relaxed);
+            max = atomic_load_explicit(&block->histogram[h].max, memory_order_relaxed);
+            if (max > snapshot->max[h])
+                snapshot->max[h] = max;
+        }
+        for (c = 0; c < STATS_COUNTERS; c++)
+            snapshot->counter[c] += atomic_load_explicit(&block->counter[c], memory_order_relaxed);
+    }
+}
+
+/*
+ * An upper bound on the given fraction of a histogram's values: the
+ * top of the bucket that value falls in, but no more than the
+ * largest value seen.
+ */
+static inline long stats_percentile(stats_snapshot_t *snapshot, int histogram, double fraction)
+{
+    long target = (long)(fraction * snapshot->count[histogram] + 0.5), seen = 0;
+    int b;
+
+    if (snapshot->count[histogram] == 0)
+        return 0;
+    if (target < 1)
+        target = 1;
+    for (b = 0; b < STATS_BUCKETS; b++) {
+        seen += snapshot->bucket[histogram][b];
+        if (seen >= target)
+            break;
+    }
+    if (b >= STATS_BUCKETS - 1 || (2L << b) - 1 > snapshot->max[histogram])
+        return snapshot->max[histogram];
+    return (2L << b) - 1;
+}
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * type_intern.h
+ *
+ * Interning of alarm types for new_alarm_mutex.c. Each distinct
+ * type string is given a small integer id the first time it is
+ * seen, so that alarms and display threads store, compare and
+ * index by an int instead of a 128-byte string.
+ *
+ * Interning is done by the command reader, under a mutex, through
+ * an open-addressing hash table. Looking a name up by id takes no
+ * lock at all: names live in fixed chunks that never move, and a
+ * new id is published only after its name is in place. Types are
+ * never forgotten, so the table holds every type ever used.
+ */
+#ifndef __type_intern_h
+#define __type_intern_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "errors.h"
+
+#define TYPE_CHUNK          1024    /* names per chunk */
+#define TYPE_CHUNKS         1024    /* so at most a million types */
+
+typedef struct type_table_tag {
+    pthread_mutex_t     lock;       /* protects the hash table and interning */
+    int                 *slots;     /* type id + 1, 0 if empty */
+    int                 capacity;   /* always a power of two */
+    atomic_int          count;      /* ids handed out */
+    char                **names[TYPE_CHUNKS];
+} type_table_t;
+
+static inline unsigned int type_hash(const char *name)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*name != '\0')
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    return hash;
+}
+
+static inline void type_table_init(type_table_t *table)
+{
+    int status;
+
+    memset(table, 0, sizeof(*table));
+    status = pthread_mutex_init(&table->lock, NULL);
+    if (status != 0)
+        err_abort (status, "Init mutex");
+}
+
+/*
+ * The name of an interned type. Safe from any thread, for any id
+ * it has been given.
+ */
+static inline const char *type_name(type_table_t *table, int id)
+{
+    return table->names[id / TYPE_CHUNK][id % TYPE_CHUNK];
+}
+
+static inline void type_place(type_table_t *table, int id)
+{
+    unsigned int slot = type_hash(type_name(table, id)) & (table->capacity - 1);
+
+    while (table->slots[slot] != 0)
+        slot = (slot + 1) & (table->capacity - 1);
+    table->slots[slot] = id + 1;
+}
+
+/*
+ * The id of a type, interning it if it is new.
+ */
+static inline int type_intern(type_table_t *table, const char *name)
+{
+    unsigned int slot;
+    int status, id, count, i;
+    char *copy;
+
+    status = pthread_mutex_lock(&table->lock);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    count = atomic_load_explicit(&table->count, memory_order_relaxed);
+    if (table->capacity > 0) {
+        for (slot = type_hash(name) & (table->capacity - 1);
+             table->slots[slot] != 0;
+             slot = (slot + 1) & (table->capacity - 1)) {
+            id = table->slots[slot] - 1;
+            if (strcmp(type_name(table, id), name) == 0)
+                goto found;
+        }
+    }
+
+    id = count;
+    if (id == TYPE_CHUNK * TYPE_CHUNKS) {
+        fprintf(stderr, "Too many alarm types\n");
+        abort();
+    }
+    if (table->names[id / TYPE_CHUNK] == NULL) {
+        table->names[id / TYPE_CHUNK] = calloc(TYPE_CHUNK, sizeof(char *));
+        if (table->names[id / TYPE_CHUNK] == NULL)
+            errno_abort ("Allocate type names");
+    }
+    copy = strdup(name);
+    if (copy == NULL)
+        errno_abort ("Allocate type name");
+    table->names[id / TYPE_CHUNK][id % TYPE_CHUNK] = copy;
+    atomic_store_explicit(&table->count, count + 1, memory_order_release);
+
+    //keep the table at most half full
+    if ((count + 1) * 2 > table->capacity) {
+        free(table->slots);
+        table->capacity = table->capacity ? table->capacity * 2 : 64;
+        table->slots = calloc(table->capacity, sizeof(int));
+        if (table->slots == NULL)
+            errno_abort ("Allocate type table");
+        for (i = 0; i <= id; i++)
+            type_place(table, i);
+    } else
+        type_place(table, id);
+
+found:
+    status = pthread_mutex_unlock(&table->lock);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    return id;
+}
+
+#endif